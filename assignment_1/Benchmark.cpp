@@ -0,0 +1,379 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <argparse/argparse.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "SharedDatabase.hpp"
+#include "StudentInfo.h"
+
+// Forks reader and writer processes against one database and reports the
+// throughput and latency of their get()s and set()s, for every combination of
+// table size and reader/writer mix asked for. Prints one CSV row (or JSON
+// object) per role per run, so results can be compared between builds.
+
+namespace {
+
+constexpr int BENCH_DB_ID = 900;
+const std::string BENCH_PASSWORD = "benchmark";
+
+struct Mix {
+  int readers;
+  int writers;
+};
+
+struct Result {
+  size_t size;
+  Mix mix;
+  std::string role;
+  std::vector<uint64_t> latencies;
+};
+
+std::vector<std::string> split(const std::string &list, char separator) {
+  std::vector<std::string> parts;
+  std::istringstream in(list);
+  std::string part;
+  while (std::getline(in, part, separator)) {
+    if (!part.empty()) {
+      parts.push_back(part);
+    }
+  }
+  return parts;
+}
+
+void writeAll(int fd, const void *data, size_t bytes) {
+  auto bytesOut = static_cast<const char *>(data);
+  while (bytes > 0) {
+    auto written = write(fd, bytesOut, bytes);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              "Failed to write results");
+    }
+    bytesOut += written;
+    bytes -= written;
+  }
+}
+
+// Reads exactly bytes bytes, returning false if the other end closed first
+bool readAll(int fd, void *data, size_t bytes) {
+  auto bytesIn = static_cast<char *>(data);
+  while (bytes > 0) {
+    auto got = read(fd, bytesIn, bytes);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    bytesIn += got;
+    bytes -= got;
+  }
+  return true;
+}
+
+// The body of a worker process. Opens its own handle on the database, says
+// it's ready, waits for the go signal (a byte on goFd, or it closing without
+// one if the run is being abandoned), then reads or writes random entries
+// until the time is up and sends back how long each one took.
+[[noreturn]] void runWorker(bool writer, unsigned seed, size_t size,
+                            const SharedDatabaseOptions &options,
+                            std::chrono::milliseconds duration, int readyFd,
+                            int goFd, int resultFd) {
+  try {
+    auto password = BENCH_PASSWORD;
+    SharedDatabase<StudentInfo> db(password, BENCH_DB_ID, options);
+    std::mt19937_64 gen(seed);
+    std::uniform_int_distribution<size_t> pick(0, size - 1);
+    StudentInfo student{};
+    std::strncpy(student.name, "Benchmark", sizeof(student.name) - 1);
+    std::vector<uint64_t> latencies;
+    latencies.reserve(1 << 20);
+
+    char byte = 0;
+    writeAll(readyFd, &byte, 1);
+    // otherwise the parent can't see the pipe close if another worker dies
+    close(readyFd);
+    if (!readAll(goFd, &byte, 1)) {
+      _exit(1);
+    }
+
+    auto end = std::chrono::steady_clock::now() + duration;
+    int checksum = 0;
+    while (true) {
+      auto start = std::chrono::steady_clock::now();
+      if (start >= end) {
+        break;
+      }
+      auto index = pick(gen);
+      if (writer) {
+        student.id = static_cast<int>(index);
+        db.set(index, student);
+      } else {
+        checksum += db.get(index).id;
+      }
+      latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count());
+    }
+    // keep the reads from being optimized away
+    if (checksum == -1) {
+      std::cerr << checksum << std::endl;
+    }
+
+    uint64_t count = latencies.size();
+    writeAll(resultFd, &count, sizeof(count));
+    writeAll(resultFd, latencies.data(), count * sizeof(uint64_t));
+    _exit(0);
+  } catch (const std::exception &err) {
+    std::cerr << "Worker failed: " << err.what() << std::endl;
+    _exit(1);
+  }
+}
+
+// Runs one size/mix combination and returns the reader and writer results
+std::vector<Result> runOnce(size_t size, Mix mix,
+                            SharedDatabaseOptions options,
+                            std::chrono::milliseconds duration) {
+  auto password = BENCH_PASSWORD;
+  options.clean = true;
+  options.capacity = size;
+  SharedDatabase<StudentInfo> db(password, BENCH_DB_ID, options);
+  std::vector<StudentInfo> students(size);
+  for (size_t i = 0; i < size; i++) {
+    students[i].id = static_cast<int>(i);
+    std::snprintf(students[i].name, sizeof(students[i].name), "Student %zu",
+                  i);
+  }
+  db.push_back_bulk(students);
+  options.clean = false;
+
+  int ready[2], go[2];
+  if (pipe(ready) == -1 || pipe(go) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to create pipes");
+  }
+  struct Worker {
+    pid_t pid;
+    bool writer;
+    int resultFd;
+  };
+  std::vector<Worker> workers;
+  for (int i = 0; i < mix.readers + mix.writers; i++) {
+    bool writer = i >= mix.readers;
+    int result[2];
+    if (pipe(result) == -1) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Failed to create pipes");
+    }
+    auto pid = fork();
+    if (pid == -1) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Failed to fork worker");
+    }
+    if (pid == 0) {
+      close(ready[0]);
+      close(go[1]);
+      close(result[0]);
+      runWorker(writer, 12345 + i, size, options, duration, ready[1], go[0],
+                result[1]);
+    }
+    close(result[1]);
+    workers.push_back({pid, writer, result[0]});
+  }
+  close(ready[1]);
+  close(go[0]);
+
+  // start everyone at once, after they've all attached. If one dies first,
+  // the rest are told to give up instead of waiting forever
+  std::vector<char> bytes(workers.size());
+  for (size_t i = 0; i < workers.size(); i++) {
+    if (!readAll(ready[0], bytes.data(), 1)) {
+      close(go[1]);
+      close(ready[0]);
+      for (auto &worker : workers) {
+        close(worker.resultFd);
+        waitpid(worker.pid, nullptr, 0);
+      }
+      throw std::runtime_error("A worker failed to start");
+    }
+  }
+  writeAll(go[1], bytes.data(), bytes.size());
+  close(go[1]);
+  close(ready[0]);
+
+  std::vector<Result> results = {{size, mix, "read", {}},
+                                 {size, mix, "write", {}}};
+  bool failed = false;
+  for (auto &worker : workers) {
+    uint64_t count = 0;
+    auto &latencies = results[worker.writer ? 1 : 0].latencies;
+    if (readAll(worker.resultFd, &count, sizeof(count))) {
+      auto start = latencies.size();
+      latencies.resize(start + count);
+      failed |= !readAll(worker.resultFd, latencies.data() + start,
+                         count * sizeof(uint64_t));
+    } else {
+      failed = true;
+    }
+    close(worker.resultFd);
+    int status;
+    waitpid(worker.pid, &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  if (failed) {
+    throw std::runtime_error("A worker failed");
+  }
+  results.erase(std::remove_if(results.begin(), results.end(),
+                               [](const Result &result) {
+                                 return result.latencies.empty();
+                               }),
+                results.end());
+  return results;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double fraction) {
+  auto index = static_cast<size_t>(fraction * sorted.size());
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void printResult(Result &result, std::chrono::milliseconds duration,
+                 const std::string &format) {
+  auto &latencies = result.latencies;
+  std::sort(latencies.begin(), latencies.end());
+  auto opsPerSec = static_cast<uint64_t>(latencies.size() * 1000.0 /
+                                         duration.count());
+  if (format == "json") {
+    std::cout << "{\"size\": " << result.size
+              << ", \"readers\": " << result.mix.readers
+              << ", \"writers\": " << result.mix.writers << ", \"role\": \""
+              << result.role << "\", \"ops\": " << latencies.size()
+              << ", \"ops_per_sec\": " << opsPerSec
+              << ", \"p50_ns\": " << percentile(latencies, 0.5)
+              << ", \"p99_ns\": " << percentile(latencies, 0.99)
+              << ", \"p999_ns\": " << percentile(latencies, 0.999)
+              << ", \"max_ns\": " << latencies.back() << "}" << std::endl;
+  } else {
+    std::cout << result.size << "," << result.mix.readers << ","
+              << result.mix.writers << "," << result.role << ","
+              << latencies.size() << "," << opsPerSec << ","
+              << percentile(latencies, 0.5) << ","
+              << percentile(latencies, 0.99) << ","
+              << percentile(latencies, 0.999) << "," << latencies.back()
+              << std::endl;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  argparse::ArgumentParser program("assignment_1_bench");
+  program.add_argument("--sizes")
+      .help("comma separated numbers of students to run with")
+      .default_value(std::string("1000,100000"));
+  program.add_argument("--mixes")
+      .help(
+          "comma separated readers:writers process counts to run with, e.g. "
+          "4:0,2:2")
+      .default_value(std::string("4:0,3:1,2:2,1:3"));
+  program.add_argument("--duration")
+      .help("milliseconds to run each combination for")
+      .default_value(1000)
+      .scan<'i', int>();
+  program.add_argument("--format")
+      .help("output format: csv or json (one object per line)")
+      .default_value(std::string("csv"));
+  program.add_argument("--stripes")
+      .help("number of lock stripes to create the database with")
+      .default_value(0)
+      .scan<'i', int>();
+  program.add_argument("--optimistic")
+      .help("have the readers use optimistic reads")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--versioned")
+      .help("create the database with multi-version snapshots")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--huge-pages")
+      .help("create the database with huge pages, if there are any free")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--interleave")
+      .help("interleave the database over every NUMA node")
+      .default_value(false)
+      .implicit_value(true);
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::runtime_error &err) {
+    std::cout << err.what() << std::endl;
+    std::cout << program;
+    exit(1);
+  }
+
+  auto format = program.get<std::string>("--format");
+  if (format != "csv" && format != "json") {
+    std::cerr << "Unknown format: " << format << std::endl;
+    exit(1);
+  }
+  std::chrono::milliseconds duration(program.get<int>("--duration"));
+  std::vector<size_t> sizes;
+  std::vector<Mix> mixes;
+  try {
+    for (const auto &size : split(program.get<std::string>("--sizes"), ',')) {
+      sizes.push_back(std::stoul(size));
+      if (sizes.back() == 0) {
+        throw std::invalid_argument("Sizes must be at least 1");
+      }
+    }
+    for (const auto &mix : split(program.get<std::string>("--mixes"), ',')) {
+      auto counts = split(mix, ':');
+      if (counts.size() != 2) {
+        throw std::invalid_argument("Bad mix: " + mix);
+      }
+      mixes.push_back({std::stoi(counts[0]), std::stoi(counts[1])});
+    }
+  } catch (const std::logic_error &err) {
+    std::cerr << err.what() << std::endl;
+    exit(1);
+  }
+
+  SharedDatabaseOptions options;
+  options.semTimeout = 30s;
+  options.lockStripes = program.get<int>("--stripes");
+  options.optimisticReads = program.get<bool>("--optimistic");
+  options.multiVersion = program.get<bool>("--versioned");
+  options.hugePages = program.get<bool>("--huge-pages");
+  if (program.get<bool>("--interleave")) {
+    options.numaPolicy = NumaPolicy::INTERLEAVE;
+  }
+
+  if (format == "csv") {
+    std::cout << "size,readers,writers,role,ops,ops_per_sec,p50_ns,p99_ns,"
+                 "p999_ns,max_ns"
+              << std::endl;
+  }
+  for (auto size : sizes) {
+    for (auto mix : mixes) {
+      try {
+        for (auto &result : runOnce(size, mix, options, duration)) {
+          printResult(result, duration, format);
+        }
+      } catch (const std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        exit(1);
+      }
+    }
+  }
+}
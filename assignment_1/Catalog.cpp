@@ -0,0 +1,203 @@
+#include "Catalog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+namespace {
+
+// shm_open() names need a leading slash
+std::string objectName(const std::string &name) {
+  return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+// A creator that died before it recorded its pid can't be told from a slow
+// one, so that's left to whoever reads this
+std::string timedOut(const std::string &object) {
+  return "Timed out waiting for catalog: " + object +
+         " (if the process creating it died, remove it with Catalog::unlink()"
+         " or from /dev/shm)";
+}
+
+}  // namespace
+
+Catalog::Catalog(const std::string &name, std::chrono::milliseconds timeout)
+    : timeout_(timeout) {
+  auto object = objectName(name);
+  bool created = true;
+  int fd = shm_open(object.c_str(), O_RDWR | O_CREAT | O_EXCL,
+                    S_IRUSR | S_IWUSR);
+  if (fd == -1 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(object.c_str(), O_RDWR, 0);
+  }
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to open catalog: " + object);
+  }
+
+  // the creator may still be setting the catalog up, so openers wait for it
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  auto waitFor = [&](auto done) {
+    while (!done()) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for(1ms);
+    }
+    return true;
+  };
+
+  if (created) {
+    if (ftruncate(fd, sizeof(CatalogState)) == -1) {
+      auto error = errno;
+      close(fd);
+      shm_unlink(object.c_str());
+      throw std::system_error(error, std::generic_category(),
+                              "Failed to size catalog: " + object);
+    }
+  } else if (!waitFor([fd] {
+               // mapping it before it's sized would fault on first touch
+               struct stat objectStat {};
+               return fstat(fd, &objectStat) == 0 &&
+                      objectStat.st_size >=
+                          static_cast<off_t>(sizeof(CatalogState));
+             })) {
+    close(fd);
+    throw std::runtime_error(timedOut(object));
+  }
+
+  auto address = mmap(nullptr, sizeof(CatalogState), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  auto error = errno;
+  close(fd);
+  if (address == MAP_FAILED) {
+    throw std::system_error(error, std::generic_category(),
+                            "Failed to map catalog: " + object);
+  }
+  state_ = static_cast<CatalogState *>(address);
+
+  auto initialize = [this] {
+    initRWLock(&state_->lock);
+    state_->version = CATALOG_VERSION;
+    state_->ready.store(1);
+  };
+  if (created) {
+    state_->creator.store(getpid());
+    initialize();
+  } else if (!waitFor([&] {
+               if (state_->ready.load() != 0) {
+                 return true;
+               }
+               // a creator that died part way would keep everyone waiting
+               // for good, so one opener finishes for it
+               auto creator = state_->creator.load();
+               if (creator != 0 && !processAlive(creator) &&
+                   state_->creator.compare_exchange_strong(creator,
+                                                           getpid())) {
+                 initialize();
+                 return true;
+               }
+               return false;
+             })) {
+    munmap(state_, sizeof(CatalogState));
+    throw std::runtime_error(timedOut(object));
+  }
+  if (state_->version != CATALOG_VERSION) {
+    munmap(state_, sizeof(CatalogState));
+    throw std::runtime_error("Catalog version mismatch");
+  }
+}
+
+Catalog::~Catalog() { munmap(state_, sizeof(CatalogState)); }
+
+std::shared_ptr<SharedRWLock> Catalog::readLock() const {
+  return acquireReadLock(&state_->lock, timeout_);
+}
+
+std::shared_ptr<SharedRWLock> Catalog::writeLock() const {
+  return acquireWriteLock(&state_->lock, timeout_);
+}
+
+int Catalog::find(const std::string &table) {
+  auto found = entry(table);
+  if (found == nullptr) {
+    return -1;
+  }
+  struct shmid_ds segment {};
+  if (shmctl(found->metadataSegment, IPC_STAT, &segment) == -1 ||
+      (segment.shm_perm.mode & SHM_DEST) != 0) {
+    found->used = false;
+    return -1;
+  }
+  return found->metadataSegment;
+}
+
+int Catalog::add(const std::string &table, size_t metadataBytes) {
+  if (table.empty() || table.size() >= MAX_TABLE_NAME) {
+    throw std::invalid_argument("Invalid table name: " + table);
+  }
+  if (entry(table) != nullptr) {
+    throw std::invalid_argument("Table already exists: " + table);
+  }
+  CatalogTable *free = nullptr;
+  for (auto &candidate : state_->tables) {
+    if (!candidate.used) {
+      free = &candidate;
+      break;
+    }
+  }
+  if (free == nullptr) {
+    throw std::out_of_range("Catalog is full");
+  }
+  auto segment = shmget(IPC_PRIVATE, metadataBytes,
+                        IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+  if (segment == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Creating database metadata shared memory "
+                            "segment failed");
+  }
+  std::memset(free->name, 0, sizeof(free->name));
+  std::memcpy(free->name, table.data(), table.size());
+  free->metadataSegment = segment;
+  free->used = true;
+  return segment;
+}
+
+void Catalog::remove(const std::string &table) {
+  if (auto found = entry(table)) {
+    found->used = false;
+  }
+}
+
+std::vector<std::string> Catalog::tables() const {
+  auto lock = readLock();
+  std::vector<std::string> names;
+  for (const auto &table : state_->tables) {
+    if (table.used) {
+      names.emplace_back(table.name);
+    }
+  }
+  return names;
+}
+
+void Catalog::unlink(const std::string &name) {
+  shm_unlink(objectName(name).c_str());
+}
+
+CatalogTable *Catalog::entry(const std::string &table) {
+  for (auto &candidate : state_->tables) {
+    if (candidate.used && table == candidate.name) {
+      return &candidate;
+    }
+  }
+  return nullptr;
+}
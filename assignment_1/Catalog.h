@@ -0,0 +1,91 @@
+#ifndef ASSIGNMENT_1_CATALOG_H
+#define ASSIGNMENT_1_CATALOG_H
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Utilities.h"
+
+// Most tables a catalog can hold
+constexpr static size_t MAX_CATALOG_TABLES = 64;
+// Longest table name, including the null
+constexpr static size_t MAX_TABLE_NAME = 64;
+constexpr static uint32_t CATALOG_VERSION = 2;
+// The catalog databases are opened in unless another is given
+const std::string DEFAULT_CATALOG = "/shared_database_catalog";
+
+struct CatalogTable {
+  bool used;
+  char name[MAX_TABLE_NAME];
+  // the SysV id of the table's metadata segment
+  int metadataSegment;
+};
+
+struct CatalogState {
+  // set once the creator has finished initializing the rest
+  std::atomic<uint32_t> ready;
+  uint32_t version;
+  // the pid of whoever is initializing it, so if they die first an opener can
+  // take over
+  std::atomic<pid_t> creator;
+  // Must be read-locked to look tables up and write-locked to add or remove
+  // them
+  SharedRWLock lock;
+  CatalogTable tables[MAX_CATALOG_TABLES];
+};
+
+// A directory from table names to the segments of the SharedDatabases holding
+// them, in a POSIX shared memory object. Unlike ftok() keys, names don't
+// depend on the working directory or collide between tables, and a process
+// attaches the catalog once however many tables it opens. The catalog only
+// finds tables; each one still has its own metadata and data segments.
+class Catalog {
+ public:
+  explicit Catalog(const std::string &name = DEFAULT_CATALOG,
+                   std::chrono::milliseconds timeout = 5s);
+  ~Catalog();
+
+  Catalog(const Catalog &) = delete;
+  Catalog &operator=(const Catalog &) = delete;
+
+  // Locks the catalog. Tables are added and removed with the write lock held,
+  // so nobody sees one half made or half dropped.
+  [[nodiscard]] std::shared_ptr<SharedRWLock> readLock() const;
+  [[nodiscard]] std::shared_ptr<SharedRWLock> writeLock() const;
+
+  // Returns the metadata segment of the named table, or -1 if there isn't
+  // one. Forgets tables whose segment has been removed from outside, e.g. by
+  // ipcrm. Must be called with the write lock held.
+  [[nodiscard]] int find(const std::string &table);
+
+  // Creates a zero-filled metadata segment for a new table and records it.
+  // Throws if the name is taken or too long, or the catalog is full. Must be
+  // called with the write lock held.
+  int add(const std::string &table, size_t metadataBytes);
+
+  // Forgets the named table, without removing its segments. Must be called
+  // with the write lock held.
+  void remove(const std::string &table);
+
+  // Returns the names of the tables in the catalog
+  [[nodiscard]] std::vector<std::string> tables() const;
+
+  // Removes the named catalog. Processes that have it open keep using it, and
+  // its tables aren't dropped.
+  static void unlink(const std::string &name = DEFAULT_CATALOG);
+
+ private:
+  CatalogState *state_;
+  std::chrono::milliseconds timeout_;
+
+  [[nodiscard]] CatalogTable *entry(const std::string &table);
+};
+
+#endif  // ASSIGNMENT_1_CATALOG_H
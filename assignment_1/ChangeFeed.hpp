@@ -0,0 +1,209 @@
+#ifndef ASSIGNMENT_1_CHANGEFEED_HPP
+#define ASSIGNMENT_1_CHANGEFEED_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Utilities.h"
+
+// What happened to a database, as reported by SharedDatabase::subscribe()
+enum class ChangeOp : uint32_t {
+  // an entry was added at index
+  ADDED = 1,
+  // the entry at index was replaced or changed in place
+  CHANGED,
+  // the entry at index was erased. Without tombstones, every entry after it
+  // moves down by one
+  ERASED,
+  // every entry was erased
+  CLEARED,
+  // compact() moved entries, so any index may have changed
+  COMPACTED,
+  // the subscriber fell so far behind that changes were overwritten before it
+  // read them, so it has to look at the whole database again
+  OVERRUN,
+};
+
+struct ChangeEvent {
+  ChangeOp op;
+  size_t index;
+  // the entry's key if it is an integer, or its hash if it isn't. 0 if the
+  // database isn't indexed or the change isn't to a single entry
+  uint64_t key;
+  // position of the change in the feed
+  uint64_t sequence;
+};
+
+// A change as stored in the ring. The fields are atomics because readers copy
+// them while they may be being overwritten, and then check sequence to see
+// whether they were.
+struct ChangeRecord {
+  // sequence of the change plus one (so 0 is never written), with
+  // CHANGE_WRITING set while the fields are being written
+  std::atomic<uint64_t> sequence;
+  std::atomic<uint32_t> op;
+  std::atomic<uint64_t> index;
+  std::atomic<uint64_t> key;
+};
+
+// The part of a change feed shared by every process, which lives in the
+// database metadata
+struct ChangeFeedState {
+  // sequence the next change will get
+  std::atomic<uint64_t> head;
+  // bumped after every change, for subscribers to sleep on
+  std::atomic<uint32_t> wake;
+  // number of subscribers sleeping on wake, so writers only make the wake
+  // syscall when someone is listening
+  std::atomic<uint32_t> sleepers;
+};
+
+constexpr static uint64_t CHANGE_WRITING = 1ull << 63;
+
+// A broadcast ring buffer of the most recent changes to a database, operating
+// on a record array owned by someone else. Writers claim a sequence with a
+// single fetch_add and never wait for each other or for subscribers, who each
+// keep their own cursor and read without taking any lock. A subscriber that
+// falls more than a ring behind gets an OVERRUN instead of the changes it
+// missed. The number of records must be a power of two.
+class ChangeFeed {
+ public:
+  ChangeFeed(ChangeRecord *records, std::size_t numRecords,
+             ChangeFeedState *state)
+      : records_(records), numRecords_(numRecords), state_(state) {}
+
+  // Returns the number of records needed to keep at least the given number of
+  // changes
+  static std::size_t recordsFor(std::size_t changes) {
+    std::size_t records = 64;
+    while (records < changes) {
+      records <<= 1;
+    }
+    return records;
+  }
+
+  // Initializes the shared state for a new feed, whose records are zeroed
+  static void init(ChangeFeedState *state) {
+    state->head.store(0);
+    state->wake.store(0);
+    state->sleepers.store(0);
+  }
+
+  // Cleans up after processes that died using a feed that nobody has open any
+  // more. Changes they were halfway through writing become OVERRUNs.
+  void recover() {
+    for (std::size_t i = 0; i < numRecords_; i++) {
+      auto sequence = records_[i].sequence.load();
+      if (sequence & CHANGE_WRITING) {
+        records_[i].op.store(static_cast<uint32_t>(ChangeOp::OVERRUN));
+        records_[i].sequence.store(sequence & ~CHANGE_WRITING);
+      }
+    }
+    state_->sleepers.store(0);
+  }
+
+  // Adds a change to the ring and wakes any sleeping subscribers
+  void publish(ChangeOp op, uint64_t index, uint64_t key) {
+    auto sequence = state_->head.fetch_add(1);
+    auto &record = records_[sequence & (numRecords_ - 1)];
+    // a seqlock write, so readers can tell if they copied a torn record
+    record.sequence.store((sequence + 1) | CHANGE_WRITING,
+                          std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.op.store(static_cast<uint32_t>(op), std::memory_order_relaxed);
+    record.index.store(index, std::memory_order_relaxed);
+    record.key.store(key, std::memory_order_relaxed);
+    record.sequence.store(sequence + 1, std::memory_order_release);
+
+    state_->wake.fetch_add(1);
+    if (state_->sleepers.load() != 0) {
+      futexWake(&state_->wake);
+    }
+  }
+
+  // Returns the sequence the next change will get
+  [[nodiscard]] uint64_t head() const { return state_->head.load(); }
+
+  // Returns the changes from cursor on and moves cursor past them. If there
+  // aren't any yet, sleeps until there are or the timeout runs out, in which
+  // case nothing is returned.
+  [[nodiscard]] std::vector<ChangeEvent> read(
+      uint64_t &cursor, std::chrono::milliseconds timeout) const {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::vector<ChangeEvent> changes;
+    while (true) {
+      // read wake first, so a change published after we look at the ring
+      // makes the sleep below return straight away
+      auto wake = state_->wake.load();
+      collect(cursor, changes);
+      if (!changes.empty()) {
+        return changes;
+      }
+      state_->sleepers.fetch_add(1);
+      auto slept = futexWait(&state_->wake, wake, deadline);
+      state_->sleepers.fetch_sub(1);
+      if (!slept) {
+        return changes;
+      }
+    }
+  }
+
+ private:
+  ChangeRecord *records_;
+  std::size_t numRecords_;
+  ChangeFeedState *state_;
+
+  // Copies the published changes from cursor on into changes
+  void collect(uint64_t &cursor, std::vector<ChangeEvent> &changes) const {
+    auto head = state_->head.load();
+    if (cursor > head) {
+      // not a cursor from this feed, or from before it was recreated
+      cursor = head;
+    }
+    while (cursor < head) {
+      if (head - cursor > numRecords_) {
+        overrun(cursor, changes);
+        continue;
+      }
+      auto &record = records_[cursor & (numRecords_ - 1)];
+      auto sequence = record.sequence.load(std::memory_order_acquire);
+      if (sequence == cursor + 1) {
+        ChangeEvent change{
+            static_cast<ChangeOp>(record.op.load(std::memory_order_relaxed)),
+            record.index.load(std::memory_order_relaxed),
+            record.key.load(std::memory_order_relaxed), cursor};
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (record.sequence.load(std::memory_order_relaxed) == sequence) {
+          changes.push_back(change);
+          cursor++;
+          continue;
+        }
+        sequence = record.sequence.load();
+      }
+      if ((sequence & ~CHANGE_WRITING) > cursor + 1) {
+        // a later change has been written over it
+        overrun(cursor, changes);
+        head = std::max(head, state_->head.load());
+        continue;
+      }
+      // still being written, so everything after it has to wait
+      break;
+    }
+  }
+
+  // Skips cursor ahead to the oldest change still in the ring
+  void overrun(uint64_t &cursor, std::vector<ChangeEvent> &changes) const {
+    if (changes.empty() || changes.back().op != ChangeOp::OVERRUN) {
+      changes.push_back({ChangeOp::OVERRUN, 0, 0, cursor});
+    }
+    auto head = state_->head.load();
+    cursor = std::max(cursor + 1,
+                      head > numRecords_ ? head - numRecords_ : uint64_t{0});
+  }
+};
+
+#endif  // ASSIGNMENT_1_CHANGEFEED_HPP
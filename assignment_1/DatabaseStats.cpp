@@ -0,0 +1,99 @@
+#include "DatabaseStats.h"
+
+#include <iomanip>
+#include <string>
+
+namespace {
+
+constexpr const char *OP_NAMES[] = {
+    "get",     "set",   "at",        "erase", "insert", "push_back",
+    "find",    "scan",  "snapshot",  "edit",  "compact", "clear",
+    "subscribe", "range", "select", "transaction",
+};
+static_assert(sizeof(OP_NAMES) / sizeof(OP_NAMES[0]) ==
+                  static_cast<size_t>(StatOp::COUNT),
+              "Every op needs a name");
+
+constexpr const char *LOCK_NAMES[] = {
+    "read",
+    "write",
+    "stripe read",
+    "stripe write",
+};
+static_assert(sizeof(LOCK_NAMES) / sizeof(LOCK_NAMES[0]) ==
+                  static_cast<size_t>(StatLock::COUNT),
+              "Every lock needs a name");
+
+// Returns a short label for the upper bound of a wait bucket
+std::string bucketLabel(int bucket) {
+  if (bucket == STAT_WAIT_BUCKETS - 1) {
+    return "longer";
+  }
+  auto micros = 1ull << bucket;
+  if (micros < 1000) {
+    return "<" + std::to_string(micros) + "us";
+  }
+  if (micros < 1000000) {
+    return "<" + std::to_string(micros / 1000) + "ms";
+  }
+  return "<" + std::to_string(micros / 1000000) + "s";
+}
+
+}  // namespace
+
+void resetStats(DatabaseStats *stats) {
+  for (auto &lock : stats->locks) {
+    lock.acquisitions.store(0, std::memory_order_relaxed);
+    lock.timeouts.store(0, std::memory_order_relaxed);
+    lock.waitNanos.store(0, std::memory_order_relaxed);
+    for (auto &wait : lock.waits) {
+      wait.store(0, std::memory_order_relaxed);
+    }
+  }
+  stats->maxReaders.store(0, std::memory_order_relaxed);
+  for (auto &op : stats->ops) {
+    op.store(0, std::memory_order_relaxed);
+  }
+}
+
+std::ostream &operator<<(std::ostream &out, const DatabaseStats &stats) {
+  out << "== Operations ==" << std::endl;
+  for (int i = 0; i < static_cast<int>(StatOp::COUNT); i++) {
+    auto count = stats.ops[i].load(std::memory_order_relaxed);
+    if (count != 0) {
+      out << std::setw(12) << OP_NAMES[i] << "  " << count << std::endl;
+    }
+  }
+
+  out << "== Locks ==" << std::endl;
+  for (int i = 0; i < static_cast<int>(StatLock::COUNT); i++) {
+    const auto &lock = stats.locks[i];
+    auto acquisitions = lock.acquisitions.load(std::memory_order_relaxed);
+    auto timeouts = lock.timeouts.load(std::memory_order_relaxed);
+    if (acquisitions == 0 && timeouts == 0) {
+      continue;
+    }
+    auto waitNanos = lock.waitNanos.load(std::memory_order_relaxed);
+    out << std::setw(12) << LOCK_NAMES[i] << "  " << acquisitions
+        << " acquired, " << timeouts << " timed out, ";
+    out << (acquisitions == 0 ? 0 : waitNanos / acquisitions / 1000)
+        << "us average wait" << std::endl;
+    out << std::setw(14) << "";
+    for (int bucket = 0; bucket < STAT_WAIT_BUCKETS; bucket++) {
+      auto count = lock.waits[bucket].load(std::memory_order_relaxed);
+      if (count != 0) {
+        out << bucketLabel(bucket) << ": " << count << "  ";
+      }
+    }
+    out << std::endl;
+  }
+  out << "Most readers at once: "
+      << stats.maxReaders.load(std::memory_order_relaxed) << std::endl;
+  auto pageSize = stats.pageSize.load(std::memory_order_relaxed);
+  if (pageSize != 0) {
+    out << "Page size: " << pageSize / 1024 << "kB, "
+        << stats.hugePageBytes.load(std::memory_order_relaxed) / 1024
+        << "kB of entries on huge pages" << std::endl;
+  }
+  return out;
+}
@@ -0,0 +1,149 @@
+#ifndef ASSIGNMENT_1_DATABASESTATS_H
+#define ASSIGNMENT_1_DATABASESTATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Build with -DSHARED_DATABASE_STATS=0 to compile the counting out. The
+// counters stay in the metadata either way, so builds with and without them
+// can share a database.
+#ifndef SHARED_DATABASE_STATS
+#define SHARED_DATABASE_STATS 1
+#endif
+
+// The operations DatabaseStats counts calls to
+enum class StatOp {
+  GET,
+  SET,
+  AT,
+  ERASE,
+  INSERT,
+  PUSH_BACK,
+  FIND,
+  SCAN,
+  SNAPSHOT,
+  EDIT,
+  COMPACT,
+  CLEAR,
+  SUBSCRIBE,
+  RANGE,
+  SELECT,
+  TRANSACTION,
+  COUNT,
+};
+
+// The locks DatabaseStats times waits for
+enum class StatLock {
+  READ,
+  WRITE,
+  STRIPE_READ,
+  STRIPE_WRITE,
+  COUNT,
+};
+
+// Bucket i of a wait histogram counts waits of under 2^i microseconds, apart
+// from the last, which counts everything longer
+constexpr static int STAT_WAIT_BUCKETS = 24;
+
+struct LockStats {
+  std::atomic<uint64_t> acquisitions;
+  std::atomic<uint64_t> timeouts;
+  std::atomic<uint64_t> waitNanos;
+  std::atomic<uint64_t> waits[STAT_WAIT_BUCKETS];
+};
+
+// Counters shared by every process using a database, which live in its
+// metadata. They are only ever updated with relaxed atomics, so they stay
+// cheap, but a reader may see a few of them a moment out of date, and op
+// counts from other handles only once they've made a batch of them.
+struct DatabaseStats {
+  LockStats locks[static_cast<int>(StatLock::COUNT)];
+  // most readers seen holding the database lock at once
+  std::atomic<uint64_t> maxReaders;
+  std::atomic<uint64_t> ops[static_cast<int>(StatOp::COUNT)];
+  // Size of the pages backing the newest extent, which holds about half the
+  // entries, and the bytes of extents backed by huge pages. Not counters, so
+  // resetStats() leaves them alone.
+  std::atomic<uint64_t> pageSize;
+  std::atomic<uint64_t> hugePageBytes;
+};
+
+// Op counts a handle has made but not added to its DatabaseStats yet. If every
+// process counted straight into the metadata, each get() would bounce the
+// same cache line between them, so handles add theirs in batches.
+struct PendingOps {
+  std::atomic<uint64_t> ops[static_cast<int>(StatOp::COUNT)];
+};
+
+// How many calls to an op a handle counts before adding them to the stats
+constexpr static uint64_t STAT_OP_BATCH = 64;
+
+inline void countOp(DatabaseStats *stats, PendingOps *pending, StatOp op,
+                    uint64_t count = 1) {
+#if SHARED_DATABASE_STATS
+  auto &local = pending->ops[static_cast<int>(op)];
+  if (local.fetch_add(count, std::memory_order_relaxed) + count >=
+      STAT_OP_BATCH) {
+    // only whoever takes the batch adds it, so another thread on the same
+    // handle can't count it twice
+    auto batch = local.exchange(0, std::memory_order_relaxed);
+    stats->ops[static_cast<int>(op)].fetch_add(batch,
+                                               std::memory_order_relaxed);
+  }
+#endif
+}
+
+// Adds every op a handle has counted so far to the stats
+inline void flushOps(DatabaseStats *stats, PendingOps *pending) {
+#if SHARED_DATABASE_STATS
+  for (int i = 0; i < static_cast<int>(StatOp::COUNT); i++) {
+    if (auto batch = pending->ops[i].exchange(0, std::memory_order_relaxed)) {
+      stats->ops[i].fetch_add(batch, std::memory_order_relaxed);
+    }
+  }
+#endif
+}
+
+// Records a successful acquisition of the given lock after waiting for it
+inline void countLockWait(DatabaseStats *stats, StatLock lock,
+                          std::chrono::steady_clock::duration wait) {
+#if SHARED_DATABASE_STATS
+  auto &lockStats = stats->locks[static_cast<int>(lock)];
+  auto nanos =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count();
+  auto micros = static_cast<uint64_t>(nanos) / 1000;
+  int bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+  if (bucket >= STAT_WAIT_BUCKETS) {
+    bucket = STAT_WAIT_BUCKETS - 1;
+  }
+  lockStats.acquisitions.fetch_add(1, std::memory_order_relaxed);
+  lockStats.waitNanos.fetch_add(nanos, std::memory_order_relaxed);
+  lockStats.waits[bucket].fetch_add(1, std::memory_order_relaxed);
+#endif
+}
+
+inline void countLockTimeout(DatabaseStats *stats, StatLock lock) {
+#if SHARED_DATABASE_STATS
+  stats->locks[static_cast<int>(lock)].timeouts.fetch_add(
+      1, std::memory_order_relaxed);
+#endif
+}
+
+inline void countReaders(DatabaseStats *stats, uint64_t readers) {
+#if SHARED_DATABASE_STATS
+  auto max = stats->maxReaders.load(std::memory_order_relaxed);
+  while (readers > max && !stats->maxReaders.compare_exchange_weak(
+                              max, readers, std::memory_order_relaxed)) {
+  }
+#endif
+}
+
+// Zeroes every counter
+void resetStats(DatabaseStats *stats);
+
+// Prints the counters as a table, leaving out ones that are still 0
+std::ostream &operator<<(std::ostream &out, const DatabaseStats &stats);
+
+#endif  // ASSIGNMENT_1_DATABASESTATS_H
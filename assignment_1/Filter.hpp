@@ -0,0 +1,199 @@
+#ifndef ASSIGNMENT_1_FILTER_HPP
+#define ASSIGNMENT_1_FILTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Filters for SharedDatabase::select(), built from where() and startsWith()
+// and combined with && and ||. A filter is checked against a block of up to
+// 64 entries at a time, and returns a bit for each one that matches, so the
+// comparisons run in tight loops over the block that the compiler can
+// vectorize, rather than a call per entry. The comparisons must be branch
+// free for that (check with -fopt-info-vec-missed).
+//
+//   db.select(where(&StudentInfo::id, between(100, 200)) &&
+//             startsWith(&StudentInfo::name, "Sm"));
+
+constexpr static size_t FILTER_BLOCK = 64;
+
+// Base of every filter, so the operators below only apply to filters
+struct EntryFilter {};
+
+template <typename F>
+constexpr static bool IS_FILTER = std::is_base_of_v<EntryFilter, F>;
+
+// Comparisons for where(). & rather than &&, which would be a branch.
+template <typename V>
+struct Between {
+  V low;
+  V high;
+  bool operator()(V value) const { return (value >= low) & (value <= high); }
+};
+
+template <typename V>
+struct Equals {
+  V value;
+  bool operator()(V other) const { return other == value; }
+};
+
+// Matches values from low to high, inclusive
+template <typename V>
+Between<V> between(V low, V high) {
+  return {low, high};
+}
+
+template <typename V>
+Equals<V> equals(V value) {
+  return {value};
+}
+
+// Matches entries whose member satisfies compare
+template <typename T, typename V, typename Compare>
+class FieldFilter : public EntryFilter {
+  static_assert(std::is_arithmetic_v<V>,
+                "where() compares numbers; use startsWith() for strings");
+
+ public:
+  using Entry = T;
+
+  FieldFilter(V T::*member, Compare compare)
+      : member_(member), compare_(compare) {}
+
+  [[nodiscard]] uint64_t match(const T *entries, size_t count) const {
+    // copy the field out of every entry first, so the comparisons are over a
+    // packed array
+    V values[FILTER_BLOCK] = {};
+    for (size_t i = 0; i < count; i++) {
+      values[i] = entries[i].*member_;
+    }
+    // A byte per entry, all ones if it matches, which packs into bits below.
+    // Always the whole block, since -O2 only vectorizes loops without a
+    // remainder, and the entries past count are masked off at the end.
+    alignas(16) uint8_t hits[FILTER_BLOCK];
+    for (size_t i = 0; i < FILTER_BLOCK; i++) {
+      hits[i] = -static_cast<uint8_t>(compare_(values[i]));
+    }
+    uint64_t matches = 0;
+#ifdef __SSE2__
+    for (size_t i = 0; i < FILTER_BLOCK; i += 16) {
+      auto bytes = _mm_load_si128(reinterpret_cast<const __m128i *>(hits + i));
+      matches |= static_cast<uint64_t>(
+                     static_cast<uint16_t>(_mm_movemask_epi8(bytes)))
+                 << i;
+    }
+#else
+    for (size_t i = 0; i < FILTER_BLOCK; i++) {
+      matches |= static_cast<uint64_t>(hits[i] & 1) << i;
+    }
+#endif
+    return count == FILTER_BLOCK ? matches : matches & ((1ull << count) - 1);
+  }
+
+ private:
+  V T::*member_;
+  Compare compare_;
+};
+
+// Matches entries whose null terminated char array member starts with prefix
+template <typename T, size_t N>
+class PrefixFilter : public EntryFilter {
+ public:
+  using Entry = T;
+
+  PrefixFilter(char (T::*member)[N], std::string prefix)
+      : member_(member), prefix_(std::move(prefix)) {}
+
+  [[nodiscard]] uint64_t match(const T *entries, size_t count) const {
+    if (prefix_.size() >= N) {
+      // there's no room for it and the null
+      return 0;
+    }
+    uint64_t matches = 0;
+    for (size_t i = 0; i < count; i++) {
+      auto equal = std::memcmp(entries[i].*member_, prefix_.data(),
+                               prefix_.size()) == 0;
+      matches |= static_cast<uint64_t>(equal ? 1 : 0) << i;
+    }
+    return matches;
+  }
+
+ private:
+  char (T::*member_)[N];
+  std::string prefix_;
+};
+
+template <typename L, typename R>
+class AndFilter : public EntryFilter {
+  static_assert(std::is_same_v<typename L::Entry, typename R::Entry>,
+                "Filters are on different types");
+
+ public:
+  using Entry = typename L::Entry;
+
+  AndFilter(L left, R right)
+      : left_(std::move(left)), right_(std::move(right)) {}
+
+  [[nodiscard]] uint64_t match(const Entry *entries, size_t count) const {
+    auto matches = left_.match(entries, count);
+    // most blocks don't match a selective filter at all
+    return matches == 0 ? 0 : matches & right_.match(entries, count);
+  }
+
+ private:
+  L left_;
+  R right_;
+};
+
+template <typename L, typename R>
+class OrFilter : public EntryFilter {
+  static_assert(std::is_same_v<typename L::Entry, typename R::Entry>,
+                "Filters are on different types");
+
+ public:
+  using Entry = typename L::Entry;
+
+  OrFilter(L left, R right)
+      : left_(std::move(left)), right_(std::move(right)) {}
+
+  [[nodiscard]] uint64_t match(const Entry *entries, size_t count) const {
+    auto all = count == FILTER_BLOCK ? ~0ull : (1ull << count) - 1;
+    auto matches = left_.match(entries, count);
+    return matches == all ? all : matches | right_.match(entries, count);
+  }
+
+ private:
+  L left_;
+  R right_;
+};
+
+template <typename T, typename V, typename Compare>
+FieldFilter<T, V, Compare> where(V T::*member, Compare compare) {
+  return {member, compare};
+}
+
+template <typename T, size_t N>
+PrefixFilter<T, N> startsWith(char (T::*member)[N], std::string prefix) {
+  return {member, std::move(prefix)};
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<IS_FILTER<L> && IS_FILTER<R>>>
+AndFilter<L, R> operator&&(L left, R right) {
+  return {std::move(left), std::move(right)};
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<IS_FILTER<L> && IS_FILTER<R>>>
+OrFilter<L, R> operator||(L left, R right) {
+  return {std::move(left), std::move(right)};
+}
+
+#endif  // ASSIGNMENT_1_FILTER_HPP
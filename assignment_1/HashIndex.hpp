@@ -0,0 +1,117 @@
+#ifndef ASSIGNMENT_1_HASHINDEX_HPP
+#define ASSIGNMENT_1_HASHINDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// A slot in a hash index. Slots only hold the key's hash and the index of the
+// entry, so they can live in shared memory and be used from any process.
+struct HashIndexSlot {
+  std::size_t hash;
+  // index of the entry plus one, or one of the markers below
+  std::size_t position;
+};
+
+constexpr static std::size_t EMPTY_SLOT = 0;
+constexpr static std::size_t DELETED_SLOT = SIZE_MAX;
+
+// Used as SharedDatabase's KeyOf parameter when the database isn't indexed
+struct NoIndex {};
+
+// An open-addressing (linear probing) multimap from key hashes to entry
+// indices, operating on a slot array owned by someone else. The number of
+// slots must be a power of two, and the table must never be allowed to fill
+// up, since probing stops at the first empty slot.
+class HashIndex {
+ public:
+  HashIndex(HashIndexSlot *slots, std::size_t numSlots)
+      : slots_(slots),
+        mask_(numSlots - 1),
+        shift_(64 - __builtin_ctzll(numSlots)) {}
+
+  // Returns the number of slots needed to index the given number of entries
+  // while staying at most half full.
+  static std::size_t slotsFor(std::size_t entries) {
+    std::size_t slots = 64;
+    while (slots < entries * 4) {
+      slots <<= 1;
+    }
+    return slots;
+  }
+
+  // Adds an index for the given hash. Returns true if it used an empty slot
+  // rather than reusing a deleted one.
+  bool insert(std::size_t hash, std::size_t index) {
+    for (auto slot = home(hash);; slot = (slot + 1) & mask_) {
+      auto position = slots_[slot].position;
+      if (position == EMPTY_SLOT || position == DELETED_SLOT) {
+        slots_[slot] = {hash, index + 1};
+        return position == EMPTY_SLOT;
+      }
+    }
+  }
+
+  // Removes the given hash/index pair, leaving a marker so that probing
+  // carries on past it. Returns false if it wasn't in the index.
+  bool remove(std::size_t hash, std::size_t index) {
+    auto slot = lookup(hash, index);
+    if (slot == nullptr) {
+      return false;
+    }
+    slot->position = DELETED_SLOT;
+    return true;
+  }
+
+  // Points the given hash at newIndex instead of oldIndex
+  bool move(std::size_t hash, std::size_t oldIndex, std::size_t newIndex) {
+    auto slot = lookup(hash, oldIndex);
+    if (slot == nullptr) {
+      return false;
+    }
+    slot->position = newIndex + 1;
+    return true;
+  }
+
+  // Calls callback(index) for every entry with the given hash. Stops early if
+  // the callback returns false.
+  template <typename F>
+  void forEach(std::size_t hash, F &&callback) const {
+    for (auto slot = home(hash);; slot = (slot + 1) & mask_) {
+      auto position = slots_[slot].position;
+      if (position == EMPTY_SLOT) {
+        return;
+      }
+      if (position != DELETED_SLOT && slots_[slot].hash == hash) {
+        if (!callback(position - 1)) {
+          return;
+        }
+      }
+    }
+  }
+
+ private:
+  HashIndexSlot *slots_;
+  std::size_t mask_;
+  int shift_;
+
+  // Fibonacci hashing, so that sequential keys (which std::hash leaves alone)
+  // still spread out over the table
+  [[nodiscard]] std::size_t home(std::size_t hash) const {
+    return (hash * 0x9E3779B97F4A7C15ull) >> shift_ & mask_;
+  }
+
+  [[nodiscard]] HashIndexSlot *lookup(std::size_t hash,
+                                      std::size_t index) const {
+    for (auto slot = home(hash);; slot = (slot + 1) & mask_) {
+      auto position = slots_[slot].position;
+      if (position == EMPTY_SLOT) {
+        return nullptr;
+      }
+      if (position == index + 1 && slots_[slot].hash == hash) {
+        return &slots_[slot];
+      }
+    }
+  }
+};
+
+#endif  // ASSIGNMENT_1_HASHINDEX_HPP
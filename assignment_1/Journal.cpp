@@ -0,0 +1,342 @@
+#include "Journal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "SnapshotFormat.h"
+
+namespace {
+
+constexpr char JOURNAL_MAGIC[8] = {'S', 'D', 'B', 'J', 'R', 'N', 'L', '\0'};
+constexpr uint32_t JOURNAL_VERSION = 1;
+
+struct JournalHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+  uint64_t schemaHash;
+};
+
+struct RecordHeader {
+  // CRC-32 of the rest of the header and the entries after it
+  uint32_t crc;
+  uint32_t op;
+  uint64_t slot;
+  uint64_t count;
+};
+
+// Appends a record to buffer
+void encodeRecord(std::vector<char> &buffer, JournalOp op, uint64_t slot,
+                  const void *records, size_t bytes, size_t count) {
+  RecordHeader header{0, static_cast<uint32_t>(op), slot, count};
+  header.crc = crc32(&header.op, sizeof(header) - sizeof(header.crc));
+  header.crc = crc32(records, bytes, header.crc);
+  auto start = buffer.size();
+  buffer.resize(start + sizeof(header) + bytes);
+  std::memcpy(buffer.data() + start, &header, sizeof(header));
+  if (bytes != 0) {
+    std::memcpy(buffer.data() + start + sizeof(header), records, bytes);
+  }
+}
+
+// Syncs the directory holding path, so a rename() into it survives a crash
+void syncDirectory(const std::string &path) {
+  auto slash = path.find_last_of('/');
+  auto directory = slash == std::string::npos ? std::string(".")
+                   : slash == 0               ? std::string("/")
+                                              : path.substr(0, slash);
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1 || fsync(fd) == -1) {
+    auto error = errno;
+    if (fd != -1) {
+      close(fd);
+    }
+    throw std::system_error(error, std::generic_category(),
+                            "Failed to sync directory: " + directory);
+  }
+  close(fd);
+}
+
+void writeAll(int fd, const char *data, size_t bytes, off_t offset,
+              const std::string &path) {
+  while (bytes > 0) {
+    auto written = pwrite(fd, data, bytes, offset);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              "Failed to write journal: " + path);
+    }
+    data += written;
+    bytes -= written;
+    offset += written;
+  }
+}
+
+}  // namespace
+
+Journal::Journal(std::string path, JournalState *state, uint32_t recordSize,
+                 uint64_t schemaHash, std::chrono::milliseconds timeout)
+    : path_(std::move(path)),
+      state_(state),
+      recordSize_(recordSize),
+      schemaHash_(schemaHash),
+      timeout_(timeout) {
+  open();
+  generation_ = state_->generation;
+}
+
+Journal::~Journal() {
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+void Journal::open() {
+  fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd_ == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to open journal: " + path_);
+  }
+  JournalHeader header{};
+  auto bytes = pread(fd_, &header, sizeof(header), 0);
+  if (bytes == 0) {
+    // a new journal
+    std::memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.recordSize = recordSize_;
+    header.schemaHash = schemaHash_;
+    writeAll(fd_, reinterpret_cast<const char *>(&header), sizeof(header), 0,
+             path_);
+    return;
+  }
+  if (bytes != sizeof(header) ||
+      std::memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != JOURNAL_VERSION) {
+    throw std::runtime_error("Not a database journal: " + path_);
+  }
+  if (header.recordSize != recordSize_ || header.schemaHash != schemaHash_) {
+    throw std::runtime_error("Journal is of a different record type: " +
+                             path_);
+  }
+}
+
+void Journal::reopenIfReplaced() {
+  if (generation_ != state_->generation) {
+    close(fd_);
+    fd_ = -1;
+    open();
+    generation_ = state_->generation;
+  }
+}
+
+void Journal::replay(const std::function<void(JournalOp, uint64_t,
+                                              const void *, size_t)> &apply) {
+  struct stat fileStat {};
+  if (fstat(fd_, &fileStat) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to stat journal: " + path_);
+  }
+  std::vector<char> data(fileStat.st_size);
+  for (size_t done = 0; done < data.size();) {
+    auto bytes = pread(fd_, data.data() + done, data.size() - done, done);
+    if (bytes <= 0) {
+      if (bytes == -1 && errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(bytes == 0 ? EIO : errno,
+                              std::generic_category(),
+                              "Failed to read journal: " + path_);
+    }
+    done += bytes;
+  }
+
+  // Reads the record at offset into header and returns where it ends, or 0
+  // if it's torn
+  auto readRecord = [&](size_t offset, RecordHeader &header) -> size_t {
+    if (offset + sizeof(RecordHeader) > data.size()) {
+      return 0;
+    }
+    std::memcpy(&header, data.data() + offset, sizeof(header));
+    auto payload = data.data() + offset + sizeof(header);
+    auto bytes = header.count * recordSize_;
+    if (header.count > data.size() ||
+        bytes > data.size() - offset - sizeof(header)) {
+      return 0;
+    }
+    auto crc = crc32(&header.op, sizeof(header) - sizeof(header.crc));
+    if (crc32(payload, bytes, crc) != header.crc) {
+      return 0;
+    }
+    return offset + sizeof(header) + bytes;
+  };
+
+  size_t end = sizeof(JournalHeader);
+  RecordHeader header{};
+  while (auto next = readRecord(end, header)) {
+    if (static_cast<JournalOp>(header.op) != JournalOp::TRANSACTION) {
+      apply(static_cast<JournalOp>(header.op), header.slot,
+            data.data() + end + sizeof(header), header.count);
+      end = next;
+      continue;
+    }
+    // check the whole transaction is there before applying any of it
+    std::vector<size_t> records;
+    auto changes = header.slot;
+    for (uint64_t i = 0; i < changes && next != 0; i++) {
+      records.push_back(next);
+      next = readRecord(next, header);
+    }
+    if (next == 0) {
+      break;
+    }
+    for (auto offset : records) {
+      std::memcpy(&header, data.data() + offset, sizeof(header));
+      apply(static_cast<JournalOp>(header.op), header.slot,
+            data.data() + offset + sizeof(header), header.count);
+    }
+    end = next;
+  }
+  if (end < data.size() && ftruncate(fd_, static_cast<off_t>(end)) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to truncate journal: " + path_);
+  }
+
+  initRWLock(&state_->appendLock);
+  initRWLock(&state_->syncLock);
+  state_->tail = end;
+  state_->base = 0;
+  state_->synced.store(end);
+  state_->generation = 0;
+  generation_ = 0;
+}
+
+uint64_t Journal::append(JournalOp op, uint64_t slot, const void *records,
+                         size_t count) {
+  std::vector<char> buffer;
+  encodeRecord(buffer, op, slot, records, count * recordSize_, count);
+  return write(buffer);
+}
+
+uint64_t Journal::appendTransaction(const std::vector<JournalChange> &changes) {
+  std::vector<char> buffer;
+  encodeRecord(buffer, JournalOp::TRANSACTION, changes.size(), nullptr, 0, 0);
+  for (const auto &change : changes) {
+    encodeRecord(buffer, change.op, change.slot, change.records,
+                 change.count * recordSize_, change.count);
+  }
+  return write(buffer);
+}
+
+uint64_t Journal::write(const std::vector<char> &buffer) {
+  lockWrite(&state_->appendLock, timeout_);
+  try {
+    reopenIfReplaced();
+    writeAll(fd_, buffer.data(), buffer.size(),
+             static_cast<off_t>(state_->tail - state_->base), path_);
+  } catch (...) {
+    unlockWrite(&state_->appendLock);
+    throw;
+  }
+  state_->tail += buffer.size();
+  auto position = state_->tail;
+  unlockWrite(&state_->appendLock);
+  return position;
+}
+
+void Journal::sync(uint64_t position) {
+  if (state_->synced.load() >= position) {
+    return;
+  }
+  lockWrite(&state_->syncLock, timeout_);
+  try {
+    // whoever had the lock before us may well have synced our record already
+    if (state_->synced.load() < position) {
+      reopenIfReplaced();
+      // sync everything appended so far, not just our record, so the writers
+      // queued up behind us don't have to
+      lockRead(&state_->appendLock, timeout_);
+      auto target = state_->tail;
+      unlockRead(&state_->appendLock);
+      if (fdatasync(fd_) == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "Failed to sync journal: " + path_);
+      }
+      state_->synced.store(target);
+    }
+  } catch (...) {
+    unlockWrite(&state_->syncLock);
+    throw;
+  }
+  unlockWrite(&state_->syncLock);
+}
+
+void Journal::rewrite(const void *records, size_t count) {
+  // a name of its own, since other processes may be rewriting it too
+  auto tempPath = path_ + ".XXXXXX";
+  int fd = mkstemp(tempPath.data());
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to create journal: " + tempPath);
+  }
+  std::vector<char> buffer(sizeof(JournalHeader));
+  JournalHeader header{};
+  std::memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  header.version = JOURNAL_VERSION;
+  header.recordSize = recordSize_;
+  header.schemaHash = schemaHash_;
+  std::memcpy(buffer.data(), &header, sizeof(header));
+  if (count != 0) {
+    encodeRecord(buffer, JournalOp::APPEND, 0, records, count * recordSize_,
+                 count);
+  }
+  try {
+    writeAll(fd, buffer.data(), buffer.size(), 0, tempPath);
+    if (fdatasync(fd) == -1) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Failed to sync journal: " + tempPath);
+    }
+  } catch (...) {
+    close(fd);
+    unlink(tempPath.c_str());
+    throw;
+  }
+  close(fd);
+
+  // same order as sync(), which takes the append lock while syncing
+  lockWrite(&state_->syncLock, timeout_);
+  try {
+    lockWrite(&state_->appendLock, timeout_);
+  } catch (...) {
+    unlockWrite(&state_->syncLock);
+    unlink(tempPath.c_str());
+    throw;
+  }
+  int error = 0;
+  if (rename(tempPath.c_str(), path_.c_str()) == -1) {
+    error = errno;
+    unlink(tempPath.c_str());
+  } else {
+    // everything written so far is in the new journal, and on disk
+    state_->base = state_->tail - buffer.size();
+    state_->synced.store(state_->tail);
+    state_->generation++;
+  }
+  unlockWrite(&state_->appendLock);
+  unlockWrite(&state_->syncLock);
+  if (error != 0) {
+    throw std::system_error(error, std::generic_category(),
+                            "Failed to replace journal: " + path_);
+  }
+  syncDirectory(path_);
+}
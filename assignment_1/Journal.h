@@ -0,0 +1,121 @@
+#ifndef ASSIGNMENT_1_JOURNAL_H
+#define ASSIGNMENT_1_JOURNAL_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Utilities.h"
+
+// The changes a journal records. Replaying them in order on an empty database
+// rebuilds it.
+enum class JournalOp : uint32_t {
+  // count entries added to the end
+  APPEND = 1,
+  // an entry added with insert()
+  INSERT,
+  // the entry in slot replaced
+  SET,
+  // the entry in slot erased
+  ERASE,
+  CLEAR,
+  // a compact() call looking at no more than slot slots
+  COMPACT,
+  // the start of a transaction made of the slot records after it, which are
+  // only replayed if they all made it to disk
+  TRANSACTION,
+};
+
+// One of the records appended together by Journal::appendTransaction()
+struct JournalChange {
+  JournalOp op;
+  uint64_t slot;
+  const void *records;
+  size_t count;
+};
+
+// The part of a journal shared by every process writing to it, which lives in
+// the database metadata. Positions in the journal are logical offsets that
+// keep counting up when the journal is rewritten, so a writer can still tell
+// whether its records are on disk.
+struct JournalState {
+  // Held while appending, so records go in one after another
+  SharedRWLock appendLock;
+  // Held by whoever is syncing the journal to disk
+  SharedRWLock syncLock;
+  // Logical offset of the end of the journal, and of the start of the file
+  uint64_t tail;
+  uint64_t base;
+  // Everything before this logical offset is on disk
+  std::atomic<uint64_t> synced;
+  // Incremented when the journal is replaced by rewrite(), so that other
+  // processes know to reopen it
+  uint32_t generation;
+};
+
+// An append-only write-ahead log of the changes made to a database.
+//
+// Writers append a record while they hold the database lock, then wait for it
+// to reach the disk with sync() after they release it. Only one process syncs
+// at a time, and it syncs everything appended so far, so writers that pile up
+// behind it usually find their records already synced and share a single
+// fdatasync (group commit).
+class Journal {
+ public:
+  // Opens the journal at path, creating it if it doesn't exist. A journal
+  // written for a different record type or size is rejected with a
+  // std::runtime_error, and I/O errors throw a std::system_error.
+  Journal(std::string path, JournalState *state, uint32_t recordSize,
+          uint64_t schemaHash, std::chrono::milliseconds timeout);
+  ~Journal();
+
+  Journal(const Journal &) = delete;
+  Journal &operator=(const Journal &) = delete;
+
+  // Initializes the shared state for a journal that nobody else has open,
+  // after calling apply(op, slot, records, count) for every complete record in
+  // it. A torn record at the end, from a crash in the middle of an append, is
+  // cut off.
+  void replay(const std::function<void(JournalOp, uint64_t, const void *,
+                                       size_t)> &apply);
+
+  // Appends a record, and returns the position sync() has to reach for it to
+  // be durable.
+  uint64_t append(JournalOp op, uint64_t slot, const void *records = nullptr,
+                  size_t count = 0);
+
+  // Appends the changes as one transaction, which replay() either applies in
+  // full or not at all, and returns the position to sync() to.
+  uint64_t appendTransaction(const std::vector<JournalChange> &changes);
+
+  // Waits until everything before the given position is on disk.
+  void sync(uint64_t position);
+
+  // Atomically replaces the journal with one holding a single APPEND record
+  // of the given entries, which must be everything in the database. Appends
+  // must be held off while it runs. Several processes can rewrite the
+  // journal at once; whichever finishes last wins.
+  void rewrite(const void *records, size_t count);
+
+ private:
+  std::string path_;
+  JournalState *state_;
+  uint32_t recordSize_;
+  uint64_t schemaHash_;
+  std::chrono::milliseconds timeout_;
+  int fd_ = -1;
+  uint32_t generation_ = 0;
+
+  void open();
+  // Appends encoded records in one write, returning the position after them
+  uint64_t write(const std::vector<char> &buffer);
+  // Reopens the journal if it has been rewritten since it was opened. Must be
+  // called with one of the journal locks held.
+  void reopenIfReplaced();
+};
+
+#endif  // ASSIGNMENT_1_JOURNAL_H
@@ -0,0 +1,351 @@
+#ifndef ASSIGNMENT_1_ORDEREDINDEX_HPP
+#define ASSIGNMENT_1_ORDEREDINDEX_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A node of an ordered index. Nodes are about a kilobyte, so a lookup only
+// touches a few of them even in a large database.
+template <typename Key>
+struct OrderedNode {
+  constexpr static uint32_t ORDER = std::max<std::size_t>(
+      8, (1024 - 16) / (sizeof(Key) + sizeof(uint64_t)));
+
+  uint32_t count;
+  bool leaf;
+  // the next leaf, or 0 after the last one
+  uint64_t next;
+  Key keys[ORDER];
+  // In a leaf, the slot of the entry with each key. In an internal node, the
+  // count + 1 children, with keys[i] no less than any key under children[i]
+  // and no greater than any key under children[i + 1].
+  uint64_t values[ORDER + 1];
+};
+
+// The part of an ordered index that lives in the database metadata
+struct OrderedIndexState {
+  uint64_t root;
+  uint32_t height;
+  // nodes handed out so far. Node 0 is never used, so it can mean "none"
+  uint64_t used;
+  uint64_t entries;
+  // entries removed since the index was built, which may have left nodes
+  // emptier than they need to be
+  uint64_t removed;
+};
+
+// A B+-tree from keys to the slots of the entries with them, operating on a
+// node array owned by someone else, so it can live in shared memory. Keys can
+// repeat. Removing entries never merges nodes; instead the owner is expected
+// to rebuild() the tree once needsRebuild() says enough have been removed.
+// Nodes are only ever added, so before inserting, the owner has to make sure
+// there are at least nodesForInsert() left, growing the array if not.
+template <typename Key>
+class OrderedIndex {
+ public:
+  using Node = OrderedNode<Key>;
+  constexpr static uint32_t ORDER = Node::ORDER;
+
+  // A place in the leaves. node is 0 past the end.
+  struct Position {
+    uint64_t node;
+    uint32_t index;
+  };
+
+  OrderedIndex(Node *nodes, std::size_t numNodes, OrderedIndexState *state)
+      : nodes_(nodes), numNodes_(numNodes), state_(state) {}
+
+  // Returns the number of nodes to allocate for an index of the given number
+  // of entries, with some room to grow
+  static std::size_t nodesFor(std::size_t entries) {
+    std::size_t nodes = 64;
+    while (nodes < entries / ORDER * 2 + 64) {
+      nodes <<= 1;
+    }
+    return nodes;
+  }
+
+  [[nodiscard]] std::size_t nodesForInsert() const {
+    // a split at every level, and a new root
+    return state_->height + 1;
+  }
+
+  [[nodiscard]] std::size_t freeNodes() const {
+    return numNodes_ - state_->used;
+  }
+
+  [[nodiscard]] bool needsRebuild() const {
+    return state_->removed > state_->entries + ORDER;
+  }
+
+  // Replaces the contents with the given key/slot pairs, which must be
+  // sorted by key. Needs nodesFor(entries.size()) nodes.
+  void rebuild(const std::vector<std::pair<Key, uint64_t>> &entries) {
+    state_->used = 1;
+    state_->entries = entries.size();
+    state_->removed = 0;
+    state_->height = 1;
+    // fill the leaves right up, since the entries are in order already
+    std::vector<std::pair<uint64_t, Key>> level;
+    for (std::size_t start = 0; start < entries.size() || level.empty();
+         start += ORDER) {
+      auto leaf = allocate(true);
+      auto count = std::min<std::size_t>(ORDER, entries.size() - start);
+      for (std::size_t i = 0; i < count; i++) {
+        nodes_[leaf].keys[i] = entries[start + i].first;
+        nodes_[leaf].values[i] = entries[start + i].second;
+      }
+      nodes_[leaf].count = count;
+      if (!level.empty()) {
+        nodes_[level.back().first].next = leaf;
+      }
+      level.push_back({leaf, nodes_[leaf].keys[0]});
+    }
+    // then each level of internal nodes over the one below
+    while (level.size() > 1) {
+      std::vector<std::pair<uint64_t, Key>> parents;
+      for (std::size_t start = 0; start < level.size(); start += ORDER + 1) {
+        auto parent = allocate(false);
+        auto count = std::min<std::size_t>(ORDER + 1, level.size() - start);
+        for (std::size_t i = 0; i < count; i++) {
+          nodes_[parent].values[i] = level[start + i].first;
+          if (i != 0) {
+            nodes_[parent].keys[i - 1] = level[start + i].second;
+          }
+        }
+        nodes_[parent].count = count - 1;
+        parents.push_back({parent, level[start].second});
+      }
+      level = std::move(parents);
+      state_->height++;
+    }
+    state_->root = level.front().first;
+  }
+
+  void insert(const Key &key, uint64_t slot) {
+    if (full(state_->root)) {
+      auto root = allocate(false);
+      nodes_[root].values[0] = state_->root;
+      split(root, 0);
+      state_->root = root;
+      state_->height++;
+    }
+    // split full nodes on the way down, so there's always room for the split
+    // below in the parent
+    auto node = state_->root;
+    while (!nodes_[node].leaf) {
+      auto child = upperBound(node, key);
+      if (full(nodes_[node].values[child])) {
+        split(node, child);
+        if (!(key < nodes_[node].keys[child])) {
+          child++;
+        }
+      }
+      node = nodes_[node].values[child];
+    }
+    auto &leaf = nodes_[node];
+    auto index = upperBound(node, key);
+    std::move_backward(leaf.keys + index, leaf.keys + leaf.count,
+                       leaf.keys + leaf.count + 1);
+    std::move_backward(leaf.values + index, leaf.values + leaf.count,
+                       leaf.values + leaf.count + 1);
+    leaf.keys[index] = key;
+    leaf.values[index] = slot;
+    leaf.count++;
+    state_->entries++;
+  }
+
+  // Removes the entry in the given slot, which has the given key. Returns
+  // false if it isn't in the index.
+  bool remove(const Key &key, uint64_t slot) {
+    auto position = find(key, slot);
+    if (position.node == 0) {
+      return false;
+    }
+    auto &leaf = nodes_[position.node];
+    std::move(leaf.keys + position.index + 1, leaf.keys + leaf.count,
+              leaf.keys + position.index);
+    std::move(leaf.values + position.index + 1, leaf.values + leaf.count,
+              leaf.values + position.index);
+    leaf.count--;
+    state_->entries--;
+    state_->removed++;
+    return true;
+  }
+
+  // Points the entry with the given key at newSlot instead of oldSlot
+  bool move(const Key &key, uint64_t oldSlot, uint64_t newSlot) {
+    auto position = find(key, oldSlot);
+    if (position.node == 0) {
+      return false;
+    }
+    nodes_[position.node].values[position.index] = newSlot;
+    return true;
+  }
+
+  // Moves every entry in a slot after the given one down by one slot, for when
+  // everything after an erased entry is shifted down over it
+  void shiftDown(uint64_t erasedSlot) {
+    for (auto node = firstLeaf(); node != 0; node = nodes_[node].next) {
+      for (uint32_t i = 0; i < nodes_[node].count; i++) {
+        if (nodes_[node].values[i] > erasedSlot) {
+          nodes_[node].values[i]--;
+        }
+      }
+    }
+  }
+
+  // Moves every entry in the given slot or after it up by one slot, for when
+  // an entry is put back in the middle
+  void shiftUp(uint64_t insertedSlot) {
+    for (auto node = firstLeaf(); node != 0; node = nodes_[node].next) {
+      for (uint32_t i = 0; i < nodes_[node].count; i++) {
+        if (nodes_[node].values[i] >= insertedSlot) {
+          nodes_[node].values[i]++;
+        }
+      }
+    }
+  }
+
+  // Returns the position of the first entry with a key no less than key
+  [[nodiscard]] Position lowerBound(const Key &key) const {
+    auto node = state_->root;
+    while (!nodes_[node].leaf) {
+      node = nodes_[node].values[lowerBound(node, key)];
+    }
+    Position position{node, lowerBound(node, key)};
+    settle(position);
+    return position;
+  }
+
+  // Returns the position of the first entry with a key greater than key
+  [[nodiscard]] Position upperBound(const Key &key) const {
+    auto node = state_->root;
+    while (!nodes_[node].leaf) {
+      node = nodes_[node].values[upperBound(node, key)];
+    }
+    Position position{node, upperBound(node, key)};
+    settle(position);
+    return position;
+  }
+
+  void advance(Position &position) const {
+    position.index++;
+    settle(position);
+  }
+
+  [[nodiscard]] const Key &key(Position position) const {
+    return nodes_[position.node].keys[position.index];
+  }
+
+  [[nodiscard]] uint64_t slot(Position position) const {
+    return nodes_[position.node].values[position.index];
+  }
+
+ private:
+  Node *nodes_;
+  std::size_t numNodes_;
+  OrderedIndexState *state_;
+
+  uint64_t allocate(bool leaf) {
+    auto node = state_->used++;
+    nodes_[node].count = 0;
+    nodes_[node].leaf = leaf;
+    nodes_[node].next = 0;
+    return node;
+  }
+
+  [[nodiscard]] bool full(uint64_t node) const {
+    return nodes_[node].count == ORDER;
+  }
+
+  // Index of the first key in the node greater than key
+  [[nodiscard]] uint32_t upperBound(uint64_t node, const Key &key) const {
+    auto &keys = nodes_[node].keys;
+    return std::upper_bound(keys, keys + nodes_[node].count, key) - keys;
+  }
+
+  // Index of the first key in the node no less than key
+  [[nodiscard]] uint32_t lowerBound(uint64_t node, const Key &key) const {
+    auto &keys = nodes_[node].keys;
+    return std::lower_bound(keys, keys + nodes_[node].count, key) - keys;
+  }
+
+  // Splits the full child at the given index of parent, which isn't full, in
+  // two
+  void split(uint64_t parent, uint32_t child) {
+    auto left = nodes_[parent].values[child];
+    auto right = allocate(nodes_[left].leaf);
+    auto &leftNode = nodes_[left];
+    auto &rightNode = nodes_[right];
+    auto middle = ORDER / 2;
+    Key separator;
+    if (leftNode.leaf) {
+      // leaves keep every key, and the separator is a copy of the first one
+      // on the right
+      rightNode.count = ORDER - middle;
+      std::copy(leftNode.keys + middle, leftNode.keys + ORDER, rightNode.keys);
+      std::copy(leftNode.values + middle, leftNode.values + ORDER,
+                rightNode.values);
+      rightNode.next = leftNode.next;
+      leftNode.next = right;
+      separator = rightNode.keys[0];
+    } else {
+      // internal nodes pass their middle key up
+      rightNode.count = ORDER - middle - 1;
+      std::copy(leftNode.keys + middle + 1, leftNode.keys + ORDER,
+                rightNode.keys);
+      std::copy(leftNode.values + middle + 1, leftNode.values + ORDER + 1,
+                rightNode.values);
+      separator = leftNode.keys[middle];
+    }
+    leftNode.count = middle;
+
+    auto &parentNode = nodes_[parent];
+    std::move_backward(parentNode.keys + child,
+                       parentNode.keys + parentNode.count,
+                       parentNode.keys + parentNode.count + 1);
+    std::move_backward(parentNode.values + child + 1,
+                       parentNode.values + parentNode.count + 1,
+                       parentNode.values + parentNode.count + 2);
+    parentNode.keys[child] = separator;
+    parentNode.values[child + 1] = right;
+    parentNode.count++;
+  }
+
+  [[nodiscard]] uint64_t firstLeaf() const {
+    auto node = state_->root;
+    while (!nodes_[node].leaf) {
+      node = nodes_[node].values[0];
+    }
+    return node;
+  }
+
+  // Moves a position that's past the end of its leaf to the start of the
+  // next non-empty one
+  void settle(Position &position) const {
+    while (position.node != 0 &&
+           position.index >= nodes_[position.node].count) {
+      position = {nodes_[position.node].next, 0};
+    }
+  }
+
+  // Returns the position of the entry with the given key and slot, or one
+  // with node 0 if there isn't one
+  [[nodiscard]] Position find(const Key &key, uint64_t slot) const {
+    // entries with the same key may be spread over several leaves
+    for (auto position = lowerBound(key);
+         position.node != 0 && !(key < this->key(position));
+         advance(position)) {
+      if (this->slot(position) == slot) {
+        return position;
+      }
+    }
+    return {0, 0};
+  }
+};
+
+#endif  // ASSIGNMENT_1_ORDEREDINDEX_HPP
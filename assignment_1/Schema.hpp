@@ -0,0 +1,199 @@
+#ifndef ASSIGNMENT_1_SCHEMA_HPP
+#define ASSIGNMENT_1_SCHEMA_HPP
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+// Describes the fields of a record type, so code that goes through them one
+// by one (parsing, printing, keys, hashing the layout) is written once rather
+// than for every type. Specialize RecordSchema with a constexpr tuple of the
+// type's fields, in order:
+//
+//   template <>
+//   struct RecordSchema<StudentInfo> {
+//     constexpr static auto fields = std::make_tuple(
+//         field("name", &StudentInfo::name), field("id", &StudentInfo::id));
+//   };
+//
+// It's all resolved at compile time, so going through the fields costs the
+// same as writing each one out by hand. Fields can be numbers or fixed size
+// char arrays holding null terminated strings.
+
+template <typename T, typename V>
+struct Field {
+  using Type = V;
+  const char *name;
+  V T::*member;
+};
+
+template <typename T, typename V>
+constexpr Field<T, V> field(const char *name, V T::*member) {
+  static_assert(std::is_arithmetic_v<V> ||
+                    (std::is_array_v<V> &&
+                     std::is_same_v<std::remove_extent_t<V>, char>),
+                "Fields must be numbers or char arrays");
+  return {name, member};
+}
+
+template <typename T>
+struct RecordSchema;
+
+template <typename T, typename = void>
+constexpr static bool HAS_SCHEMA = false;
+
+template <typename T>
+constexpr static bool
+    HAS_SCHEMA<T, std::void_t<decltype(RecordSchema<T>::fields)>> = true;
+
+template <typename T>
+constexpr static std::size_t FIELD_COUNT =
+    std::tuple_size_v<std::decay_t<decltype(RecordSchema<T>::fields)>>;
+
+// Calls f on each of T's fields, in order
+template <typename T, typename F>
+constexpr void forEachField(F &&f) {
+  std::apply([&](const auto &...fields) { (f(fields), ...); },
+             RecordSchema<T>::fields);
+}
+
+// Copies text into a string field, truncating it if needed so the field is
+// always null terminated
+template <std::size_t N>
+void setString(char (&field)[N], std::string_view text) {
+  auto length = std::min(text.size(), N - 1);
+  std::memcpy(field, text.data(), length);
+  field[length] = '\0';
+}
+
+// Parses text into a field. Returns false if it isn't a valid value for it.
+template <typename V>
+bool parseField(V &value, std::string_view text) {
+  if constexpr (std::is_array_v<V>) {
+    setString(value, text);
+    return true;
+  } else {
+    auto [end, error] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    return !text.empty() && error == std::errc();
+  }
+}
+
+// Reads record's fields in order, calling next() for the text of each one.
+// Throws a std::invalid_argument naming the field if one can't be parsed.
+template <typename T, typename Next>
+void readRecord(T &record, Next &&next) {
+  forEachField<T>([&](const auto &field) {
+    auto text = next();
+    if (!parseField(record.*field.member, text)) {
+      throw std::invalid_argument("Invalid " + std::string(field.name) +
+                                  ": " + std::string(text));
+    }
+  });
+}
+
+// Writes record's fields in order, each on a line of its own
+template <typename T>
+void writeRecord(std::ostream &out, const T &record) {
+  forEachField<T>([&](const auto &field) {
+    const auto &value = record.*field.member;
+    if constexpr (std::is_array_v<
+                      typename std::decay_t<decltype(field)>::Type>) {
+      // not relying on the null, in case a full field doesn't have one
+      out << std::string_view(value, strnlen(value, sizeof(value)));
+    } else {
+      out << value;
+    }
+    // not std::endl, which would flush every line
+    out << '\n';
+  });
+}
+
+// Returns a hash of the names, order and types of T's fields and its size, to
+// tell whether two programs agree on T's layout
+template <typename T>
+constexpr uint64_t fieldsHash() {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto mix = [&hash](uint64_t value) {
+    hash ^= value;
+    hash *= 0x100000001b3ull;
+  };
+  forEachField<T>([&](const auto &field) {
+    using V = typename std::decay_t<decltype(field)>::Type;
+    for (auto c = field.name; *c != '\0'; c++) {
+      mix(static_cast<unsigned char>(*c));
+    }
+    mix(sizeof(V));
+    mix(std::is_array_v<V> ? 2 : std::is_floating_point_v<V> ? 1 : 0);
+  });
+  mix(sizeof(T));
+  mix(alignof(T));
+  return hash;
+}
+
+// The value of a string field as a key, ordered and compared like strncmp
+template <std::size_t N>
+struct FixedString {
+  char chars[N];
+
+  bool operator<(const FixedString &other) const {
+    return std::strncmp(chars, other.chars, N) < 0;
+  }
+
+  bool operator==(const FixedString &other) const {
+    return std::strncmp(chars, other.chars, N) == 0;
+  }
+
+  [[nodiscard]] std::string_view view() const {
+    return {chars, strnlen(chars, N)};
+  }
+};
+
+namespace std {
+template <size_t N>
+struct hash<FixedString<N>> {
+  size_t operator()(const FixedString<N> &key) const {
+    return hash<string_view>{}(key.view());
+  }
+};
+}  // namespace std
+
+template <typename P>
+struct MemberOf;
+
+template <typename T, typename V>
+struct MemberOf<V T::*> {
+  using Record = T;
+  using Type = V;
+};
+
+// Key extractor for a SharedDatabase's KeyOf or OrderOf that keys records by
+// one of their fields, e.g. FieldKey<&StudentInfo::id>
+template <auto Member>
+struct FieldKey {
+  using Record = typename MemberOf<decltype(Member)>::Record;
+  using Type = typename MemberOf<decltype(Member)>::Type;
+  using Key = std::conditional_t<std::is_array_v<Type>,
+                                 FixedString<sizeof(Type)>, Type>;
+
+  Key operator()(const Record &record) const {
+    if constexpr (std::is_array_v<Type>) {
+      Key key;
+      std::memcpy(key.chars, record.*Member, sizeof(key.chars));
+      return key;
+    } else {
+      return record.*Member;
+    }
+  }
+};
+
+#endif  // ASSIGNMENT_1_SCHEMA_HPP
@@ -0,0 +1,255 @@
+#include "SegmentStore.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+namespace {
+
+// From linux/mempolicy.h, so this doesn't need libnuma
+constexpr int MPOL_BIND_ = 2;
+constexpr int MPOL_INTERLEAVE_ = 3;
+
+size_t basePageSize() {
+  static const auto size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return size;
+}
+
+// The default huge page size, from /proc/meminfo, or 0 if there aren't any
+size_t hugePageSize() {
+  static const auto size = [] {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string name;
+    size_t kilobytes;
+    while (meminfo >> name >> kilobytes) {
+      if (name == "Hugepagesize:") {
+        return kilobytes * 1024;
+      }
+      meminfo.ignore(64, '\n');
+    }
+    return size_t{0};
+  }();
+  return size;
+}
+
+// The online NUMA nodes as a mask, from a list like "0-1,3" in sysfs
+uint64_t onlineNodes() {
+  static const auto nodes = [] {
+    std::ifstream online("/sys/devices/system/node/online");
+    uint64_t mask = 0;
+    std::string range;
+    while (std::getline(online, range, ',')) {
+      int first, end;
+      char dash;
+      std::istringstream in(range);
+      if (!(in >> first)) {
+        continue;
+      }
+      // a single node, or a range of them
+      auto last = in >> dash >> end ? end : first;
+      for (int node = first; node <= last && node < 64; node++) {
+        mask |= 1ull << node;
+      }
+    }
+    return mask == 0 ? 1 : mask;
+  }();
+  return nodes;
+}
+
+// Maps the whole of an open file
+void *mapFile(int fd, size_t bytes, const std::string &path) {
+  auto address =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to map database file: " + path);
+  }
+  return address;
+}
+
+}  // namespace
+
+SegmentStore::~SegmentStore() {
+  if (rootFd_ != -1) {
+    close(rootFd_);
+  }
+}
+
+void *SegmentStore::openRoot(size_t bytes, bool &created, bool &solo) {
+  created = true;
+  rootFd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (rootFd_ == -1 && errno == EEXIST) {
+    created = false;
+    rootFd_ = open(path_.c_str(), O_RDWR);
+  }
+  if (rootFd_ == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to open database file: " + path_);
+  }
+
+  // every process holds a shared lock on the file while it has it open, so
+  // whoever can get an exclusive one is on their own
+  solo = flock(rootFd_, LOCK_EX | LOCK_NB) == 0;
+  if (!solo && flock(rootFd_, LOCK_SH) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to lock database file: " + path_);
+  }
+  if (created && ftruncate(rootFd_, static_cast<off_t>(bytes)) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to size database file: " + path_);
+  }
+  return mapFile(rootFd_, bytes, path_);
+}
+
+void SegmentStore::shareRoot() const {
+  if (flock(rootFd_, LOCK_SH) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to lock database file: " + path_);
+  }
+}
+
+void SegmentStore::closeRoot(void *address, size_t bytes) {
+  munmap(address, bytes);
+  close(rootFd_);
+  rootFd_ = -1;
+}
+
+void SegmentStore::removeRoot() const { unlink(path_.c_str()); }
+
+int SegmentStore::create(int fileId, size_t bytes, size_t *pageSize) const {
+  if (pageSize != nullptr) {
+    *pageSize = basePageSize();
+  }
+  if (!fileBacked()) {
+    auto hugePage = hugePageSize();
+    // small segments would waste most of a huge page
+    if (placement_.hugePages && hugePage != 0 && bytes >= hugePage) {
+      auto hugeBytes = (bytes + hugePage - 1) / hugePage * hugePage;
+      auto shmid = shmget(IPC_PRIVATE, hugeBytes,
+                          IPC_CREAT | IPC_EXCL | SHM_HUGETLB | S_IRUSR |
+                              S_IWUSR);
+      if (shmid != -1) {
+        if (pageSize != nullptr) {
+          *pageSize = hugePage;
+        }
+        return shmid;
+      }
+      // out of huge pages, or not allowed to use them
+    }
+    auto shmid = shmget(IPC_PRIVATE, bytes,
+                        IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    if (shmid == -1) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Creating database shared memory segment failed");
+    }
+    return shmid;
+  }
+
+  auto path = segmentPath(fileId);
+  // truncate anything left over by a database that wasn't cleaned up
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to create database file: " + path);
+  }
+  auto result = ftruncate(fd, static_cast<off_t>(bytes));
+  auto error = errno;
+  close(fd);
+  if (result == -1) {
+    throw std::system_error(error, std::generic_category(),
+                            "Failed to size database file: " + path);
+  }
+  return fileId;
+}
+
+void *SegmentStore::attach(int id, size_t bytes) const {
+  if (!fileBacked()) {
+    auto address = shmat(id, nullptr, 0);
+    if (address == reinterpret_cast<void *>(-1)) {
+      throw std::system_error(
+          errno, std::generic_category(),
+          "Attaching to database shared memory segment failed");
+    }
+    // a SHM_HUGETLB segment is rounded up to a whole huge page, and mbind()
+    // refuses a range that ends part way through one
+    struct shmid_ds segment {};
+    if (shmctl(id, IPC_STAT, &segment) == 0) {
+      bytes = std::max(bytes, static_cast<size_t>(segment.shm_segsz));
+    }
+    placeAttached(address, bytes);
+    return address;
+  }
+
+  auto path = segmentPath(id);
+  int fd = open(path.c_str(), O_RDWR);
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to open database file: " + path);
+  }
+  try {
+    auto address = mapFile(fd, bytes, path);
+    close(fd);
+    placeAttached(address, bytes);
+    return address;
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+}
+
+void SegmentStore::detach(void *address, size_t bytes) const {
+  if (fileBacked()) {
+    munmap(address, bytes);
+  } else {
+    shmdt(address);
+  }
+}
+
+void SegmentStore::remove(int id) const {
+  if (fileBacked()) {
+    unlink(segmentPath(id).c_str());
+  } else {
+    shmctl(id, IPC_RMID, nullptr);
+  }
+}
+
+void SegmentStore::sync(void *address, size_t bytes) const {
+  if (fileBacked() && msync(address, bytes, MS_SYNC) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to sync database file: " + path_);
+  }
+}
+
+std::string SegmentStore::segmentPath(int id) const {
+  return path_ + "." + std::to_string(id);
+}
+
+void SegmentStore::placeAttached(void *address, size_t bytes) const {
+  // both of these are only advice, so failures are ignored. Segments that
+  // already got huge pages from SHM_HUGETLB don't need the first
+  if (placement_.hugePages) {
+    madvise(address, bytes, MADV_HUGEPAGE);
+  }
+  if (placement_.numaPolicy == NumaPolicy::DEFAULT) {
+    return;
+  }
+  auto mode = placement_.numaPolicy == NumaPolicy::INTERLEAVE
+                  ? MPOL_INTERLEAVE_
+                  : MPOL_BIND_;
+  auto nodes = placement_.numaNodes == 0 ? onlineNodes()
+                                         : placement_.numaNodes;
+  // SysV segments keep the policy for every process, and it applies to pages
+  // faulted in from then on, so this has to happen before the segment is
+  // first touched, which attaching right after creating does
+  syscall(SYS_mbind, address, bytes, mode, &nodes, sizeof(nodes) * 8 + 1, 0);
+}
@@ -0,0 +1,87 @@
+#ifndef ASSIGNMENT_1_SEGMENTSTORE_H
+#define ASSIGNMENT_1_SEGMENTSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// Where the memory of a segment is allowed to come from
+enum class NumaPolicy : uint32_t {
+  // wherever the kernel likes, usually the node of whoever touches it first
+  DEFAULT,
+  // spread page by page over the nodes, so every reader sees the same mix of
+  // local and remote memory
+  INTERLEAVE,
+  // only the nodes given
+  BIND,
+};
+
+// How new segments are backed. Kept in the database metadata, so segments
+// added by any process get the same treatment.
+struct SegmentPlacement {
+  // Back segments of at least a huge page with huge pages (SHM_HUGETLB), to
+  // cut TLB misses on big scans. If none are free, or the store is file
+  // backed, the segment gets normal pages, with transparent huge pages asked
+  // for where the kernel supports them.
+  bool hugePages;
+  NumaPolicy numaPolicy;
+  // The nodes for numaPolicy, one bit per node. 0 means every online node.
+  uint64_t numaNodes;
+};
+
+// Creates, attaches and removes the memory segments a SharedDatabase is stored
+// in. Segments are SysV shared memory by default. If a path is given, they are
+// files mapped with MAP_SHARED instead, so the database survives restarts and
+// can be reopened without loading it again.
+class SegmentStore {
+ public:
+  explicit SegmentStore(std::string path = "") : path_(std::move(path)) {}
+
+  SegmentStore(const SegmentStore &) = delete;
+  SegmentStore &operator=(const SegmentStore &) = delete;
+
+  ~SegmentStore();
+
+  [[nodiscard]] bool fileBacked() const { return !path_.empty(); }
+
+  // Sets how segments created or attached from now on are placed. The
+  // policies are hints: if the kernel can't follow them, segments are created
+  // as if there weren't any.
+  void place(const SegmentPlacement &placement) { placement_ = placement; }
+
+  // Opens the file holding the database metadata, creating it with the given
+  // size if it doesn't exist. created is set if it was created, and solo if no
+  // other process has it open, in which case any lock state left in it by a
+  // process that exited is stale. A solo process keeps other processes out
+  // until it calls shareRoot(), so it can reset that state first. Only for
+  // file backed stores.
+  void *openRoot(size_t bytes, bool &created, bool &solo);
+  void shareRoot() const;
+  void closeRoot(void *address, size_t bytes);
+  void removeRoot() const;
+
+  // Creates a zero-filled segment and returns its id. File backed segments are
+  // named after fileId, which must be unique within the database; SysV ones
+  // get an id from the kernel. If pageSize isn't null, it's set to the size
+  // of the pages the segment is guaranteed to get.
+  [[nodiscard]] int create(int fileId, size_t bytes,
+                           size_t *pageSize = nullptr) const;
+  [[nodiscard]] void *attach(int id, size_t bytes) const;
+  void detach(void *address, size_t bytes) const;
+  void remove(int id) const;
+
+  // Flushes a file backed segment to disk. Does nothing for SysV segments.
+  void sync(void *address, size_t bytes) const;
+
+ private:
+  std::string path_;
+  int rootFd_ = -1;
+  SegmentPlacement placement_{};
+
+  [[nodiscard]] std::string segmentPath(int id) const;
+  // Applies the placement to a newly attached segment
+  void placeAttached(void *address, size_t bytes) const;
+};
+
+#endif  // ASSIGNMENT_1_SEGMENTSTORE_H
@@ -2,50 +2,295 @@
 #define ASSIGNMENT_1_SHAREDDATABASE_HPP
 
 #include <fcntl.h>
-#include <semaphore.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <optional>
+#include <type_traits>
 #include <vector>
 
+#include "Catalog.h"
+#include "ChangeFeed.hpp"
+#include "DatabaseStats.h"
+#include "Filter.hpp"
+#include "HashIndex.hpp"
+#include "Journal.h"
+#include "OrderedIndex.hpp"
+#include "SegmentStore.h"
+#include "SnapshotFormat.h"
+#include "StringArena.hpp"
 #include "Utilities.h"
 
 using namespace std::chrono_literals;
 
 constexpr static int METADATA_OFFSET = 0;
-constexpr static int DATABASE_OFFSET = 1;
-constexpr static int DB_VERSION = 2;
-constexpr static int MAX_ENTRIES = 50;
+constexpr static int DB_VERSION = 22;
+// Number of entries allocated when a database is created, unless overridden
+constexpr static size_t DEFAULT_CAPACITY = 50;
+// Maximum number of extents a database can grow to. Every extent is twice as
+// large as the one before it, so this is never the limiting factor in practice
+constexpr static int MAX_EXTENTS = 32;
+// Number of times an optimistic read retries before falling back to the lock
+constexpr static int OPTIMISTIC_READ_RETRIES = 64;
+// Number of slots compact() looks at by default before releasing the lock
+constexpr static size_t COMPACT_CHUNK = 4096;
+// Maximum number of lock stripes a database can have
+constexpr static int MAX_LOCK_STRIPES = 64;
+// Maximum number of multi-version snapshots that can be open at once
+constexpr static int MAX_PINNED_SNAPSHOTS = 64;
+// Number of old versions the version store starts out with room for
+constexpr static size_t INITIAL_VERSION_SLOTS = 64;
+// Longest journal path a database can be created with, including the null
+constexpr static size_t MAX_JOURNAL_PATH = 256;
+// Number of times an optimistic transaction reruns after another process
+// changed the database under it, before it falls back to the lock
+constexpr static int OPTIMISTIC_TXN_RETRIES = 8;
+// Size of the string arena when it's created by the first storeString()
+constexpr static size_t DEFAULT_STRING_ARENA = 64 * 1024;
 
+// The entries of a database are stored in a chain of shared memory segments
+// (extents). The first extent holds extentEntries entries, and extent k holds
+// extentEntries << (k - 1), so the capacity doubles every time the database
+// grows and existing entries never have to move.
+//
+// If the database erases with tombstones, every extent is followed by a
+// bitmap with a bit set for each slot that has been erased, and numEntries
+// counts erased slots too. The erased slots that aren't past the compaction
+// cursor are kept on a free list, linked through the slots themselves.
+//
+// If the database has a key column, every extent also stores the key of each
+// of its slots in a separate array after that, so the keys can be scanned
+// without pulling in the rest of every entry.
+//
+// If the database has lock stripes, slot i also belongs to stripe
+// i % numStripes. Entries can then be read or changed in place while holding
+// lock shared and just their stripe's lock, so writers to different stripes
+// don't wait for each other.
+//
+// If the database is multi-version, every extent ends with a version column
+// holding the version each slot was last written at, and a link to the
+// versions it held before then in the version store. Old versions are only
+// kept while a snapshot that might need them is pinned.
+//
+// If the database has a change feed, every change to it is also published to
+// a ring of the most recent changes in a segment of its own, for subscribe().
+//
+// If the database is ordered, a B+-tree from the entries' OrderOf keys to
+// their slots is kept in another segment, for range(). It's changed under the
+// write lock, like the hash index.
+//
+// Strings stored with storeString() are kept in a segment of their own too,
+// and entries refer to them by offset, so they can be shorter than a fixed
+// size array that has to fit the longest one.
 struct DatabaseMetadata {
-  // Must be locked before editing the metadata
-  sem_t lock;
+  // Must be read-locked before reading and write-locked before editing the
+  // metadata or the database. With lock stripes, read-locking it only freezes
+  // the metadata, and the stripes must be locked too to read entries
+  SharedRWLock lock;
+  uint32_t numStripes;
+  SharedRWLock stripes[MAX_LOCK_STRIPES];
   uint32_t version;
+  // schemaHash<T>() of the entries, so a program with a different idea of
+  // what they look like can't open the database
+  uint64_t schemaHash;
   std::size_t passwordHash;
-  int readerCount;
   size_t numEntries;
+  bool tombstones;
+  size_t numErased;
+  size_t erasedInExtent[MAX_EXTENTS];
+  // Erased slot plus one, or 0 if the free list is empty
+  size_t freeHead;
+  // An incremental compaction is in progress. Everything before compactWrite
+  // has been compacted, and everything from there up to compactRead has been
+  // moved down or was erased.
+  bool compacting;
+  size_t compactRead;
+  size_t compactWrite;
+  // Incremented whenever entries move to a different slot, which invalidates
+  // EntryHandles
+  uint32_t epoch;
+  // Limit on numEntries, set when the database is created
   size_t maxEntries;
+  // Number of entries that fit in the extents allocated so far
+  size_t capacity;
+  size_t extentEntries;
+  // Incremented whenever an extent is added, so that attached processes know
+  // to attach the new extents
+  uint32_t generation;
+  uint32_t numExtents;
+  // SegmentStore ids of the extents and the index
+  int extentSegments[MAX_EXTENTS];
+  // Used to name the segments of file backed databases
+  int nextSegmentId;
+  // Hash index over the entries' keys, if the database is indexed. indexSlots
+  // is 0 if it isn't. indexUsed counts slots that are in use or deleted, since
+  // both lengthen probes.
+  int indexSegment;
+  size_t indexSlots;
+  size_t indexUsed;
+  bool keyColumn;
+  // sizeof the key type, to catch handles with a different key extractor
+  size_t keySize;
+  // Sequence counter for optimistic readers. Writers make it odd when they
+  // take the write lock and even again when they release it, so a reader that
+  // sees the same even value before and after copying got an untorn entry.
+  std::atomic<uint32_t> sequence;
+  bool multiVersion;
+  // Incremented by every in-place write to a multi-version database
+  std::atomic<uint64_t> commitVersion;
+  // The versions pinned by open snapshots, plus one, or 0 if unused
+  std::atomic<uint64_t> pins[MAX_PINNED_SNAPSHOTS];
+  // Must be held to use the version store. Taken after a stripe, never before
+  SharedRWLock versionLock;
+  int versionSegment;
+  size_t versionSlots;
+  // Where to start looking for a free version slot
+  size_t versionCursor;
+  // Path of the database's journal, or empty if it doesn't have one
+  char journalPath[MAX_JOURNAL_PATH];
+  JournalState journal;
+  // Ring of recent changes, if feedRecords isn't 0
+  int feedSegment;
+  size_t feedRecords;
+  ChangeFeedState feed;
+  // Incremented by every change to the database, so optimistic transactions
+  // can tell whether anything changed while they ran
+  std::atomic<uint64_t> changes;
+  DatabaseStats stats;
+  // Ordered index over the entries' OrderOf keys, if orderedSegment isn't -1.
+  // Node ids stay the same when it grows into a bigger segment.
+  int orderedSegment;
+  size_t orderedNodes;
+  // sizeof the OrderOf key type, like keySize
+  size_t orderedKeySize;
+  OrderedIndexState ordered;
+  // String arena, if arenaSegment isn't -1. Offsets stay the same when it
+  // grows into a bigger segment.
+  int arenaSegment;
+  size_t arenaBytes;
+  StringArenaState arena;
+  // How every segment after the metadata is backed
+  SegmentPlacement placement;
 };
 
-template <typename T>
-struct Database {
-  // Must be locked before editing the database
-  sem_t lock;
-  T entries[MAX_ENTRIES];
+// Per-process options used when opening a SharedDatabase. The capacity
+// options only take effect if the database is created.
+struct SharedDatabaseOptions {
+  std::chrono::milliseconds semTimeout = 5s;
+  std::chrono::milliseconds semSleep = 0s;
+  bool clean = false;
+  // Read entries without taking the read lock, retrying if a writer raced the
+  // copy. Falls back to the locked path if the retries run out.
+  bool optimisticReads = false;
+  // Number of entries to allocate up front
+  size_t capacity = DEFAULT_CAPACITY;
+  // Limit on the number of entries the database can grow to. 0 means it can
+  // grow until it runs out of extents.
+  size_t maxCapacity = 0;
+  // Make erase() O(1) by leaving a tombstone in the erased slot instead of
+  // moving every later entry down. The space is reused by insert() and
+  // reclaimed by compact().
+  bool tombstoneErase = false;
+  // Also store the entries' keys in a column of their own, as well as in the
+  // entries, so that findKeys() only has to read the keys. Needs a KeyOf.
+  bool keyColumn = false;
+  // Store the database in files starting with this path, rather than in SysV
+  // shared memory, so that it survives restarts and reopens without having
+  // to be loaded again. The id is ignored.
+  std::string path;
+  // Split the entries between this many locks, so that set() (and at() if the
+  // database isn't indexed or ordered) only lock out other processes using the
+  // stripe. Anything that changes the structure of the database, or the key
+  // of an indexed entry, still locks the whole thing. 0 turns striping off.
+  // Optimistic reads aren't used on striped databases.
+  size_t lockStripes = 0;
+  // Keep old versions of entries for snapshots, so snapshot() and scan() read
+  // a consistent version of the database without locking out set() and at().
+  // Changes to the structure (adding or removing entries) still wait for
+  // snapshots to finish. Uses one lock stripe if lockStripes isn't set.
+  bool multiVersion = false;
+  // Record every change in a write-ahead journal at this path, so that the
+  // database survives a crash or reboot. Changes are on disk by the time they
+  // return. If the database is created and the journal already exists, the
+  // database is rebuilt from it. checkpoint() shrinks the journal back down
+  // to one record.
+  std::string journalPath;
+  // Keep a ring of at least this many of the most recent changes, so that
+  // other processes can follow them with subscribe() instead of rereading the
+  // database. 0 turns the change feed off.
+  size_t changeFeed = 0;
+  // Bytes to allocate up front for strings stored with storeString(). The
+  // arena grows as needed. 0 leaves it to the first storeString().
+  size_t stringArena = 0;
+  // Back large segments with huge pages if there are any free, falling back
+  // to normal pages if not. stats() shows which the entries got.
+  bool hugePages = false;
+  // Spread the segments over NUMA nodes, or keep them to some, so the memory
+  // isn't all on whichever node first touched it. numaNodes has a bit for
+  // each node to use, or 0 for all of them.
+  NumaPolicy numaPolicy = NumaPolicy::DEFAULT;
+  uint64_t numaNodes = 0;
+};
+
+// Refers to an entry by the slot it is stored in, which doesn't change when
+// other entries are added or erased, unlike its index. Handles are
+// invalidated when entries are moved, by a non-tombstone erase() or by
+// compact(), and using one after that throws.
+struct EntryHandle {
+  size_t slot;
+  uint32_t epoch;
+};
+
+// The type of key that KeyOf extracts from a T, or void if there's no index
+template <typename T, typename KeyOf>
+struct IndexKey {
+  using type = std::decay_t<std::invoke_result_t<const KeyOf &, const T &>>;
 };
 
 template <typename T>
+struct IndexKey<T, NoIndex> {
+  using type = void;
+};
+
+template <typename T, typename KeyOf = NoIndex, typename OrderOf = NoIndex>
 //  Implements a database of objects, stored in shared memory, that can be
 //  accessed by multiple processes concurrently.
+//
+//  If KeyOf is given, it is called on entries to get their key, and a hash
+//  index on that key is kept in shared memory so find() doesn't have to scan
+//  the database. Every writable handle on an indexed database must use the
+//  same KeyOf; handles without one are opened read-only.
+//
+//  If OrderOf is given, it is called on entries to get a key to order them
+//  by, which needs a < operator, and a B+-tree on that key is kept in shared
+//  memory for range(). The same rules apply to handles without one.
 class SharedDatabase {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "SharedDatabase entries must be trivially copyable");
+
+  using Key = typename IndexKey<T, KeyOf>::type;
+  constexpr static bool INDEXED = !std::is_void_v<Key>;
+  using OrderKey = typename IndexKey<T, OrderOf>::type;
+  constexpr static bool ORDERED = !std::is_void_v<OrderKey>;
+  static_assert(!ORDERED || std::is_trivially_copyable_v<OrderKey>,
+                "Order keys are stored in shared memory, so they must be "
+                "trivially copyable");
+  // the tree over OrderKey, or a stand-in that's never used if there isn't one
+  using OrderTree = OrderedIndex<std::conditional_t<ORDERED, OrderKey, char>>;
+
  public:
   // Creates a new shared database with the given identifier. If a database
   // with the same identifier already exists, and the password matches, the
@@ -55,225 +300,2794 @@ class SharedDatabase {
                           const std::chrono::milliseconds semTimeout = 5s,
                           const std::chrono::milliseconds semSleep = 0s,
                           const bool clean = false)
-      : semTimeout_(semTimeout), clean_(clean), semSleep_(semSleep) {
+      : SharedDatabase(password, id,
+                       legacyOptions(semTimeout, semSleep, clean)) {}
+
+  SharedDatabase(std::string &password, int id,
+                 const SharedDatabaseOptions &options)
+      : SharedDatabase(password, nullptr, {}, id, options) {}
+
+  // Opens the named table in the catalog, creating it if there isn't one, with
+  // the same password rules. The table is found or added under the catalog's
+  // lock, so concurrent openers never make two, and whoever adds it holds
+  // its lock until it's set up, so the others wait for that without keeping
+  // the rest of the catalog waiting too. A file backed database
+  // (options.path) is named by its path, so the catalog isn't used.
+  SharedDatabase(std::string &password, Catalog &catalog,
+                 const std::string &table,
+                 const SharedDatabaseOptions &options = {})
+      : SharedDatabase(password, &catalog, table, 0, options) {}
+
+  SharedDatabase(const SharedDatabase &) = delete;
+  SharedDatabase &operator=(const SharedDatabase &) = delete;
+
+  ~SharedDatabase() {
+    flushOps(&metadata_->stats, &pendingOps_);
+    if (clean_ && !dropped_) {
+      if (catalog_ != nullptr) {
+        try {
+          auto catalogLock = catalog_->writeLock();
+          forget();
+        } catch (const std::exception &) {
+          // the segments are still removed, and find() forgets them later
+        }
+      }
+      removeSegments();
+    }
+    detachSegments();
+  };
+
+  // Deletes a table opened from a catalog, removing it from the catalog and
+  // all its segments, like a clean handle closing it but right away. Opening
+  // the table again creates a new, empty one. Other handles on the table
+  // still work until they close, but see none of the new one.
+  void drop() {
+    if (catalog_ == nullptr) {
+      throw std::logic_error("Only tables in a catalog can be dropped");
+    }
+    if (dropped_) {
+      return;
+    }
+    // always the catalog first, like opening
+    auto catalogLock = catalog_->writeLock();
+    auto writeLock = getWriteLock();
+    forget();
+    removeSegments();
+    dropped_ = true;
+  }
+
+ private:
+  // The options the arguments of the first constructor stand for, set by
+  // name since SharedDatabaseOptions keeps growing
+  static SharedDatabaseOptions legacyOptions(
+      std::chrono::milliseconds semTimeout, std::chrono::milliseconds semSleep,
+      bool clean) {
+    SharedDatabaseOptions options;
+    options.semTimeout = semTimeout;
+    options.semSleep = semSleep;
+    options.clean = clean;
+    return options;
+  }
+
+  SharedDatabase(std::string &password, Catalog *catalog,
+                 const std::string &table, int id,
+                 const SharedDatabaseOptions &options)
+      : store_(options.path),
+        clean_(options.clean),
+        optimisticReads_(options.optimisticReads),
+        semTimeout_(options.semTimeout),
+        semSleep_(options.semSleep),
+        catalog_(catalog),
+        table_(table) {
     // this is a terrible hash function, but it works for the purposes of this
     // project
     std::size_t passwordHash = std::hash<std::string>{}(password);
 
-    // generate key_t using ftok() from current executable file path and the id
-    auto metadataKey = ftok(".", id + METADATA_OFFSET);
-    auto databaseKey = ftok(".", id + DATABASE_OFFSET);
+    if (options.capacity == 0 ||
+        (options.maxCapacity != 0 && options.maxCapacity < options.capacity)) {
+      throw std::invalid_argument("Invalid database capacity");
+    }
+    // the free list is linked through the erased entries
+    if (options.tombstoneErase && sizeof(T) < sizeof(size_t)) {
+      throw std::invalid_argument("Entries are too small for tombstone erase");
+    }
+    if (options.keyColumn && !INDEXED) {
+      throw std::invalid_argument("A key column needs a key extractor");
+    }
+    if (options.lockStripes > MAX_LOCK_STRIPES) {
+      throw std::invalid_argument("Too many lock stripes");
+    }
+    if (options.journalPath.size() >= MAX_JOURNAL_PATH) {
+      throw std::invalid_argument("Journal path is too long");
+    }
 
-    // create shared memory segment for metadata
-    metadataShmid_ = shmget(metadataKey, sizeof(DatabaseMetadata),
-                            IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    bool created = true;
+    bool solo = false;
+    // held while the table is looked up or added, if it's in a catalog
+    std::shared_ptr<SharedRWLock> catalogLock;
+    if (store_.fileBacked()) {
+      catalog_ = nullptr;
+      metadata_ = static_cast<DatabaseMetadata *>(
+          store_.openRoot(sizeof(DatabaseMetadata), created, solo));
+    } else {
+      if (catalog_ != nullptr) {
+        catalogLock = catalog_->writeLock();
+        metadataShmid_ = catalog_->find(table_);
+        if (metadataShmid_ != -1) {
+          created = false;
+        } else {
+          metadataShmid_ = catalog_->add(table_, sizeof(DatabaseMetadata));
+        }
+      } else {
+        // generate key_t using ftok() from current executable file path and
+        // the id
+        auto metadataKey = ftok(".", id + METADATA_OFFSET);
 
-    if (metadataShmid_ != 1 || errno == EEXIST) {
-      if (errno == EEXIST) {
-        // get shmid of existing database metadata
-        metadataShmid_ = shmget(metadataKey, sizeof(DatabaseMetadata), 0);
+        // create shared memory segment for metadata
+        metadataShmid_ = shmget(metadataKey, sizeof(DatabaseMetadata),
+                                IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+        if (metadataShmid_ == -1 && errno == EEXIST) {
+          // get shmid of existing database metadata
+          created = false;
+          metadataShmid_ = shmget(metadataKey, sizeof(DatabaseMetadata), 0);
+        }
       }
+      if (metadataShmid_ == -1) {
+        throw std::system_error(errno, std::generic_category(),
+                                "Creating/attaching database metadata shared "
+                                "memory segment failed");
+      }
+
       // attach metadata_ to shared memory segment
       metadata_ =
           static_cast<DatabaseMetadata *>(shmat(metadataShmid_, nullptr, 0));
       if (metadata_ == reinterpret_cast<DatabaseMetadata *>(-1)) {
+        auto error = errno;
+        if (created && catalog_ != nullptr) {
+          forget();
+          shmctl(metadataShmid_, IPC_RMID, nullptr);
+        }
         throw std::system_error(
-            errno, std::generic_category(),
+            error, std::generic_category(),
             "Attaching to database metadata shared memory segment failed");
       }
+      if (!created && catalog_ != nullptr) {
+        catalogLock.reset();
+        // Whoever added the table held its lock before letting go of the
+        // catalog, and holds it until it's set up, which can take a while if
+        // there's a journal to replay. Wait for that here rather than keeping
+        // everyone else out of the catalog.
+        acquireReadLock(&metadata_->lock, semTimeout_).reset();
+        if (metadata_->version == 0) {
+          shmdt(metadata_);
+          throw std::runtime_error("Database failed to initialize: " + table_);
+        }
+      }
+    }
 
-      // if the metadata segment was created, initialize it
-      if (errno != EEXIST) {
-        sem_init(&metadata_->lock, 1, 1);
-        auto metadataLock = acquireSem(&metadata_->lock);
-        metadata_->version = DB_VERSION;
-        metadata_->passwordHash = passwordHash;
-        metadata_->readerCount = 0;
-        metadata_->numEntries = 0;
-        metadata_->maxEntries = MAX_ENTRIES;
+    // if the metadata segment was created, initialize it
+    if (created) {
+      initRWLock(&metadata_->lock);
+      metadata_->numStripes = options.lockStripes;
+      if (options.multiVersion && options.lockStripes == 0) {
+        metadata_->numStripes = 1;
+      }
+      for (auto &stripe : metadata_->stripes) {
+        initRWLock(&stripe);
+      }
+      auto metadataLock = acquireWriteLock(&metadata_->lock);
+      // the version stays 0 until the rest is set up, so anyone who opens
+      // the table in the meantime can tell if setting it up failed
+      catalogLock.reset();
+      metadata_->schemaHash = schemaHash<T>();
+      metadata_->placement = {options.hugePages, options.numaPolicy,
+                              options.numaNodes};
+      store_.place(metadata_->placement);
+      metadata_->passwordHash = passwordHash;
+      metadata_->numEntries = 0;
+      metadata_->tombstones = options.tombstoneErase;
+      metadata_->numErased = 0;
+      std::fill(std::begin(metadata_->erasedInExtent),
+                std::end(metadata_->erasedInExtent), 0);
+      metadata_->freeHead = 0;
+      metadata_->compacting = false;
+      metadata_->compactRead = 0;
+      metadata_->compactWrite = 0;
+      metadata_->epoch = 0;
+      metadata_->maxEntries = options.maxCapacity;
+      metadata_->capacity = 0;
+      metadata_->extentEntries = options.capacity;
+      metadata_->generation = 0;
+      metadata_->numExtents = 0;
+      metadata_->nextSegmentId = 0;
+      metadata_->indexSegment = -1;
+      metadata_->indexSlots = 0;
+      metadata_->indexUsed = 0;
+      metadata_->keyColumn = options.keyColumn;
+      if constexpr (INDEXED) {
+        metadata_->keySize = sizeof(Key);
+      } else {
+        metadata_->keySize = 0;
+      }
+      metadata_->sequence.store(0);
+      metadata_->multiVersion = options.multiVersion;
+      metadata_->commitVersion.store(0);
+      for (auto &pin : metadata_->pins) {
+        pin.store(0);
+      }
+      initRWLock(&metadata_->versionLock);
+      metadata_->versionSegment = -1;
+      metadata_->versionSlots = 0;
+      metadata_->versionCursor = 0;
+      // the length was checked above, so the null fits
+      std::memcpy(metadata_->journalPath, options.journalPath.c_str(),
+                  options.journalPath.size() + 1);
+      metadata_->feedSegment = -1;
+      metadata_->feedRecords = 0;
+      ChangeFeed::init(&metadata_->feed);
+      metadata_->changes.store(0);
+      ::resetStats(&metadata_->stats);
+      metadata_->orderedSegment = -1;
+      metadata_->orderedNodes = 0;
+      metadata_->orderedKeySize = 0;
+      metadata_->arenaSegment = -1;
+      metadata_->arenaBytes = 0;
+      StringArena::init(&metadata_->arena);
+      try {
+        if (options.stringArena != 0) {
+          moveArena(options.stringArena);
+        }
+        if (options.changeFeed != 0) {
+          metadata_->feedRecords = ChangeFeed::recordsFor(options.changeFeed);
+          metadata_->feedSegment =
+              store_.create(metadata_->nextSegmentId++, feedBytes());
+        }
+        addExtent();
+        if constexpr (ORDERED) {
+          rebuildOrdered();
+        }
+        if (!options.journalPath.empty()) {
+          // the database is empty, so it can be rebuilt from the journal
+          journal_ = openJournal();
+          journal_->replay([this](JournalOp op, uint64_t slot,
+                                  const void *records, size_t count) {
+            applyJournal(op, slot, static_cast<const T *>(records), count);
+          });
+        }
+      } catch (...) {
+        // don't leave a half built database behind for others to attach to
         metadataLock.reset();
+        if (catalog_ != nullptr) {
+          try {
+            auto lock = catalog_->writeLock();
+            forget();
+          } catch (const std::exception &) {
+            // find() forgets it once the segments are gone
+          }
+        }
+        removeSegments();
+        detachSegments();
+        throw;
+      }
+      metadata_->version = DB_VERSION;
+      metadataLock.reset();
+    } else if (solo && metadata_->version == DB_VERSION) {
+      // a file backed database that nobody has open. Whoever had it open last
+      // may have died holding the lock or in the middle of a write
+      initRWLock(&metadata_->lock);
+      for (auto &stripe : metadata_->stripes) {
+        initRWLock(&stripe);
+      }
+      if (metadata_->sequence.load() & 1) {
+        metadata_->sequence.fetch_add(1);
+      }
+      initRWLock(&metadata_->versionLock);
+      for (auto &pin : metadata_->pins) {
+        pin.store(0);
+      }
+      initRWLock(&metadata_->journal.appendLock);
+      initRWLock(&metadata_->journal.syncLock);
+      if (metadata_->feedRecords != 0) {
+        attachFeed();
+        feed_->recover();
       }
-
-    } else {
-      throw std::system_error(
-          errno, std::generic_category(),
-          "Creating/attaching database metadata shared memory segment failed");
+    }
+    if (solo) {
+      store_.shareRoot();
     }
 
     if (metadata_->version != DB_VERSION) {
       throw std::runtime_error("Database version mismatch");
     }
+    if (metadata_->schemaHash != schemaHash<T>()) {
+      throw std::runtime_error("Database schema mismatch");
+    }
+    store_.place(metadata_->placement);
 
     readOnly_ = passwordHash != metadata_->passwordHash;
+    if (!journal_ && metadata_->journalPath[0] != '\0') {
+      journal_ = openJournal();
+    }
+    if (!feed_ && metadata_->feedRecords != 0) {
+      attachFeed();
+    }
 
-    databaseShmid_ = shmget(databaseKey, sizeof(Database<T>),
-                            IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-
-    if (databaseShmid_ != -1 || errno == EEXIST) {
-      if (errno == EEXIST) {
-        // get shmid of existing database
-        databaseShmid_ = shmget(databaseKey, sizeof(Database<T>), 0);
+    if constexpr (INDEXED) {
+      if (metadata_->keyColumn && metadata_->keySize != sizeof(Key)) {
+        throw std::runtime_error("Database key type mismatch");
       }
-
-      // attach database_ to shared memory segment
-      database_ = static_cast<Database<T> *>(shmat(databaseShmid_, nullptr, 0));
-      if (database_ == reinterpret_cast<Database<T> *>(-1)) {
-        throw std::system_error(
-            errno, std::generic_category(),
-            "Attaching to database shared memory segment failed");
+      // index a database that was created by a process without a key
+      if (!readOnly_ && metadata_->indexSlots == 0) {
+        auto writeLock = getWriteLock();
+        if (metadata_->indexSlots == 0) {
+          rebuildIndex();
+        }
+      }
+    } else {
+      // we can't keep someone else's index up to date
+      readOnly_ = readOnly_ || metadata_->indexSlots != 0;
+    }
+    if constexpr (ORDERED) {
+      if (metadata_->orderedSegment != -1 &&
+          metadata_->orderedKeySize != sizeof(OrderKey)) {
+        throw std::runtime_error("Database order key type mismatch");
       }
-      if (errno != EEXIST) {
-        sem_init(&database_->lock, 1, 1);
+      if (!readOnly_ && metadata_->orderedSegment == -1) {
+        auto writeLock = getWriteLock();
+        if (metadata_->orderedSegment == -1) {
+          rebuildOrdered();
+        }
       }
     } else {
-      throw std::system_error(
-          errno, std::generic_category(),
-          "Creating/attaching database shared memory segment failed");
+      readOnly_ = readOnly_ || metadata_->orderedSegment != -1;
     }
-    //    std::cout << "Database shmid: " << databaseShmid << std::endl;
   };
 
-  ~SharedDatabase() {
-    if (clean_) {
-      shmctl(metadataShmid_, IPC_RMID, nullptr);
-      shmctl(databaseShmid_, IPC_RMID, nullptr);
-    }
-  };
+ public:
 
   // Returns a copy of the element at the given index.
   [[nodiscard]] T get(size_t index) const {
-    if (index >= metadata_->numEntries) {
-      throw std::out_of_range("Index out of bounds");
+    countOp(StatOp::GET);
+    if (optimisticReads_ && !striped()) {
+      T data;
+      if (tryOptimisticGet(index, data)) {
+        return data;
+      }
     }
 
-    auto readLock = getReadLock();
+    auto [slot, readLock] = lockSlot([&] { return slotOf(index); }, false);
     // Return a copy of the data
-    return database_->entries[index];
+    return *entry(slot);
+  }
+
+  // Returns a copy of the element the handle refers to.
+  [[nodiscard]] T get(EntryHandle handle) const {
+    countOp(StatOp::GET);
+    auto [slot, readLock] = lockSlot([&] { return slotOf(handle); }, false);
+    return *entry(slot);
+  }
+
+  // Returns a handle to the element at the given index.
+  [[nodiscard]] EntryHandle handle(size_t index) const {
+    auto readLock = getReadLock();
+    return {slotOf(index), metadata_->epoch};
   }
 
   // Clear all elements in the database
   void clear() {
-    auto writeLock = getWriteLock();
-    for (size_t i = 0; i < metadata_->numEntries; i++) {
-      database_->entries[i] = {};
+    countOp(StatOp::CLEAR);
+    uint64_t position;
+    {
+      auto writeLock = getWriteLock();
+      clearSlots();
+      position = journal(JournalOp::CLEAR);
+      publish(ChangeOp::CLEARED);
     }
-    metadata_->numEntries = 0;
+    waitDurable(position);
   }
 
   // Returns a shared pointer to the element at the given index. The database is
   // locked while the pointer is in use, and unlocked when the pointer is
-  // destroyed.
+  // destroyed. Indexed and ordered databases are always locked as a whole,
+  // since the caller may change the key.
   [[nodiscard]] std::shared_ptr<T> at(size_t index) {
-    // check if index is within bounds
-    if (index >= metadata_->numEntries) {
-      throw std::out_of_range("Index out of bounds");
-    }
+    return atLocked([&] { return slotOf(index); });
+  };
 
-    auto writeLock = getWriteLock();
-    // Return a shared pointer to the data, with a deleter that holds a
-    // reference to the lock pointer until
-    return {&database_->entries[index], [writeLock](T *data) {}};
+  // Same as at(index), for the element the handle refers to.
+  [[nodiscard]] std::shared_ptr<T> at(EntryHandle handle) {
+    return atLocked([&] { return slotOf(handle); });
   };
 
   // Deletes the element at the given index.
   void erase(size_t index) {
-    // check if index is within bounds
-    if (index >= metadata_->numEntries) {
-      throw std::out_of_range("Index out of bounds");
+    eraseLocked([&] { return slotOf(index); });
+  };
+
+  // Deletes the element the handle refers to.
+  void erase(EntryHandle handle) {
+    eraseLocked([&] { return slotOf(handle); });
+  };
+
+  // Adds an element to the database, reusing an erased slot if there is one,
+  // and returns a handle to it. Unlike push_back(), the element doesn't
+  // necessarily end up at the end.
+  EntryHandle insert(T data) {
+    countOp(StatOp::INSERT);
+    EntryHandle handle;
+    uint64_t position;
+    {
+      auto writeLock = getWriteLock();
+      handle = {insertSlot(data), metadata_->epoch};
+      position = journal(JournalOp::INSERT, 0, &data, 1);
+      publish(ChangeOp::ADDED, handle.slot);
     }
+    waitDurable(position);
+    return handle;
+  }
 
-    // decrement numEntries
-    auto writeLock = getWriteLock();
-    // shift all entries after the one being deleted down by one
-    for (size_t i = index; i < metadata_->numEntries - 1; i++) {
-      database_->entries[i] = database_->entries[i + 1];
+  // Reclaims the slots left behind by tombstone erases, by moving entries
+  // down over them. Looks at no more than maxSlots slots per call, so the
+  // write lock is only held briefly, and returns true once the database is
+  // fully compacted. Entries keep their order, but their handles become
+  // invalid.
+  bool compact(size_t maxSlots = COMPACT_CHUNK) {
+    countOp(StatOp::COMPACT);
+    bool done;
+    uint64_t position;
+    {
+      auto writeLock = getWriteLock();
+      auto epoch = metadata_->epoch;
+      done = compactSlots(maxSlots);
+      position = journal(JournalOp::COMPACT, maxSlots);
+      if (metadata_->epoch != epoch) {
+        publish(ChangeOp::COMPACTED);
+      }
     }
-    metadata_->numEntries--;
-  };
+    waitDurable(position);
+    return done;
+  }
 
-  // Adds an element to the end of the database.
+  // Adds an element to the end of the database, growing it if it is at
+  // capacity.
   void push_back(T data) {
-    if (metadata_->numEntries >= metadata_->maxEntries) {
-      throw std::out_of_range("Database is full");
+    countOp(StatOp::PUSH_BACK);
+    uint64_t position;
+    {
+      auto writeLock = getWriteLock();
+      auto slot = appendSlot(data);
+      position = journal(JournalOp::APPEND, 0, &data, 1);
+      publish(ChangeOp::ADDED, slot);
     }
-    auto writeLock = getWriteLock();
-    database_->entries[metadata_->numEntries] = data;
-    metadata_->numEntries++;
+    waitDurable(position);
   };
 
+  // Adds all the given elements to the end of the database. The write lock is
+  // only taken once, and the elements are copied in one run per extent they
+  // land in. Either all of them are added or none are.
+  void push_back_bulk(const T *data, size_t count) {
+    countOp(StatOp::PUSH_BACK, count);
+    uint64_t position;
+    {
+      auto writeLock = getWriteLock();
+      appendBulk(data, count);
+      position = journal(JournalOp::APPEND, 0, data, count);
+      metadata_->changes.fetch_add(1);
+      if (feed_) {
+        // the new entries are the last count, so their indexes are too
+        auto slot = metadata_->numEntries - count;
+        auto index = size() - count;
+        for (size_t i = 0; i < count; i++) {
+          feed_->publish(ChangeOp::ADDED, index + i, feedKey(slot + i));
+        }
+      }
+    }
+    waitDurable(position);
+  }
+
+  void push_back_bulk(const std::vector<T> &data) {
+    push_back_bulk(data.data(), data.size());
+  }
+
   // Sets the element at the given index to the given data.
   void set(size_t index, T data) {
-    // check if index is within bounds
-    if (index >= metadata_->numEntries) {
-      throw std::out_of_range("Index out of bounds");
+    setLocked([&] { return slotOf(index); }, data);
+  };
+
+  // Sets the element the handle refers to to the given data.
+  void set(EntryHandle handle, T data) {
+    setLocked([&] { return slotOf(handle); }, data);
+  };
+
+  // Calls body(batch) with the write lock held, so every change it makes
+  // through batch takes one lock round trip between them, and nothing else
+  // sees the database halfway through. With a journal, the changes are synced
+  // to disk together once the lock is released. If body throws, the changes
+  // it made before then are undone, as in transaction(), which this is
+  // without the option of running optimistically.
+  template <typename F>
+  void batch(F &&body) {
+    lockedTransaction(body);
+  }
+
+  // The reads and changes of a transaction(). Changes take effect together
+  // when the transaction commits, or not at all if it throws.
+  class Txn {
+   public:
+    // In an optimistic transaction, the reads see the database as it was
+    // before the transaction, without its own changes, and the indexes given
+    // to set() and erase() mean the entries the reads saw at them.
+    [[nodiscard]] size_t size() const { return db_->size(); }
+
+    [[nodiscard]] T get(size_t index) const {
+      if (optimistic_) {
+        return db_->get(index);
+      }
+      db_->countOp(StatOp::GET);
+      return *db_->entry(db_->slotOf(index));
     }
 
-    auto writeLock = getWriteLock();
-    database_->entries[index] = data;
+    // Same as SharedDatabase::find()
+    template <typename K = Key,
+              typename = std::enable_if_t<!std::is_void_v<K>>>
+    [[nodiscard]] std::optional<size_t> find(const K &key) const {
+      if (optimistic_) {
+        return db_->find(key);
+      }
+      db_->countOp(StatOp::FIND);
+      auto slot = db_->findSlot(key);
+      if (!slot) {
+        return std::nullopt;
+      }
+      return db_->indexOf(*slot);
+    }
+
+    void set(size_t index, const T &data) {
+      Change queued{};
+      queued.op = JournalOp::SET;
+      queued.index = index;
+      queued.after = data;
+      change(queued);
+    }
+
+    void push_back(const T &data) {
+      Change queued{};
+      queued.op = JournalOp::APPEND;
+      queued.after = data;
+      change(queued);
+    }
+
+    void erase(size_t index) {
+      Change queued{};
+      queued.op = JournalOp::ERASE;
+      queued.index = index;
+      change(queued);
+    }
+
+   private:
+    friend class SharedDatabase;
+
+    // A change, and once it's made, what's needed to undo, journal and
+    // publish it. A pending change holds the slot its index pointed at when
+    // it was queued, and the epoch that slot was in.
+    struct Change {
+      JournalOp op;
+      size_t slot;
+      size_t index;
+      uint64_t key;
+      T before;
+      T after;
+      uint32_t epoch;
+    };
+
+    Txn(SharedDatabase *db, bool optimistic)
+        : db_(db),
+          optimistic_(optimistic),
+          start_(db->metadata_->changes.load()) {}
+
+    SharedDatabase *db_;
+    bool optimistic_;
+    // the database's change count when the transaction started
+    uint64_t start_;
+    // changes waiting for an optimistic transaction to commit
+    std::vector<Change> pending_;
+    // changes made so far, in order
+    std::vector<Change> made_;
+
+    void change(Change change) {
+      if (!optimistic_) {
+        make(change);
+        return;
+      }
+      // the index means the entry the reads saw there, wherever earlier
+      // changes in the transaction leave it
+      if (change.op != JournalOp::APPEND) {
+        auto handle = db_->handle(change.index);
+        change.slot = handle.slot;
+        change.epoch = handle.epoch;
+      }
+      pending_.push_back(change);
+    }
+
+    // Returns true if a pending change's slot may have been moved by someone
+    // else since it was queued. Must be called with the write lock held.
+    [[nodiscard]] bool stale() const {
+      for (const auto &change : pending_) {
+        if (change.op != JournalOp::APPEND &&
+            change.epoch != db_->metadata_->epoch) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Returns the slot a change applies to, which for a pending change was
+    // worked out when it was queued
+    [[nodiscard]] size_t slotFor(const Change &change) const {
+      if (!optimistic_) {
+        return db_->slotOf(change.index);
+      }
+      if (change.slot >= db_->metadata_->numEntries ||
+          db_->isErased(change.slot)) {
+        throw std::out_of_range("Entry was erased");
+      }
+      return change.slot;
+    }
+
+    // Makes a change to the database. Must be called with the write lock held
+    void make(Change change) {
+      auto db = db_;
+      switch (change.op) {
+        case JournalOp::SET:
+          db->countOp(StatOp::SET);
+          change.slot = slotFor(change);
+          change.index = db->indexOf(change.slot);
+          change.before = *db->entry(change.slot);
+          db->setSlot(change.slot, change.after);
+          change.key = db->feedKey(change.slot);
+          break;
+        case JournalOp::APPEND:
+          db->countOp(StatOp::PUSH_BACK);
+          change.slot = db->appendSlot(change.after);
+          change.index = db->size() - 1;
+          change.key = db->feedKey(change.slot);
+          break;
+        case JournalOp::ERASE:
+          db->countOp(StatOp::ERASE);
+          change.slot = slotFor(change);
+          change.index = db->indexOf(change.slot);
+          change.before = *db->entry(change.slot);
+          change.key = db->feedKey(change.slot);
+          db->eraseSlot(change.slot);
+          break;
+        default:
+          throw std::logic_error("Not a transaction change");
+      }
+      made_.push_back(change);
+    }
+
+    // Makes the pending changes of an optimistic transaction, undoing them
+    // all if one fails. Must be called with the write lock held.
+    void makePending() {
+      try {
+        for (size_t i = 0; i < pending_.size(); i++) {
+          make(pending_[i]);
+          if (pending_[i].op != JournalOp::ERASE ||
+              db_->metadata_->tombstones) {
+            continue;
+          }
+          // the erase moved every later entry down a slot, so follow them
+          auto erased = made_.back().slot;
+          for (auto later = pending_.begin() + i + 1; later != pending_.end();
+               later++) {
+            if (later->op == JournalOp::APPEND || later->slot < erased) {
+              continue;
+            }
+            later->slot = later->slot == erased ? SIZE_MAX : later->slot - 1;
+          }
+        }
+      } catch (...) {
+        rollback();
+        throw;
+      }
+    }
+
+    // Undoes the changes made so far, newest first
+    void rollback() {
+      for (auto change = made_.rbegin(); change != made_.rend(); change++) {
+        switch (change->op) {
+          case JournalOp::SET:
+            db_->setSlot(change->slot, change->before);
+            break;
+          case JournalOp::APPEND:
+            db_->popSlot();
+            break;
+          default:
+            db_->uneraseSlot(change->slot, change->before);
+            break;
+        }
+      }
+      made_.clear();
+    }
+
+    // Journals and publishes the changes, now that they're all made, and
+    // returns the journal position to wait for. The changes go in the journal
+    // as one transaction, so a crash part way through writing them loses
+    // them all. Must be called with the write lock still held.
+    uint64_t commit() {
+      if (made_.empty()) {
+        return 0;
+      }
+      uint64_t position = 0;
+      if (db_->journal_) {
+        std::vector<JournalChange> changes;
+        for (const auto &change : made_) {
+          bool erase = change.op == JournalOp::ERASE;
+          changes.push_back({change.op, change.slot,
+                             erase ? nullptr : &change.after,
+                             erase ? 0u : 1u});
+        }
+        position = db_->journal_->appendTransaction(changes);
+      }
+      for (const auto &change : made_) {
+        bool erase = change.op == JournalOp::ERASE;
+        if (db_->feed_) {
+          auto op = erase                             ? ChangeOp::ERASED
+                    : change.op == JournalOp::APPEND ? ChangeOp::ADDED
+                                                      : ChangeOp::CHANGED;
+          db_->feed_->publish(op, change.index, change.key);
+        }
+      }
+      db_->metadata_->changes.fetch_add(1);
+      return position;
+    }
+  };
+
+  // Runs body(txn), where txn can read the database and make changes to it
+  // that take effect together or not at all: if body throws, none of them
+  // are made. Nothing else sees the database in between them.
+  //
+  // Normally body runs with the write lock held. If optimistic is true, it
+  // runs without it, its reads take the read lock one at a time, and its
+  // changes are saved up and made at the end under the write lock, as long
+  // as nobody else changed the database while body ran. Otherwise body runs
+  // again, so it must not have other side effects, and after
+  // OPTIMISTIC_TXN_RETRIES tries it runs under the write lock instead.
+  template <typename F>
+  void transaction(F &&body, bool optimistic = false) {
+    countOp(StatOp::TRANSACTION);
+    uint64_t position;
+    for (int attempt = 0; optimistic && attempt < OPTIMISTIC_TXN_RETRIES;
+         attempt++) {
+      Txn txn(this, true);
+      try {
+        body(txn);
+      } catch (const std::out_of_range &) {
+        // probably an index that another process's change made stale
+        if (metadata_->changes.load() == txn.start_) {
+          throw;
+        }
+        continue;
+      }
+      {
+        auto writeLock = getWriteLock();
+        if (metadata_->changes.load() != txn.start_ || txn.stale()) {
+          continue;
+        }
+        txn.makePending();
+        position = txn.commit();
+      }
+      waitDurable(position);
+      return;
+    }
+    lockedTransaction(body);
+  }
+
+  // The changes batch() makes under its write lock. The methods work like the
+  // database's own, but nothing else can read or change the database in
+  // between them.
+  using Batch = Txn;
+
+  // A private copy of an element, made by edit(), that can be changed for as
+  // long as it takes without holding any lock, and then written back with
+  // commit().
+  class Edit {
+   public:
+    T &operator*() { return data_; }
+    T *operator->() { return &data_; }
+
+    // Writes the changes back, unless the element has been changed, moved or
+    // erased since the copy was made, in which case nothing is written and
+    // false is returned.
+    bool commit() { return db_->commitEdit(handle_, original_, data_); }
+
+   private:
+    friend class SharedDatabase;
+    Edit(SharedDatabase *db, EntryHandle handle, const T &data)
+        : db_(db), handle_(handle), original_(data), data_(data) {}
+
+    SharedDatabase *db_;
+    EntryHandle handle_;
+    T original_;
+    T data_;
+  };
+
+  // Returns a copy of the element at the given index to be changed and
+  // committed. Unlike at(), nothing is locked while it's being changed.
+  [[nodiscard]] Edit edit(size_t index) {
+    countOp(StatOp::EDIT);
+    if (readOnly_) {
+      throw std::runtime_error("Database is read-only");
+    }
+    auto [slot, readLock] = lockSlot([&] { return slotOf(index); }, false);
+    return {this, {slot, metadata_->epoch}, *entry(slot)};
+  }
+
+  // Returns the index of the first element with the given key, if there is
+  // one. Uses the hash index, so it doesn't have to look at every element.
+  template <typename K = Key, typename = std::enable_if_t<!std::is_void_v<K>>>
+  [[nodiscard]] std::optional<size_t> find(const K &key) const {
+    countOp(StatOp::FIND);
+    auto readLock = getReadLock();
+    auto slot = findSlot(key);
+    if (!slot) {
+      return std::nullopt;
+    }
+    return indexOf(*slot);
+  }
+
+  // Same as find(), but returns a handle to the element.
+  template <typename K = Key, typename = std::enable_if_t<!std::is_void_v<K>>>
+  [[nodiscard]] std::optional<EntryHandle> findHandle(const K &key) const {
+    countOp(StatOp::FIND);
+    auto readLock = getReadLock();
+    auto slot = findSlot(key);
+    if (!slot) {
+      return std::nullopt;
+    }
+    return EntryHandle{*slot, metadata_->epoch};
+  }
+
+  // Returns the indexes of all the elements whose key satisfies pred, in
+  // order. If the database has a key column, only the keys are read, in
+  // blocks of 64 that the compiler can vectorize for simple predicates.
+  template <typename Pred, typename K = Key,
+            typename = std::enable_if_t<!std::is_void_v<K>>>
+  [[nodiscard]] std::vector<size_t> findKeys(Pred &&pred) const {
+    countOp(StatOp::FIND);
+    auto readLock = getReadLock();
+    syncSegments();
+    std::vector<size_t> found;
+    if (!metadata_->keyColumn) {
+      size_t index = 0;
+      for (size_t slot = 0; slot < metadata_->numEntries; slot++) {
+        if (!isErased(slot)) {
+          if (pred(KeyOf{}(*entry(slot)))) {
+            found.push_back(index);
+          }
+          index++;
+        }
+      }
+      return found;
+    }
+
+    size_t index = 0;
+    auto remaining = metadata_->numEntries;
+    for (uint32_t extent = 0; remaining > 0; extent++) {
+      auto count = std::min(remaining, extentSize(extent));
+      const Key *keys = keyColumn(extent);
+      const uint64_t *erased =
+          metadata_->erasedInExtent[extent] == 0 ? nullptr : tombstones(extent);
+      for (size_t block = 0; block < count; block += 64) {
+        auto blockSize = std::min<size_t>(64, count - block);
+        uint64_t matches = 0;
+        for (size_t i = 0; i < blockSize; i++) {
+          matches |= static_cast<uint64_t>(pred(keys[block + i]) ? 1 : 0) << i;
+        }
+        uint64_t live = blockSize == 64 ? ~0ull : (1ull << blockSize) - 1;
+        if (erased != nullptr) {
+          live &= ~erased[block / 64];
+        }
+        index = addMatches(found, index, matches, live);
+      }
+      remaining -= count;
+    }
+    return found;
+  }
+
+  // Returns the indexes of all the elements that match filter, in order, all
+  // under one read lock. Filters are made with where() and startsWith() and
+  // combined with && and ||, and are run over the entries 64 at a time (see
+  // Filter.hpp).
+  template <typename Filter, typename = std::enable_if_t<IS_FILTER<Filter>>>
+  [[nodiscard]] std::vector<size_t> select(const Filter &filter) const {
+    countOp(StatOp::SELECT);
+    auto readLock = getReadLock();
+    std::vector<size_t> found;
+    size_t index = 0;
+    filterBlocks(filter, [&](const T *, uint64_t matches, uint64_t live) {
+      index = addMatches(found, index, matches, live);
+    });
+    return found;
+  }
+
+  // Same as select(), but returns copies of the matching elements, made under
+  // the same lock, rather than indexes that may be stale by the time they're
+  // used
+  template <typename Filter, typename = std::enable_if_t<IS_FILTER<Filter>>>
+  [[nodiscard]] std::vector<T> selectEntries(const Filter &filter) const {
+    countOp(StatOp::SELECT);
+    auto readLock = getReadLock();
+    std::vector<T> found;
+    filterBlocks(filter,
+                 [&](const T *entries, uint64_t matches, uint64_t live) {
+                   for (matches &= live; matches != 0; matches &= matches - 1) {
+                     found.push_back(entries[__builtin_ctzll(matches)]);
+                   }
+                 });
+    return found;
+  }
+
+  // The elements with keys from low to high, inclusive, in key order, as
+  // returned by range(). Elements with the same key are in slot order.
+  // Writers are locked out for as long as it exists.
+  class OrderedRange {
+   public:
+    class iterator {
+     public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = T;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const T *;
+      using reference = const T &;
+
+      // iterators walk the leaves, and turn into end() when they get to the
+      // first position past the range
+      iterator(const SharedDatabase *db, typename OrderTree::Position position,
+               typename OrderTree::Position end)
+          : db_(db), position_(position), end_(end) {
+        stopAtEnd();
+      }
+      reference operator*() const { return *operator->(); }
+      pointer operator->() const { return db_->entry(slot()); }
+      // A handle to the current element, for changing it once the range is
+      // gone
+      [[nodiscard]] EntryHandle handle() const {
+        return {slot(), db_->metadata_->epoch};
+      }
+      iterator &operator++() {
+        db_->orderedView().advance(position_);
+        stopAtEnd();
+        return *this;
+      }
+      iterator operator++(int) {
+        auto old = *this;
+        ++*this;
+        return old;
+      }
+      bool operator==(const iterator &other) const {
+        return position_.node == other.position_.node &&
+               position_.index == other.position_.index;
+      }
+      bool operator!=(const iterator &other) const {
+        return !(*this == other);
+      }
+
+     private:
+      const SharedDatabase *db_;
+      typename OrderTree::Position position_;
+      typename OrderTree::Position end_;
+
+      void stopAtEnd() {
+        if (position_.node == end_.node && position_.index == end_.index) {
+          position_ = {0, 0};
+        }
+      }
+
+      [[nodiscard]] size_t slot() const {
+        return db_->orderedView().slot(position_);
+      }
+    };
+
+    [[nodiscard]] iterator begin() const { return {db_, begin_, end_}; }
+    [[nodiscard]] iterator end() const { return {db_, {0, 0}, end_}; }
+
+   private:
+    friend class SharedDatabase;
+    OrderedRange(const SharedDatabase *db, std::shared_ptr<void> readLock,
+                 typename OrderTree::Position begin,
+                 typename OrderTree::Position end)
+        : db_(db), readLock_(std::move(readLock)), begin_(begin), end_(end) {}
+
+    const SharedDatabase *db_;
+    std::shared_ptr<void> readLock_;
+    typename OrderTree::Position begin_;
+    // the first position past high, where iteration stops
+    typename OrderTree::Position end_;
   };
 
+  // Returns the elements whose keys are between low and high, inclusive, in
+  // key order, holding the read lock until the range is destroyed. Uses the
+  // ordered index, so only the elements in the range are looked at.
+  template <typename K = OrderKey,
+            typename = std::enable_if_t<!std::is_void_v<K>>>
+  [[nodiscard]] OrderedRange range(const K &low, const K &high) const {
+    countOp(StatOp::RANGE);
+    auto readLock = getReadLock();
+    syncSegments();
+    if (metadata_->orderedSegment == -1) {
+      // a read-only handle on a database nobody has ordered yet
+      throw std::runtime_error("Database has no ordered index");
+    }
+    auto tree = orderedView();
+    auto begin = tree.lowerBound(low);
+    auto end = tree.upperBound(high);
+    if (high < low) {
+      begin = end;
+    }
+    return {this, std::move(readLock), begin, end};
+  }
+
   // Returns the number of elements in the database.
-  [[nodiscard]] size_t size() const { return metadata_->numEntries; };
+  [[nodiscard]] size_t size() const {
+    return metadata_->numEntries - metadata_->numErased;
+  };
 
   // Returns a shared pointer to the size of the database.
   //
   // This guarantees that the size of the database will not change while the
   // consumer is holding the shared pointer.
   [[nodiscard]] std::shared_ptr<size_t> smartSize() const {
+    // the size is a copy, since with tombstones it isn't stored anywhere, but
+    // it can't go stale while the lock is held alongside it
+    auto sizeLock = std::make_shared<std::pair<std::shared_ptr<void>, size_t>>(
+        getReadLock(), 0);
+    sizeLock->second = size();
+    return {sizeLock, &sizeLock->second};
+  }
+
+  // Calls callback(element) for every element in the database, in order,
+  // while holding the read lock once for the whole scan. The elements are
+  // passed by reference to avoid copying them, so the references must not be
+  // kept after the callback returns.
+  template <typename F>
+  void scan(F &&callback) const {
+    countOp(StatOp::SCAN);
+    if (metadata_->multiVersion) {
+      // read a pinned version rather than locking out writers for the scan
+      for (const auto &element : snapshot()) {
+        callback(element);
+      }
+      return;
+    }
     auto readLock = getReadLock();
-    return {&metadata_->numEntries, [readLock](size_t *size) {
-              std::cout << "smartSize() deleter" << std::endl;
-              // do nothing, but hold a reference to the lock in the deleter so
-              // that it doesn't get destroyed before the shared pointer
-            }};
+    syncSegments();
+    auto remaining = metadata_->numEntries;
+    // walk the extents directly rather than locating every index
+    for (uint32_t extent = 0; remaining > 0; extent++) {
+      auto count = std::min(remaining, extentSize(extent));
+      const T *entries = extents_[extent];
+      if (metadata_->erasedInExtent[extent] == 0) {
+        for (size_t i = 0; i < count; i++) {
+          callback(entries[i]);
+        }
+      } else {
+        auto erased = tombstones(extent);
+        for (size_t i = 0; i < count; i++) {
+          if (!(erased[i / 64] & (1ull << (i % 64)))) {
+            callback(entries[i]);
+          }
+        }
+      }
+      remaining -= count;
+    }
   }
 
-  // Returns the maximum number of elements in the database.
-  [[nodiscard]] size_t maxSize() const { return metadata_->maxEntries; };
+  // Writes every element to a binary snapshot at the given path, from a
+  // snapshot() of the database. See SnapshotFormat.h for the format. Throws a std::logic_error
+  // if the database holds strings stored with storeString(), since the
+  // snapshot would only have their offsets into this database's arena.
+  void dump(const std::string &path) const {
+    // storeString() needs the write lock, which the snapshot keeps out until
+    // everything is written
+    auto view = snapshot();
+    if (metadata_->arena.live != 0) {
+      throw std::logic_error("Databases with stored strings can't be dumped");
+    }
+    SnapshotWriter writer(path, sizeof(T), schemaHash<T>());
+    for (const auto &element : view) {
+      writer.write(&element, 1);
+    }
+    writer.finish();
+  }
 
- private:
-  DatabaseMetadata *metadata_;
-  Database<T> *database_;
-  bool readOnly_;
-  bool clean_;
-  std::chrono::milliseconds semTimeout_;
-  std::chrono::milliseconds semSleep_;
-  int metadataShmid_;
-  int databaseShmid_;
+  // Appends the elements in a binary snapshot written by dump(). The snapshot
+  // is checked before anything is added, and is mapped rather than read in
+  // unless map is false. Throws a std::system_error if it can't be read and a
+  // std::runtime_error if it is corrupt or holds something other than T.
+  void restore(const std::string &path, bool map = true) {
+    static_assert(alignof(T) <= alignof(SnapshotHeader),
+                  "Snapshot records would be misaligned");
+    SnapshotReader reader(path, sizeof(T), schemaHash<T>(), map);
+    push_back_bulk(static_cast<const T *>(reader.records()), reader.count());
+  }
 
-  // readLock(). Returns something that automatically unlocks the semaphore when
-  // destroyed. (out of scope)
-  [[nodiscard]] std::shared_ptr<void> getReadLock() const {
-    runWithLock(
-        &metadata_->lock, [&]() { metadata_->readerCount++; }, semTimeout_);
+  // A consistent view of the database that can be iterated over with a
+  // range-based for loop. Writers are locked out for as long as the snapshot
+  // exists, unless the database is multi-version, in which case only changes
+  // to its structure are, and the elements are read as of the version the
+  // snapshot pinned.
+  class Snapshot {
+   public:
+    class iterator {
+     public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = T;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const T *;
+      using reference = const T &;
+
+      // iterators walk slots, skipping erased ones
+      iterator(const SharedDatabase *db, size_t slot, uint64_t version)
+          : db_(db), slot_(db->nextLiveSlot(slot)), version_(version) {}
+      reference operator*() const { return *operator->(); }
+      pointer operator->() const {
+        if (version_ == 0) {
+          return db_->entry(slot_);
+        }
+        // the entry may be written in place while we read it, so copy it
+        db_->readVersion(slot_, version_ - 1, current_);
+        return &current_;
+      }
+      iterator &operator++() {
+        slot_ = db_->nextLiveSlot(slot_ + 1);
+        return *this;
+      }
+      iterator operator++(int) {
+        auto old = *this;
+        ++*this;
+        return old;
+      }
+      bool operator==(const iterator &other) const {
+        return slot_ == other.slot_;
+      }
+      bool operator!=(const iterator &other) const {
+        return slot_ != other.slot_;
+      }
+
+     private:
+      const SharedDatabase *db_;
+      size_t slot_;
+      // the pinned version plus one, or 0 to read the entries directly
+      uint64_t version_;
+      mutable T current_;
+    };
+
+    [[nodiscard]] iterator begin() const { return {db_, 0, version_}; }
+    [[nodiscard]] iterator end() const {
+      return {db_, db_->metadata_->numEntries, version_};
+    }
+    [[nodiscard]] size_t size() const { return db_->size(); }
+    [[nodiscard]] T operator[](size_t index) const {
+      return *iterator(db_, db_->slotOf(index), version_);
+    }
+
+   private:
+    friend class SharedDatabase;
+    Snapshot(const SharedDatabase *db, std::shared_ptr<void> readLock,
+             uint64_t version = 0)
+        : db_(db), readLock_(std::move(readLock)), version_(version) {}
+
+    const SharedDatabase *db_;
+    std::shared_ptr<void> readLock_;
+    uint64_t version_;
+  };
+
+  // Returns a snapshot of the database, holding the read lock (or a pinned
+  // version, if the database is multi-version) until it is destroyed.
+  [[nodiscard]] Snapshot snapshot() const {
+    countOp(StatOp::SNAPSHOT);
+    if (!metadata_->multiVersion) {
+      return {this, getReadLock()};
+    }
+    // only lock the structure, so the slots stay put
+    auto structureLock = timedLock(&metadata_->lock, false, StatLock::READ);
     std::this_thread::sleep_for(semSleep_);
-    // can't just init a shared_ptr<void> with nullptr
-    return {nullptr, [this](void *) {
-              runWithLock(
-                  &metadata_->lock, [&]() { metadata_->readerCount--; },
-                  semTimeout_);
-            }};
+    uint64_t version;
+    auto pin = pinVersion(version);
+    return {this,
+            {nullptr, [structureLock, pin](void *) mutable { pin.reset(); }},
+            version + 1};
   }
 
-  [[nodiscard]] std::shared_ptr<void> getWriteLock() const {
-    // throw an error if we are in read-only mode
-    if (readOnly_) {
-      throw std::runtime_error("Database is read-only");
+  // Returns the counters every process using the database adds to, with this
+  // handle's ops counted so far. Other handles add theirs in batches of
+  // STAT_OP_BATCH, and when they close. Print them with <<. They're all 0 if
+  // built with SHARED_DATABASE_STATS=0.
+  [[nodiscard]] const DatabaseStats &stats() const {
+    flushOps(&metadata_->stats, &pendingOps_);
+    return metadata_->stats;
+  }
+
+  // Zeroes the counters, for every process using the database
+  void resetStats() const {
+    for (auto &op : pendingOps_.ops) {
+      op.store(0, std::memory_order_relaxed);
     }
+    ::resetStats(&metadata_->stats);
+  }
 
-    auto currentTime = std::chrono::system_clock::now();
-    // while there are readers, wait for them to finish. Use the semTimeout_
-    // to prevent deadlock
-    while (metadata_->readerCount > 0) {
-      if (std::chrono::system_clock::now() - currentTime > semTimeout_) {
-        throw std::runtime_error("Timed out waiting for readers to finish");
-      }
-      std::this_thread::sleep_for(1ms);  // so we don't spinlock
+  // Returns the position in the change feed of the next change, to pass to
+  // subscribe(). Take it before reading the database, so no change made after
+  // the read is missed. Throws if the database has no change feed.
+  [[nodiscard]] uint64_t changeCursor() const {
+    if (!feed_) {
+      throw std::runtime_error("Database has no change feed");
     }
-    auto metadataLock = acquireSem(&metadata_->lock);
-    auto databaseLock = acquireSem(&database_->lock);
-    std::this_thread::sleep_for(semSleep_);
-    return {nullptr, [metadataLock, databaseLock](void *) {}};
+    return feed_->head();
+  }
+
+  // Returns the changes made since cursor, in order, and moves cursor past
+  // them. If there aren't any, sleeps until another process makes one, or
+  // returns nothing once the timeout runs out. A subscriber that falls too far
+  // behind gets an OVERRUN in place of the changes it missed. Never takes the
+  // database lock, so it doesn't hold up writers however often it's called.
+  [[nodiscard]] std::vector<ChangeEvent> subscribe(
+      uint64_t &cursor, std::chrono::milliseconds timeout = 1000ms) const {
+    countOp(StatOp::SUBSCRIBE);
+    if (!feed_) {
+      throw std::runtime_error("Database has no change feed");
+    }
+    return feed_->read(cursor, timeout);
+  }
+
+  // Copies text into the database's string arena and returns a reference to
+  // it that can be stored in an element and read back from any process with
+  // getString(). The string is kept until releaseString() is called on it, or
+  // the database is cleared. Strings aren't journaled, so this throws if the
+  // database has a journal.
+  StringRef storeString(std::string_view text) {
+    if (metadata_->journalPath[0] != '\0') {
+      throw std::runtime_error("Strings can't be stored with a journal");
+    }
+    // before fits(), which only knows the block sizes up to this
+    if (text.size() > STRING_MAX_LENGTH) {
+      throw std::length_error("String is too long for the arena");
+    }
+    auto writeLock = getWriteLock();
+    auto arena = arenaView();
+    if (!arena.fits(text.size())) {
+      auto needed =
+          metadata_->arena.used + StringArena::blockBytes(text.size());
+      auto bytes = std::max(metadata_->arenaBytes, DEFAULT_STRING_ARENA);
+      while (bytes < needed) {
+        bytes *= 2;
+      }
+      if (bytes > STRING_ARENA_MAX_BYTES) {
+        throw std::length_error("String arena is full");
+      }
+      moveArena(bytes);
+      arena = arenaView();
+    }
+    return arena.store(text);
+  }
+
+  // Frees a string stored with storeString() for reuse. Nothing may refer to
+  // it afterwards.
+  void releaseString(StringRef string) {
+    auto writeLock = getWriteLock();
+    arenaView().release(string);
+  }
+
+  // Returns a copy of a string stored with storeString()
+  [[nodiscard]] std::string getString(StringRef string) const {
+    auto readLock = getReadLock();
+    return std::string(arenaView().view(string));
+  }
+
+  // Compares a string stored with storeString() to text, like
+  // std::string::compare(), without copying it out
+  [[nodiscard]] int compareString(StringRef string,
+                                  std::string_view text) const {
+    auto readLock = getReadLock();
+    return arenaView().view(string).compare(text);
+  }
+
+  // Flushes a file backed database to disk, so that it is consistent there as
+  // of now, and replaces the journal, if there is one, with a single record
+  // of everything in the database. Writers are locked out while it runs. Does
+  // nothing for databases in SysV shared memory without a journal, which
+  // don't outlive a reboot anyway.
+  void checkpoint() const {
+    if (!store_.fileBacked() && !journal_) {
+      return;
+    }
+    auto readLock = getReadLock();
+    syncSegments();
+    if (store_.fileBacked()) {
+      for (uint32_t i = 0; i < extents_.size(); i++) {
+        store_.sync(extents_[i], extentBytes(i));
+      }
+      if (index_ != nullptr) {
+        store_.sync(index_, indexBytes_);
+      }
+      if (orderedNodes_ != nullptr) {
+        store_.sync(orderedNodes_, orderedBytes_);
+      }
+      if (arena_ != nullptr) {
+        store_.sync(arena_, arenaBytes_);
+      }
+      store_.sync(metadata_, sizeof(DatabaseMetadata));
+    }
+    if (journal_) {
+      std::vector<T> entries;
+      entries.reserve(metadata_->numEntries - metadata_->numErased);
+      for (size_t slot = 0; slot < metadata_->numEntries; slot++) {
+        if (!isErased(slot)) {
+          entries.push_back(*entry(slot));
+        }
+      }
+      journal_->rewrite(entries.data(), entries.size());
+    }
+  }
+
+  // Returns the maximum number of elements in the database, or 0 if it can
+  // keep growing.
+  [[nodiscard]] size_t maxSize() const { return metadata_->maxEntries; };
+
+  // Returns the number of elements the database can hold before it has to
+  // grow.
+  [[nodiscard]] size_t capacity() const { return metadata_->capacity; };
+
+ private:
+  // The version a slot was last written at, and the old version it held
+  // before that, plus one, or 0 if no snapshot needed it
+  struct SlotVersion {
+    uint64_t version;
+    size_t older;
+  };
+
+  // A version of an entry that was current from version from until version
+  // to, kept in the version store for pinned snapshots. Free if to is older
+  // than every pinned version
+  struct OldVersion {
+    uint64_t from;
+    uint64_t to;
+    size_t older;
+    T data;
+  };
+
+  DatabaseMetadata *metadata_;
+  // this process's attachments of the extents, in order
+  mutable std::vector<T *> extents_;
+  // the metadata generation that extents_ was last synced with
+  mutable uint32_t generation_ = 0;
+  // this process's attachment of the hash index
+  mutable HashIndexSlot *index_ = nullptr;
+  mutable int indexSegment_ = -1;
+  mutable size_t indexBytes_ = 0;
+  // this process's attachment of the ordered index
+  mutable typename OrderTree::Node *orderedNodes_ = nullptr;
+  mutable int orderedSegment_ = -1;
+  mutable size_t orderedBytes_ = 0;
+  // this process's attachment of the string arena
+  mutable char *arena_ = nullptr;
+  mutable int arenaSegment_ = -1;
+  mutable size_t arenaBytes_ = 0;
+  // this process's attachment of the version store
+  mutable OldVersion *versions_ = nullptr;
+  mutable int versionSegment_ = -1;
+  mutable size_t versionsBytes_ = 0;
+  SegmentStore store_;
+  std::unique_ptr<Journal> journal_;
+  // this process's attachment of the change feed
+  ChangeRecord *feedRecords_ = nullptr;
+  std::optional<ChangeFeed> feed_;
+  bool readOnly_;
+  bool clean_;
+  bool optimisticReads_;
+  // ops this handle hasn't added to the stats yet
+  mutable PendingOps pendingOps_{};
+  std::chrono::milliseconds semTimeout_;
+  std::chrono::milliseconds semSleep_;
+  int metadataShmid_ = -1;
+  // the catalog the database was opened from, if any, and its name there
+  Catalog *catalog_;
+  std::string table_;
+  bool dropped_ = false;
+
+  // Runs filter over the entries a block of up to 64 at a time, calling
+  // add(entries, matches, live) with the block's first entry, a bit for each
+  // entry that matched, and a bit for each that isn't erased. Must be called
+  // with the read lock held.
+  template <typename Filter, typename F>
+  void filterBlocks(const Filter &filter, F &&add) const {
+    static_assert(std::is_same_v<typename Filter::Entry, T>,
+                  "Filter is for a different type");
+    syncSegments();
+    auto remaining = metadata_->numEntries;
+    for (uint32_t extent = 0; remaining > 0; extent++) {
+      auto count = std::min(remaining, extentSize(extent));
+      const T *entries = extents_[extent];
+      const uint64_t *erased =
+          metadata_->erasedInExtent[extent] == 0 ? nullptr : tombstones(extent);
+      for (size_t block = 0; block < count; block += FILTER_BLOCK) {
+        auto blockSize = std::min(FILTER_BLOCK, count - block);
+        uint64_t live = blockSize == 64 ? ~0ull : (1ull << blockSize) - 1;
+        if (erased != nullptr) {
+          live &= ~erased[block / 64];
+        }
+        // erased slots are checked too, but never match
+        add(entries + block, filter.match(entries + block, blockSize), live);
+      }
+      remaining -= count;
+    }
+  }
+
+  // Adds the index of every live slot in a block of 64 with its bit set in
+  // matches to found, given the index of the block's first live slot, and
+  // returns the index of the next block's
+  static size_t addMatches(std::vector<size_t> &found, size_t index,
+                           uint64_t matches, uint64_t live) {
+    matches &= live;
+    // the index of each match is the number of live slots before it
+    for (; matches != 0; matches &= matches - 1) {
+      auto bit = __builtin_ctzll(matches);
+      found.push_back(index + __builtin_popcountll(live & ((1ull << bit) - 1)));
+    }
+    return index + __builtin_popcountll(live);
+  }
+
+  // Returns the size of the given extent, in entries
+  [[nodiscard]] size_t extentSize(uint32_t extent) const {
+    return extent == 0 ? metadata_->extentEntries
+                       : metadata_->extentEntries << (extent - 1);
+  }
+
+  // Returns the extent holding the given index, and the index within it
+  [[nodiscard]] std::pair<uint32_t, size_t> locate(size_t index) const {
+    auto extentEntries = metadata_->extentEntries;
+    if (index < extentEntries) {
+      return {0, index};
+    }
+    // extent k starts at extentEntries << (k - 1)
+    uint32_t extent = 64 - __builtin_clzll(index / extentEntries);
+    return {extent, index - (extentEntries << (extent - 1))};
+  }
+
+  // Attaches any extents or index that other processes have added since we
+  // last looked. Must be called with the lock held.
+  void syncSegments() const {
+    if (generation_ == metadata_->generation) {
+      return;
+    }
+    for (auto i = static_cast<uint32_t>(extents_.size());
+         i < metadata_->numExtents; i++) {
+      extents_.push_back(static_cast<T *>(
+          store_.attach(metadata_->extentSegments[i], extentBytes(i))));
+    }
+    if (indexSegment_ != metadata_->indexSegment) {
+      if (index_ != nullptr) {
+        store_.detach(index_, indexBytes_);
+        index_ = nullptr;
+      }
+      indexSegment_ = metadata_->indexSegment;
+      if (indexSegment_ != -1) {
+        indexBytes_ = metadata_->indexSlots * sizeof(HashIndexSlot);
+        index_ = static_cast<HashIndexSlot *>(
+            store_.attach(indexSegment_, indexBytes_));
+      }
+    }
+    if (orderedSegment_ != metadata_->orderedSegment) {
+      if (orderedNodes_ != nullptr) {
+        store_.detach(orderedNodes_, orderedBytes_);
+        orderedNodes_ = nullptr;
+      }
+      orderedSegment_ = metadata_->orderedSegment;
+      if (orderedSegment_ != -1) {
+        orderedBytes_ =
+            metadata_->orderedNodes * sizeof(typename OrderTree::Node);
+        orderedNodes_ = static_cast<typename OrderTree::Node *>(
+            store_.attach(orderedSegment_, orderedBytes_));
+      }
+    }
+    if (arenaSegment_ != metadata_->arenaSegment) {
+      if (arena_ != nullptr) {
+        store_.detach(arena_, arenaBytes_);
+        arena_ = nullptr;
+      }
+      arenaSegment_ = metadata_->arenaSegment;
+      if (arenaSegment_ != -1) {
+        arenaBytes_ = metadata_->arenaBytes;
+        arena_ = static_cast<char *>(store_.attach(arenaSegment_, arenaBytes_));
+      }
+    }
+    generation_ = metadata_->generation;
+  }
+
+  // Returns a pointer to the entry at the given index. Must be called with
+  // the lock held.
+  [[nodiscard]] T *entry(size_t index) const {
+    syncSegments();
+    auto [extent, offset] = locate(index);
+    return extents_[extent] + offset;
+  }
+
+  // Allocates the next extent. Must be called with the write lock held.
+  void addExtent() {
+    if (metadata_->numExtents == MAX_EXTENTS) {
+      throw std::out_of_range("Database is full");
+    }
+    auto size = extentSize(metadata_->numExtents);
+    auto bytes = extentBytes(metadata_->numExtents);
+    size_t pageSize;
+    auto segment = store_.create(metadata_->nextSegmentId, bytes, &pageSize);
+    metadata_->nextSegmentId++;
+    metadata_->stats.pageSize.store(pageSize);
+    if (pageSize > static_cast<size_t>(sysconf(_SC_PAGESIZE))) {
+      metadata_->stats.hugePageBytes.fetch_add(bytes);
+    }
+    metadata_->extentSegments[metadata_->numExtents] = segment;
+    metadata_->numExtents++;
+    metadata_->capacity += size;
+    metadata_->generation++;
+  }
+
+  [[nodiscard]] static size_t alignUp(size_t bytes, size_t alignment) {
+    return (bytes + alignment - 1) / alignment * alignment;
+  }
+
+  // Byte offset of the given extent's tombstone bitmap within the extent
+  [[nodiscard]] size_t tombstonesOffset(uint32_t extent) const {
+    return alignUp(extentSize(extent) * sizeof(T), alignof(uint64_t));
+  }
+
+  // Byte offset of the given extent's key column within the extent
+  [[nodiscard]] size_t keyColumnOffset(uint32_t extent) const {
+    auto offset = extentSize(extent) * sizeof(T);
+    if (metadata_->tombstones) {
+      offset = tombstonesOffset(extent) +
+               tombstoneWords(extent) * sizeof(uint64_t);
+    }
+    if constexpr (INDEXED) {
+      offset = alignUp(offset, alignof(Key));
+    }
+    return offset;
+  }
+
+  // Byte offset of the given extent's version column within the extent
+  [[nodiscard]] size_t versionColumnOffset(uint32_t extent) const {
+    auto offset = keyColumnOffset(extent);
+    if (metadata_->keyColumn) {
+      offset += extentSize(extent) * metadata_->keySize;
+    }
+    return alignUp(offset, alignof(SlotVersion));
+  }
+
+  // Total size of the given extent, in bytes
+  [[nodiscard]] size_t extentBytes(uint32_t extent) const {
+    if (metadata_->multiVersion) {
+      return versionColumnOffset(extent) +
+             extentSize(extent) * sizeof(SlotVersion);
+    }
+    if (metadata_->keyColumn) {
+      return keyColumnOffset(extent) + extentSize(extent) * metadata_->keySize;
+    }
+    return keyColumnOffset(extent);
+  }
+
+  [[nodiscard]] size_t tombstoneWords(uint32_t extent) const {
+    return (extentSize(extent) + 63) / 64;
+  }
+
+  // Returns the tombstone bitmap of the given extent. Must be called with the
+  // lock held.
+  [[nodiscard]] uint64_t *tombstones(uint32_t extent) const {
+    syncSegments();
+    return reinterpret_cast<uint64_t *>(
+        reinterpret_cast<char *>(extents_[extent]) + tombstonesOffset(extent));
+  }
+
+  // Returns the key column of the given extent. Must be called with the lock
+  // held.
+  template <typename K = Key>
+  [[nodiscard]] K *keyColumn(uint32_t extent) const {
+    syncSegments();
+    return reinterpret_cast<K *>(reinterpret_cast<char *>(extents_[extent]) +
+                                 keyColumnOffset(extent));
+  }
+
+  // Copies the key of the entry in the given slot into the key column, if
+  // there is one. Must be called whenever an entry is written.
+  void storeKey(size_t slot) {
+    if constexpr (INDEXED) {
+      if (metadata_->keyColumn) {
+        auto [extent, offset] = locate(slot);
+        keyColumn(extent)[offset] = KeyOf{}(*entry(slot));
+      }
+    }
+  }
+
+  [[nodiscard]] bool isErased(size_t slot) const {
+    if (metadata_->numErased == 0) {
+      return false;
+    }
+    auto [extent, offset] = locate(slot);
+    return tombstones(extent)[offset / 64] & (1ull << (offset % 64));
+  }
+
+  // Marks a slot as erased or live, keeping the counts up to date
+  void setErased(size_t slot, bool erased) {
+    auto [extent, offset] = locate(slot);
+    auto &word = tombstones(extent)[offset / 64];
+    auto bit = 1ull << (offset % 64);
+    if (static_cast<bool>(word & bit) == erased) {
+      return;
+    }
+    word ^= bit;
+    auto change = erased ? 1 : -1;
+    metadata_->erasedInExtent[extent] += change;
+    metadata_->numErased += change;
+  }
+
+  // Returns the first slot at or after the given one that hasn't been erased,
+  // or numEntries if there isn't one
+  [[nodiscard]] size_t nextLiveSlot(size_t slot) const {
+    while (slot < metadata_->numEntries && isErased(slot)) {
+      slot++;
+    }
+    return std::min(slot, metadata_->numEntries);
+  }
+
+  // Returns the slot holding the element at the given index, skipping over
+  // erased slots. Throws if the index is out of bounds.
+  [[nodiscard]] size_t slotOf(size_t index) const {
+    if (index >= size()) {
+      throw std::out_of_range("Index out of bounds");
+    }
+    if (metadata_->numErased == 0) {
+      return index;
+    }
+    // skip whole extents, then whole words, using the erased counts
+    size_t start = 0;
+    for (uint32_t extent = 0;; extent++) {
+      auto count = std::min(extentSize(extent), metadata_->numEntries - start);
+      auto live = count - metadata_->erasedInExtent[extent];
+      if (index >= live) {
+        index -= live;
+        start += count;
+        continue;
+      }
+      auto erased = tombstones(extent);
+      for (size_t word = 0;; word++) {
+        auto bits = std::min<size_t>(64, count - word * 64);
+        auto liveBits = ~erased[word];
+        if (bits < 64) {
+          liveBits &= (1ull << bits) - 1;
+        }
+        auto liveCount = static_cast<size_t>(__builtin_popcountll(liveBits));
+        if (index >= liveCount) {
+          index -= liveCount;
+          continue;
+        }
+        // drop the lowest set bits until the one we want is the lowest
+        for (; index > 0; index--) {
+          liveBits &= liveBits - 1;
+        }
+        return start + word * 64 + __builtin_ctzll(liveBits);
+      }
+    }
+  }
+
+  // Returns the slot the handle refers to, if it is still valid
+  [[nodiscard]] size_t slotOf(EntryHandle handle) const {
+    if (handle.epoch != metadata_->epoch) {
+      throw std::out_of_range("Entry handle is stale");
+    }
+    if (handle.slot >= metadata_->numEntries || isErased(handle.slot)) {
+      throw std::out_of_range("Entry was erased");
+    }
+    return handle.slot;
+  }
+
+  // Returns the index of the element in the given slot
+  [[nodiscard]] size_t indexOf(size_t slot) const {
+    if (metadata_->numErased == 0) {
+      return slot;
+    }
+    auto [slotExtent, offset] = locate(slot);
+    size_t index = 0;
+    for (uint32_t extent = 0; extent < slotExtent; extent++) {
+      index += extentSize(extent) - metadata_->erasedInExtent[extent];
+    }
+    auto erased = tombstones(slotExtent);
+    for (size_t word = 0; word < offset / 64; word++) {
+      index += 64 - __builtin_popcountll(erased[word]);
+    }
+    auto below = (1ull << (offset % 64)) - 1;
+    return index + __builtin_popcountll(~erased[offset / 64] & below);
+  }
+
+  // Adds an element in a new slot at the end, growing the database if it is
+  // at capacity. Must be called with the write lock held.
+  size_t appendSlot(const T &data) {
+    if (metadata_->maxEntries != 0 &&
+        metadata_->numEntries >= metadata_->maxEntries) {
+      throw std::out_of_range("Database is full");
+    }
+    if (metadata_->numEntries == metadata_->capacity) {
+      addExtent();
+    }
+    auto slot = metadata_->numEntries;
+    *entry(slot) = data;
+    storeKey(slot);
+    metadata_->numEntries++;
+    if constexpr (INDEXED) {
+      indexInsert(keyHash(data), slot);
+    }
+    orderedInsert(slot);
+    return slot;
+  }
+
+  // Removes the table from its catalog, if it's still the one there. The
+  // catalog must be write-locked.
+  void forget() {
+    if (catalog_ != nullptr && catalog_->find(table_) == metadataShmid_) {
+      catalog_->remove(table_);
+    }
+  }
+
+  // Removes every segment of the database. They go away once nobody has them
+  // attached.
+  void removeSegments() {
+    for (uint32_t i = 0; i < metadata_->numExtents; i++) {
+      store_.remove(metadata_->extentSegments[i]);
+    }
+    if (metadata_->indexSlots != 0) {
+      store_.remove(metadata_->indexSegment);
+    }
+    if (metadata_->versionSegment != -1) {
+      store_.remove(metadata_->versionSegment);
+    }
+    if (metadata_->feedSegment != -1) {
+      store_.remove(metadata_->feedSegment);
+    }
+    if (metadata_->orderedSegment != -1) {
+      store_.remove(metadata_->orderedSegment);
+    }
+    if (metadata_->arenaSegment != -1) {
+      store_.remove(metadata_->arenaSegment);
+    }
+    if (store_.fileBacked()) {
+      store_.removeRoot();
+    } else {
+      shmctl(metadataShmid_, IPC_RMID, nullptr);
+    }
+  }
+
+  void detachSegments() {
+    for (uint32_t i = 0; i < extents_.size(); i++) {
+      store_.detach(extents_[i], extentBytes(i));
+    }
+    if (index_ != nullptr) {
+      store_.detach(index_, indexBytes_);
+    }
+    if (versions_ != nullptr) {
+      store_.detach(versions_, versionsBytes_);
+    }
+    if (feedRecords_ != nullptr) {
+      store_.detach(feedRecords_, feedBytes());
+    }
+    if (orderedNodes_ != nullptr) {
+      store_.detach(orderedNodes_, orderedBytes_);
+    }
+    if (arena_ != nullptr) {
+      store_.detach(arena_, arenaBytes_);
+    }
+    if (store_.fileBacked()) {
+      store_.closeRoot(metadata_, sizeof(DatabaseMetadata));
+    } else {
+      shmdt(metadata_);
+    }
+  }
+
+  [[nodiscard]] bool striped() const { return metadata_->numStripes != 0; }
+
+  // Locks the database to read or write a single entry in place, and returns
+  // the slot found by locate() once it's locked. On a striped database the
+  // structure is only locked shared, along with the slot's stripe.
+  template <typename F>
+  [[nodiscard]] std::pair<size_t, std::shared_ptr<void>> lockSlot(
+      F &&locate, bool write) const {
+    if (!striped()) {
+      auto lock = write ? getWriteLock() : getReadLock();
+      return {locate(), lock};
+    }
+    if (write && readOnly_) {
+      throw std::runtime_error("Database is read-only");
+    }
+    auto structureLock = timedLock(&metadata_->lock, false, StatLock::READ);
+    auto slot = locate();
+    if (slot == SIZE_MAX) {
+      // nothing to lock, and the caller knows it
+      return {slot, structureLock};
+    }
+    auto stripe = &metadata_->stripes[slot % metadata_->numStripes];
+    auto stripeLock =
+        timedLock(stripe, write,
+                  write ? StatLock::STRIPE_WRITE : StatLock::STRIPE_READ);
+    std::this_thread::sleep_for(semSleep_);
+    // release the stripe before the structure
+    return {slot, {nullptr, [structureLock, stripeLock](void *) mutable {
+                     stripeLock.reset();
+                   }}};
+  }
+
+  template <typename F>
+  [[nodiscard]] std::shared_ptr<T> atLocked(F &&locate) {
+    countOp(StatOp::AT);
+    if constexpr (INDEXED || ORDERED) {
+      auto writeLock = getWriteLock();
+      return atSlot(locate(), writeLock);
+    } else {
+      auto [slot, lock] = lockSlot(locate, true);
+      newVersion(slot);
+      return atSlot(slot, lock);
+    }
+  }
+
+  template <typename F>
+  void eraseLocked(F &&locate) {
+    countOp(StatOp::ERASE);
+    uint64_t position;
+    {
+      auto writeLock = getWriteLock();
+      auto slot = locate();
+      publish(ChangeOp::ERASED, slot);
+      eraseSlot(slot);
+      position = journal(JournalOp::ERASE, slot);
+    }
+    waitDurable(position);
+  }
+
+  template <typename F>
+  void setLocked(F &&locate, const T &data) {
+    countOp(StatOp::SET);
+    uint64_t position;
+    bool done = false;
+    if (striped()) {
+      auto [slot, lock] = lockSlot(locate, true);
+      // changing the key means changing the index, which is shared by every
+      // stripe
+      if (!keysDiffer(*entry(slot), data)) {
+        newVersion(slot);
+        *entry(slot) = data;
+        storeKey(slot);
+        position = journal(JournalOp::SET, slot, &data, 1);
+        publish(ChangeOp::CHANGED, slot);
+        done = true;
+      }
+    }
+    if (!done) {
+      auto writeLock = getWriteLock();
+      auto slot = locate();
+      setSlot(slot, data);
+      position = journal(JournalOp::SET, slot, &data, 1);
+      publish(ChangeOp::CHANGED, slot);
+    }
+    waitDurable(position);
+  }
+
+  // The bodies of clear(), insert(), compact() and push_back_bulk(). Must be
+  // called with the write lock held.
+  void clearSlots() {
+    syncSegments();
+    for (size_t i = 0; i < metadata_->numEntries; i++) {
+      *entry(i) = {};
+    }
+    if (metadata_->tombstones) {
+      for (uint32_t extent = 0; extent < metadata_->numExtents; extent++) {
+        std::memset(tombstones(extent), 0,
+                    tombstoneWords(extent) * sizeof(uint64_t));
+        metadata_->erasedInExtent[extent] = 0;
+      }
+    }
+    metadata_->numEntries = 0;
+    metadata_->numErased = 0;
+    metadata_->freeHead = 0;
+    metadata_->compacting = false;
+    metadata_->epoch++;
+    if constexpr (INDEXED) {
+      std::memset(index_, 0, metadata_->indexSlots * sizeof(HashIndexSlot));
+      metadata_->indexUsed = 0;
+    }
+    if constexpr (ORDERED) {
+      orderedView().rebuild({});
+    }
+    // the strings belonged to the entries
+    StringArena::init(&metadata_->arena);
+  }
+
+  size_t insertSlot(const T &data) {
+    if (metadata_->freeHead == 0) {
+      return appendSlot(data);
+    }
+    auto slot = metadata_->freeHead - 1;
+    std::memcpy(&metadata_->freeHead, entry(slot), sizeof(size_t));
+    *entry(slot) = data;
+    storeKey(slot);
+    setErased(slot, false);
+    if constexpr (INDEXED) {
+      indexInsert(keyHash(data), slot);
+    }
+    orderedInsert(slot);
+    return slot;
+  }
+
+  bool compactSlots(size_t maxSlots) {
+    if (!metadata_->compacting) {
+      if (metadata_->numErased == 0) {
+        return true;
+      }
+      // the free list would hand out slots that are about to be overwritten
+      metadata_->freeHead = 0;
+      metadata_->compacting = true;
+      metadata_->compactRead = 0;
+      metadata_->compactWrite = 0;
+    }
+
+    auto end = std::min(metadata_->numEntries,
+                        metadata_->compactRead + maxSlots);
+    bool moved = false;
+    for (auto slot = metadata_->compactRead; slot < end; slot++) {
+      if (isErased(slot)) {
+        continue;
+      }
+      auto target = metadata_->compactWrite++;
+      if (target != slot) {
+        *entry(target) = *entry(slot);
+        storeKey(target);
+        setErased(target, false);
+        setErased(slot, true);
+        if constexpr (INDEXED) {
+          indexView().move(keyHash(*entry(target)), slot, target);
+        }
+        if constexpr (ORDERED) {
+          orderedView().move(OrderOf{}(*entry(target)), slot, target);
+        }
+        moved = true;
+      }
+    }
+    metadata_->compactRead = end;
+    if (moved) {
+      metadata_->epoch++;
+    }
+    if (end < metadata_->numEntries) {
+      return false;
+    }
+
+    // everything past the write cursor is erased, so drop it
+    for (auto slot = metadata_->compactWrite; slot < metadata_->numEntries;
+         slot++) {
+      setErased(slot, false);
+      *entry(slot) = {};
+    }
+    metadata_->numEntries = metadata_->compactWrite;
+    metadata_->compacting = false;
+    // erases that landed behind the write cursor while we were working are
+    // still there, so put them back on the free list
+    for (auto slot = metadata_->numEntries; slot-- > 0;) {
+      if (isErased(slot)) {
+        std::memcpy(entry(slot), &metadata_->freeHead, sizeof(size_t));
+        metadata_->freeHead = slot + 1;
+      }
+    }
+    return true;
+  }
+
+  void appendBulk(const T *data, size_t count) {
+    auto first = metadata_->numEntries;
+    if (metadata_->maxEntries != 0 && first + count > metadata_->maxEntries) {
+      throw std::out_of_range("Database is full");
+    }
+    while (metadata_->capacity < first + count) {
+      addExtent();
+    }
+    syncSegments();
+    for (size_t copied = 0; copied < count;) {
+      auto [extent, offset] = locate(first + copied);
+      auto run = std::min(count - copied, extentSize(extent) - offset);
+      std::memcpy(extents_[extent] + offset, data + copied, run * sizeof(T));
+      copied += run;
+    }
+    for (size_t i = 0; i < count; i++) {
+      storeKey(first + i);
+    }
+    metadata_->numEntries += count;
+    if constexpr (INDEXED) {
+      if ((metadata_->indexUsed + count) * 2 > metadata_->indexSlots) {
+        rebuildIndex();
+      } else {
+        auto index = indexView();
+        for (size_t i = 0; i < count; i++) {
+          if (index.insert(keyHash(data[i]), first + i)) {
+            metadata_->indexUsed++;
+          }
+        }
+      }
+    }
+    if constexpr (ORDERED) {
+      // sorting everything is quicker than a lot of separate inserts
+      if (count > metadata_->ordered.entries) {
+        rebuildOrdered();
+      } else {
+        for (size_t i = 0; i < count; i++) {
+          orderedInsert(first + i);
+        }
+      }
+    }
+  }
+
+  // Redoes a change read back from the journal. Must be called with the write
+  // lock held.
+  void applyJournal(JournalOp op, uint64_t slot, const T *records,
+                    size_t count) {
+    switch (op) {
+      case JournalOp::APPEND:
+        appendBulk(records, count);
+        break;
+      case JournalOp::INSERT:
+        insertSlot(records[0]);
+        break;
+      case JournalOp::SET:
+        setSlot(slot, records[0]);
+        break;
+      case JournalOp::ERASE:
+        eraseSlot(slot);
+        break;
+      case JournalOp::CLEAR:
+        clearSlots();
+        break;
+      case JournalOp::COMPACT:
+        compactSlots(slot);
+        break;
+      case JournalOp::TRANSACTION:
+        // replay() unwraps these, and only passes on the changes in them
+        break;
+    }
+  }
+
+  [[nodiscard]] std::unique_ptr<Journal> openJournal() const {
+    return std::make_unique<Journal>(metadata_->journalPath,
+                                     &metadata_->journal, sizeof(T),
+                                     schemaHash<T>(), semTimeout_);
+  }
+
+  // Records a change in the journal, if there is one, and returns the
+  // position waitDurable() needs to wait for. Must be called with the lock
+  // that the change was made under still held, so the journal is in the same
+  // order as the changes.
+  uint64_t journal(JournalOp op, uint64_t slot = 0, const T *records = nullptr,
+                   size_t count = 0) const {
+    if (!journal_) {
+      return 0;
+    }
+    return journal_->append(op, slot, records, count);
+  }
+
+  // Waits for a change recorded with journal() to reach the disk. Call it
+  // after releasing the lock, so other writers can join the same sync.
+  void waitDurable(uint64_t position) const {
+    if (journal_) {
+      journal_->sync(position);
+    }
+  }
+
+  [[nodiscard]] size_t feedBytes() const {
+    return metadata_->feedRecords * sizeof(ChangeRecord);
+  }
+
+  // The feed never grows, so it's attached once, up front
+  void attachFeed() {
+    feedRecords_ = static_cast<ChangeRecord *>(
+        store_.attach(metadata_->feedSegment, feedBytes()));
+    feed_.emplace(feedRecords_, metadata_->feedRecords, &metadata_->feed);
+  }
+
+  // Tells subscribers about a change to the entry in slot, or to the whole
+  // database if slot is SIZE_MAX, and counts it for optimistic transactions.
+  // Like journal(), must be called with the lock the change was made under
+  // still held, so the feed is in the same order as the changes. For an
+  // erase, call it before the entry is gone.
+  void publish(ChangeOp op, size_t slot = SIZE_MAX) {
+    metadata_->changes.fetch_add(1);
+    if (!feed_) {
+      return;
+    }
+    if (slot == SIZE_MAX) {
+      feed_->publish(op, 0, 0);
+      return;
+    }
+    feed_->publish(op, indexOf(slot), feedKey(slot));
+  }
+
+  // The key of the entry in slot as a ChangeEvent has it
+  [[nodiscard]] uint64_t feedKey(size_t slot) const {
+    if constexpr (INDEXED) {
+      auto key = KeyOf{}(*entry(slot));
+      if constexpr (std::is_integral_v<Key>) {
+        return static_cast<uint64_t>(key);
+      } else {
+        return std::hash<Key>{}(key);
+      }
+    } else {
+      return 0;
+    }
+  }
+
+  bool commitEdit(EntryHandle handle, const T &original, const T &data) {
+    // the element must still be exactly what the edit started from
+    auto unchanged = [&](size_t slot) {
+      return std::memcmp(entry(slot), &original, sizeof(T)) == 0;
+    };
+    auto locate = [&] {
+      if (handle.epoch != metadata_->epoch ||
+          handle.slot >= metadata_->numEntries || isErased(handle.slot)) {
+        return SIZE_MAX;
+      }
+      return handle.slot;
+    };
+    uint64_t position;
+    if (keysDiffer(original, data)) {
+      // changing the key means changing the index, which is shared by every
+      // stripe
+      auto writeLock = getWriteLock();
+      auto slot = locate();
+      if (slot == SIZE_MAX || !unchanged(slot)) {
+        return false;
+      }
+      setSlot(slot, data);
+      position = journal(JournalOp::SET, slot, &data, 1);
+      publish(ChangeOp::CHANGED, slot);
+    } else {
+      auto [slot, lock] = lockSlot(locate, true);
+      if (slot == SIZE_MAX || !unchanged(slot)) {
+        return false;
+      }
+      newVersion(slot);
+      *entry(slot) = data;
+      storeKey(slot);
+      position = journal(JournalOp::SET, slot, &data, 1);
+      publish(ChangeOp::CHANGED, slot);
+    }
+    waitDurable(position);
+    return true;
+  }
+
+  void setSlot(size_t slot, const T &data) {
+    auto oldData = *entry(slot);
+    *entry(slot) = data;
+    rekey(slot, oldData);
+  }
+
+  // Brings the key column and the indexes up to date after the entry in slot
+  // was changed from old. Must be called with the write lock held.
+  void rekey(size_t slot, const T &old) {
+    storeKey(slot);
+    if constexpr (INDEXED) {
+      reindex(slot, keyHash(old), keyHash(*entry(slot)));
+    }
+    if constexpr (ORDERED) {
+      auto oldKey = OrderOf{}(old);
+      auto newKey = OrderOf{}(*entry(slot));
+      if (oldKey < newKey || newKey < oldKey) {
+        orderedView().remove(oldKey, slot);
+        orderedInsert(slot);
+      }
+    }
+  }
+
+  // Returns true if changing a to b changes a key that an index shared by
+  // every stripe is kept on
+  [[nodiscard]] static bool keysDiffer(const T &a, const T &b) {
+    bool differ = false;
+    if constexpr (INDEXED) {
+      differ = keyHash(a) != keyHash(b);
+    }
+    if constexpr (ORDERED) {
+      auto aKey = OrderOf{}(a);
+      auto bKey = OrderOf{}(b);
+      differ = differ || aKey < bKey || bKey < aKey;
+    }
+    return differ;
+  }
+
+  [[nodiscard]] std::shared_ptr<T> atSlot(size_t slot,
+                                          const std::shared_ptr<void> &writeLock) {
+    // Return a shared pointer to the data, with a deleter that holds a
+    // reference to the lock pointer until the caller is done with it. The
+    // change is journaled and published then, but since a deleter can't
+    // throw, errors syncing the journal are lost
+    if constexpr (INDEXED || ORDERED) {
+      // the caller may change the keys, so reindex the entry when they're done
+      auto old = *entry(slot);
+      return {entry(slot),
+              [this, lock = writeLock, slot, old](T *data) mutable {
+                rekey(slot, old);
+                auto position = journal(JournalOp::SET, slot, data, 1);
+                publish(ChangeOp::CHANGED, slot);
+                lock.reset();
+                try {
+                  waitDurable(position);
+                } catch (const std::system_error &) {
+                }
+              }};
+    } else {
+      return {entry(slot), [this, lock = writeLock, slot](T *data) mutable {
+                auto position = journal(JournalOp::SET, slot, data, 1);
+                publish(ChangeOp::CHANGED, slot);
+                lock.reset();
+                try {
+                  waitDurable(position);
+                } catch (const std::system_error &) {
+                }
+              }};
+    }
+  }
+
+  void eraseSlot(size_t slot) {
+    if constexpr (INDEXED) {
+      indexView().remove(keyHash(*entry(slot)), slot);
+    }
+    if constexpr (ORDERED) {
+      orderedView().remove(OrderOf{}(*entry(slot)), slot);
+    }
+    if (metadata_->tombstones) {
+      setErased(slot, true);
+      // slots behind the compaction cursors are dealt with by compact()
+      if (!metadata_->compacting) {
+        std::memcpy(entry(slot), &metadata_->freeHead, sizeof(size_t));
+        metadata_->freeHead = slot + 1;
+      }
+      return;
+    }
+    // shift all entries after the one being deleted down by one
+    for (size_t i = slot; i < metadata_->numEntries - 1; i++) {
+      *entry(i) = *entry(i + 1);
+      storeKey(i);
+      if constexpr (INDEXED) {
+        indexView().move(keyHash(*entry(i)), i + 1, i);
+      }
+    }
+    if constexpr (ORDERED) {
+      orderedView().shiftDown(slot);
+    }
+    metadata_->numEntries--;
+    metadata_->epoch++;
+  }
+
+  // Removes the last slot, undoing an appendSlot(). Must be called with the
+  // write lock held.
+  void popSlot() {
+    auto slot = metadata_->numEntries - 1;
+    if constexpr (INDEXED) {
+      indexView().remove(keyHash(*entry(slot)), slot);
+    }
+    if constexpr (ORDERED) {
+      orderedView().remove(OrderOf{}(*entry(slot)), slot);
+    }
+    *entry(slot) = {};
+    metadata_->numEntries--;
+  }
+
+  // Puts data back in the slot it was erased from, undoing an eraseSlot().
+  // Must be called with the write lock held, before anything else changes.
+  void uneraseSlot(size_t slot, const T &data) {
+    if (metadata_->tombstones) {
+      if (!metadata_->compacting) {
+        // eraseSlot() put it at the head of the free list
+        std::memcpy(&metadata_->freeHead, entry(slot), sizeof(size_t));
+      }
+      setErased(slot, false);
+    } else {
+      // move everything from slot on back up by one
+      for (auto i = metadata_->numEntries; i > slot; i--) {
+        *entry(i) = *entry(i - 1);
+        storeKey(i);
+        if constexpr (INDEXED) {
+          indexView().move(keyHash(*entry(i)), i - 1, i);
+        }
+      }
+      if constexpr (ORDERED) {
+        orderedView().shiftUp(slot);
+      }
+      metadata_->numEntries++;
+      metadata_->epoch++;
+    }
+    *entry(slot) = data;
+    storeKey(slot);
+    if constexpr (INDEXED) {
+      indexInsert(keyHash(data), slot);
+    }
+    orderedInsert(slot);
+  }
+
+  // Returns the lowest slot holding an element with the given key
+  template <typename K>
+  [[nodiscard]] std::optional<size_t> findSlot(const K &key) const {
+    std::optional<size_t> found;
+    auto check = [&](size_t i) {
+      // several keys can have the same hash, and there can be duplicate keys
+      if (KeyOf{}(*entry(i)) == key && (!found || i < *found)) {
+        found = i;
+      }
+      return true;
+    };
+    syncSegments();
+    if (index_ == nullptr) {
+      // a read-only handle on a database that hasn't been indexed yet
+      for (size_t i = 0; i < metadata_->numEntries; i++) {
+        if (!isErased(i)) {
+          check(i);
+        }
+      }
+    } else {
+      indexView().forEach(std::hash<Key>{}(key), check);
+    }
+    return found;
+  }
+
+  [[nodiscard]] static size_t keyHash(const T &data) {
+    return std::hash<Key>{}(KeyOf{}(data));
+  }
+
+  // Returns a view of the hash index. Must be called with the lock held.
+  [[nodiscard]] HashIndex indexView() const {
+    syncSegments();
+    return {index_, metadata_->indexSlots};
+  }
+
+  // Adds the given entry to the index, rebuilding the index instead if it
+  // would get too full. The entry must already hold its new data. Must be
+  // called with the write lock held.
+  void indexInsert(size_t hash, size_t index) {
+    if ((metadata_->indexUsed + 1) * 2 > metadata_->indexSlots) {
+      // rebuilding also clears out deleted slots
+      rebuildIndex();
+      return;
+    }
+    if (indexView().insert(hash, index)) {
+      metadata_->indexUsed++;
+    }
+  }
+
+  // Moves the entry at the given index from oldHash to newHash
+  void reindex(size_t index, size_t oldHash, size_t newHash) {
+    if (oldHash != newHash) {
+      indexView().remove(oldHash, index);
+      indexInsert(newHash, index);
+    }
+  }
+
+  // Builds a fresh index of all the entries in a new segment and removes the
+  // old one. Must be called with the write lock held.
+  void rebuildIndex() {
+    auto numEntries = metadata_->numEntries;
+    auto slots = HashIndex::slotsFor(numEntries);
+    auto segment = store_.create(metadata_->nextSegmentId,
+                                 slots * sizeof(HashIndexSlot));
+    metadata_->nextSegmentId++;
+    auto oldSegment = metadata_->indexSegment;
+    metadata_->indexSegment = segment;
+    metadata_->indexSlots = slots;
+    metadata_->generation++;
+    auto index = indexView();
+    for (size_t i = 0; i < numEntries; i++) {
+      if (!isErased(i)) {
+        index.insert(keyHash(*entry(i)), i);
+      }
+    }
+    metadata_->indexUsed = numEntries - metadata_->numErased;
+    if (oldSegment != -1) {
+      // processes that still have it attached keep it until they resync
+      store_.remove(oldSegment);
+    }
+  }
+
+  // Returns a view of the ordered index. Must be called with the lock held.
+  [[nodiscard]] OrderTree orderedView() const {
+    syncSegments();
+    return {orderedNodes_, metadata_->orderedNodes, &metadata_->ordered};
+  }
+
+  // Adds the entry in the given slot to the ordered index, growing the index
+  // if it's out of nodes, or rebuilding it instead if enough has been removed
+  // since it was built that it's mostly empty nodes. The entry must already
+  // hold its new data. Must be called with the write lock held.
+  void orderedInsert(size_t slot) {
+    if constexpr (ORDERED) {
+      auto tree = orderedView();
+      if (tree.needsRebuild()) {
+        rebuildOrdered();
+        return;
+      }
+      if (tree.freeNodes() < tree.nodesForInsert()) {
+        moveOrdered(metadata_->orderedNodes * 2);
+        tree = orderedView();
+      }
+      tree.insert(OrderOf{}(*entry(slot)), slot);
+    }
+  }
+
+  // Moves the ordered index to a new segment with room for the given number
+  // of nodes. Node ids don't change, so the tree can just be copied over.
+  void moveOrdered(size_t nodes) {
+    auto bytes = nodes * sizeof(typename OrderTree::Node);
+    auto segment = store_.create(metadata_->nextSegmentId, bytes);
+    metadata_->nextSegmentId++;
+    if (metadata_->orderedSegment != -1) {
+      syncSegments();
+      auto copy = store_.attach(segment, bytes);
+      std::memcpy(copy, orderedNodes_,
+                  metadata_->ordered.used * sizeof(typename OrderTree::Node));
+      store_.detach(copy, bytes);
+      // processes that still have it attached keep it until they resync
+      store_.remove(metadata_->orderedSegment);
+    }
+    metadata_->orderedSegment = segment;
+    metadata_->orderedNodes = nodes;
+    metadata_->generation++;
+  }
+
+  // Returns a view of the string arena. Must be called with the lock held.
+  [[nodiscard]] StringArena arenaView() const {
+    syncSegments();
+    return {arena_, metadata_->arenaBytes, &metadata_->arena};
+  }
+
+  // Moves the string arena to a new segment of the given size. Strings are
+  // referred to by offset, so it can just be copied over.
+  void moveArena(size_t bytes) {
+    auto segment = store_.create(metadata_->nextSegmentId, bytes);
+    metadata_->nextSegmentId++;
+    if (metadata_->arenaSegment != -1) {
+      syncSegments();
+      auto copy = store_.attach(segment, bytes);
+      std::memcpy(copy, arena_, metadata_->arena.used);
+      store_.detach(copy, bytes);
+      // processes that still have it attached keep it until they resync
+      store_.remove(metadata_->arenaSegment);
+    }
+    metadata_->arenaSegment = segment;
+    metadata_->arenaBytes = bytes;
+    metadata_->generation++;
+  }
+
+  // Builds a fresh ordered index of all the entries in a new segment. Must be
+  // called with the write lock held.
+  void rebuildOrdered() {
+    if constexpr (ORDERED) {
+      std::vector<std::pair<OrderKey, uint64_t>> keys;
+      keys.reserve(metadata_->numEntries - metadata_->numErased);
+      for (size_t slot = 0; slot < metadata_->numEntries; slot++) {
+        if (!isErased(slot)) {
+          keys.push_back({OrderOf{}(*entry(slot)), slot});
+        }
+      }
+      // stable, so equal keys stay in slot order
+      std::stable_sort(keys.begin(), keys.end(),
+                       [](const auto &a, const auto &b) {
+                         return a.first < b.first;
+                       });
+      auto oldSegment = metadata_->orderedSegment;
+      metadata_->orderedSegment = -1;
+      moveOrdered(OrderTree::nodesFor(keys.size()));
+      if (oldSegment != -1) {
+        store_.remove(oldSegment);
+      }
+      metadata_->orderedKeySize = sizeof(OrderKey);
+      orderedView().rebuild(keys);
+    }
+  }
+
+  // Copies the element at the given index into data without taking any lock.
+  // Returns false if a writer kept racing the copy, in which case the caller
+  // should fall back to the locked path.
+  bool tryOptimisticGet(size_t index, T &data) const {
+    for (int attempt = 0; attempt < OPTIMISTIC_READ_RETRIES; attempt++) {
+      auto sequence = metadata_->sequence.load(std::memory_order_acquire);
+      if (sequence & 1) {
+        // a write is in progress
+        std::this_thread::yield();
+        continue;
+      }
+      // only use the extents we already have attached, since the metadata
+      // can't be trusted until the sequence has been checked. Indexes only
+      // match slots if nothing has been erased with a tombstone
+      if (metadata_->generation != generation_ || metadata_->numErased != 0) {
+        return false;
+      }
+      auto numEntries = metadata_->numEntries;
+      if (index < numEntries) {
+        auto [extent, offset] = locate(index);
+        if (extent >= extents_.size()) {
+          return false;
+        }
+        std::memcpy(&data, extents_[extent] + offset, sizeof(T));
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (metadata_->sequence.load(std::memory_order_relaxed) != sequence) {
+        continue;
+      }
+      if (index >= numEntries) {
+        throw std::out_of_range("Index out of bounds");
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // Returns the version column entry of the given slot. Must be called with
+  // the slot's stripe locked.
+  [[nodiscard]] SlotVersion *slotVersion(size_t slot) const {
+    auto [extent, offset] = locate(slot);
+    syncSegments();
+    return reinterpret_cast<SlotVersion *>(
+               reinterpret_cast<char *>(extents_[extent]) +
+               versionColumnOffset(extent)) +
+           offset;
+  }
+
+  // Attaches the current version store. Must be called with the version lock
+  // held.
+  void syncVersions() const {
+    if (versionSegment_ == metadata_->versionSegment) {
+      return;
+    }
+    if (versions_ != nullptr) {
+      store_.detach(versions_, versionsBytes_);
+      versions_ = nullptr;
+    }
+    versionSegment_ = metadata_->versionSegment;
+    if (versionSegment_ != -1) {
+      versionsBytes_ = metadata_->versionSlots * sizeof(OldVersion);
+      versions_ = static_cast<OldVersion *>(
+          store_.attach(versionSegment_, versionsBytes_));
+    }
+  }
+
+  // Pins the current version for a snapshot, so that the versions it needs
+  // aren't thrown away, and returns something that unpins it when destroyed.
+  [[nodiscard]] std::shared_ptr<void> pinVersion(uint64_t &version) const {
+    for (auto &pin : metadata_->pins) {
+      uint64_t unused = 0;
+      version = metadata_->commitVersion.load();
+      if (!pin.compare_exchange_strong(unused, version + 1)) {
+        continue;
+      }
+      // a writer that took a newer version before the pin was visible may not
+      // have kept the old contents, so move up to include its write. Writers
+      // hold their stripe while they write, so reads wait for it to finish
+      for (auto current = metadata_->commitVersion.load(); current != version;
+           current = metadata_->commitVersion.load()) {
+        version = current;
+        pin.store(version + 1);
+      }
+      return {nullptr, [&pin](void *) { pin.store(0); }};
+    }
+    throw std::runtime_error("Too many snapshots");
+  }
+
+  // Returns the oldest version pinned by a snapshot, if there are any
+  [[nodiscard]] std::optional<uint64_t> oldestPin() const {
+    std::optional<uint64_t> oldest;
+    for (auto &pin : metadata_->pins) {
+      auto pinned = pin.load();
+      if (pinned != 0 && (!oldest || pinned - 1 < *oldest)) {
+        oldest = pinned - 1;
+      }
+    }
+    return oldest;
+  }
+
+  // Gives the entry in the given slot a new version, keeping its current
+  // contents in the version store if a snapshot might still need them. Must
+  // be called with the slot's stripe write-locked, before the entry changes.
+  void newVersion(size_t slot) {
+    if (!metadata_->multiVersion) {
+      return;
+    }
+    auto version = metadata_->commitVersion.fetch_add(1) + 1;
+    auto current = slotVersion(slot);
+    auto oldest = oldestPin();
+    if (!oldest) {
+      *current = {version, 0};
+      return;
+    }
+    auto versionLock = acquireWriteLock(&metadata_->versionLock, semTimeout_);
+    auto old = allocateVersion(*oldest);
+    versions_[old] = {current->version, version, current->older, *entry(slot)};
+    *current = {version, old + 1};
+  }
+
+  // Returns a free slot in the version store, growing it if there aren't any.
+  // Must be called with the version lock write-locked.
+  size_t allocateVersion(uint64_t oldest) {
+    syncVersions();
+    auto slots = metadata_->versionSlots;
+    for (size_t i = 0; i < slots; i++) {
+      auto old = (metadata_->versionCursor + i) % slots;
+      // no pinned snapshot is older than the version that replaced it
+      if (versions_[old].to <= oldest) {
+        metadata_->versionCursor = old + 1;
+        return old;
+      }
+    }
+
+    // every old version is still needed, so move them to a store twice the
+    // size. Their positions stay the same, so the links between them do too
+    auto newSlots = slots == 0 ? INITIAL_VERSION_SLOTS : slots * 2;
+    auto segment = store_.create(metadata_->nextSegmentId,
+                                 newSlots * sizeof(OldVersion));
+    metadata_->nextSegmentId++;
+    auto oldSegment = metadata_->versionSegment;
+    auto oldVersions = versions_;
+    versions_ = nullptr;
+    metadata_->versionSegment = segment;
+    metadata_->versionSlots = newSlots;
+    versionSegment_ = segment;
+    versionsBytes_ = newSlots * sizeof(OldVersion);
+    versions_ =
+        static_cast<OldVersion *>(store_.attach(segment, versionsBytes_));
+    if (oldVersions != nullptr) {
+      std::memcpy(versions_, oldVersions, slots * sizeof(OldVersion));
+      store_.detach(oldVersions, slots * sizeof(OldVersion));
+      store_.remove(oldSegment);
+    }
+    metadata_->versionCursor = slots + 1;
+    return slots;
+  }
+
+  // Copies the entry in the given slot as it was at the given version into
+  // data. Must be called with the structure read-locked and the version
+  // pinned.
+  void readVersion(size_t slot, uint64_t version, T &data) const {
+    auto stripe = &metadata_->stripes[slot % metadata_->numStripes];
+    auto stripeLock = timedLock(stripe, false, StatLock::STRIPE_READ);
+    auto current = slotVersion(slot);
+    if (current->version <= version) {
+      data = *entry(slot);
+      return;
+    }
+    auto versionLock = acquireReadLock(&metadata_->versionLock, semTimeout_);
+    syncVersions();
+    // the chain goes from newest to oldest, and ends at the one we want
+    for (auto old = current->older; old != 0; old = versions_[old - 1].older) {
+      if (versions_[old - 1].from <= version) {
+        data = versions_[old - 1].data;
+        return;
+      }
+    }
+    throw std::logic_error("Snapshot version was thrown away");
+  }
+
+  // acquireReadLock() or acquireWriteLock() on one of the database's locks,
+  // timing the wait for the stats
+  [[nodiscard]] std::shared_ptr<SharedRWLock> timedLock(SharedRWLock *lock,
+                                                        bool write,
+                                                        StatLock kind) const {
+#if SHARED_DATABASE_STATS
+    auto start = std::chrono::steady_clock::now();
+    try {
+      auto held = write ? acquireWriteLock(lock, semTimeout_)
+                        : acquireReadLock(lock, semTimeout_);
+      countLockWait(&metadata_->stats, kind,
+                    std::chrono::steady_clock::now() - start);
+      return held;
+    } catch (const std::system_error &) {
+      countLockTimeout(&metadata_->stats, kind);
+      throw;
+    }
+#else
+    return write ? acquireWriteLock(lock, semTimeout_)
+                 : acquireReadLock(lock, semTimeout_);
+#endif
+  }
+
+  // Runs body(txn) under the write lock, undoing its changes if it throws
+  template <typename F>
+  void lockedTransaction(F &&body) {
+    uint64_t position;
+    {
+      auto writeLock = getWriteLock();
+      Txn txn(this, false);
+      try {
+        body(txn);
+      } catch (...) {
+        txn.rollback();
+        throw;
+      }
+      position = txn.commit();
+    }
+    waitDurable(position);
+  }
+
+  // lockRead() on a stripe, timing the wait for the stats like timedLock()
+  void lockStripeRead(SharedRWLock *stripe) const {
+#if SHARED_DATABASE_STATS
+    auto start = std::chrono::steady_clock::now();
+    try {
+      lockRead(stripe, semTimeout_);
+    } catch (const std::system_error &) {
+      countLockTimeout(&metadata_->stats, StatLock::STRIPE_READ);
+      throw;
+    }
+    countLockWait(&metadata_->stats, StatLock::STRIPE_READ,
+                  std::chrono::steady_clock::now() - start);
+#else
+    lockRead(stripe, semTimeout_);
+#endif
+  }
+
+  // Counts a call to op, adding this handle's batch of them to the stats once
+  // it's full
+  void countOp(StatOp op, uint64_t count = 1) const {
+    ::countOp(&metadata_->stats, &pendingOps_, op, count);
+  }
+
+  // readLock(). Returns something that automatically unlocks the semaphore when
+  // destroyed. (out of scope)
+  [[nodiscard]] std::shared_ptr<void> getReadLock() const {
+    auto readLock = timedLock(&metadata_->lock, false, StatLock::READ);
+    countReaders(&metadata_->stats, lockReaders(&metadata_->lock));
+    if (striped()) {
+      // reading more than one entry, so keep writers out of every stripe.
+      // Stripe writers only ever hold one stripe, so taking them in order
+      // can't deadlock. There can be a lot of them, so they're taken
+      // directly rather than with a shared_ptr each
+      auto stripes = metadata_->stripes;
+      uint32_t locked = 0;
+      try {
+        for (; locked < metadata_->numStripes; locked++) {
+          lockStripeRead(&stripes[locked]);
+        }
+      } catch (...) {
+        while (locked > 0) {
+          unlockRead(&stripes[--locked]);
+        }
+        throw;
+      }
+      std::this_thread::sleep_for(semSleep_);
+      return {nullptr, [readLock, stripes, locked](void *) {
+                for (uint32_t i = locked; i > 0; i--) {
+                  unlockRead(&stripes[i - 1]);
+                }
+              }};
+    }
+    std::this_thread::sleep_for(semSleep_);
+    return readLock;
+  }
+
+  [[nodiscard]] std::shared_ptr<void> getWriteLock() const {
+    // throw an error if we are in read-only mode
+    if (readOnly_) {
+      throw std::runtime_error("Database is read-only");
+    }
+
+    // waits for the current readers to finish, and holds off new ones
+    auto writeLock = timedLock(&metadata_->lock, true, StatLock::WRITE);
+    // make the sequence odd so optimistic readers retry until we release. A
+    // writer that died holding the lock will have left it odd already
+    if (!(metadata_->sequence.load(std::memory_order_relaxed) & 1)) {
+      metadata_->sequence.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    std::this_thread::sleep_for(semSleep_);
+    // the captured lock is released after the deleter runs, so the sequence
+    // is even again before anyone else can write
+    return {nullptr, [this, writeLock](void *) {
+              metadata_->sequence.fetch_add(1, std::memory_order_release);
+            }};
   }
 };
 
@@ -1,10 +1,19 @@
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
+#include <climits>
 #include <condition_variable>
+#include <filesystem>
+#include <fstream>
 #include <future>
 #include <mutex>
 #include <random>
+#include <sstream>
 #include <thread>
+#include <tuple>
 
 #include "SharedDatabase.hpp"
 #include "StudentInfo.h"
@@ -52,17 +61,17 @@ class SharedDatabaseTest : public ::testing::Test {
  protected:
   SharedDatabaseTest() {
     auto metadata_key = ftok(".", DB_ID + METADATA_OFFSET);
-    auto database_key = ftok(".", DB_ID + DATABASE_OFFSET);
 
     auto metadata_shmid = shmget(metadata_key, sizeof(DatabaseMetadata), 0);
     //    std::cout << "Deleting existing shared memory segments" << std::endl;
     shmctl(metadata_shmid, IPC_RMID, nullptr);
-    auto database_shmid =
-        shmget(database_key, sizeof(Database<StudentInfo>), 0);
-    shmctl(database_shmid, IPC_RMID, nullptr);
-    db = new SharedDatabase<StudentInfo>(
-        DB_PASSWORD, DB_ID, 50ms, 0ms,
-        true);  //<StudentInfo>(DB_PASSWORD, DB_ID, 50ms);
+    SharedDatabaseOptions options;
+    options.semTimeout = 50ms;
+    options.clean = true;
+    // a fixed size so fillStudents() can fill it up
+    options.capacity = 50;
+    options.maxCapacity = 50;
+    db = new SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, options);
   }
 
   ~SharedDatabaseTest() override { delete db; }
@@ -324,4 +333,1623 @@ TEST_F(SharedDatabaseTest, clear) {
   fillStudents();
   auto db_student = db->at(0);
   EXPECT_THROW(db->clear(), std::system_error);
-}
\ No newline at end of file
+}
+TEST_F(SharedDatabaseTest, optimistic_read) {
+  fillStudents();
+  SharedDatabaseOptions options;
+  options.semTimeout = 50ms;
+  options.optimisticReads = true;
+  auto readDB = SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, options);
+  for (int i = 0; i < db->size(); i++) {
+    auto db_student = db->get(i);
+    auto read_student = readDB.get(i);
+    EXPECT_EQ(db_student.id, read_student.id);
+    EXPECT_STREQ(db_student.name, read_student.name);
+  }
+  EXPECT_THROW(readDB.get(readDB.size()), std::out_of_range);
+
+  // a held write lock makes the optimistic path give up and fall back to the
+  // locked read, which times out
+  auto db_student = db->at(0);
+  EXPECT_THROW(readDB.get(0), std::system_error);
+  db_student.reset();
+  EXPECT_NO_THROW(readDB.get(0));
+}
+
+TEST_F(SharedDatabaseTest, optimistic_read_not_torn) {
+  fillStudents();
+  std::atomic<bool> started = false;
+  std::atomic<bool> done = false;
+  // every field of the written students is filled with the same character,
+  // so a torn read shows up as mismatching fields
+  auto writer = std::async(std::launch::async, [&]() {
+    auto writeDB = SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, 5s);
+    for (int i = 0; !done; i++) {
+      StudentInfo student{};
+      char c = static_cast<char>('a' + i % 26);
+      std::memset(student.name, c, sizeof(student.name) - 1);
+      std::memset(student.address, c, sizeof(student.address) - 1);
+      std::memset(student.phone, c, sizeof(student.phone) - 1);
+      student.id = c;
+      writeDB.set(0, student);
+      started = true;
+    }
+  });
+
+  SharedDatabaseOptions options;
+  options.semTimeout = 5s;
+  options.optimisticReads = true;
+  auto readDB = SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, options);
+  // wait for the first write so entry 0 is uniform
+  while (!started) {
+  }
+  for (int i = 0; i < 10000; i++) {
+    auto student = readDB.get(0);
+    ASSERT_EQ(student.name[0], static_cast<char>(student.id));
+    ASSERT_EQ(student.address[sizeof(student.address) - 2], student.name[0]);
+    ASSERT_EQ(student.phone[0], student.name[0]);
+  }
+  done = true;
+  writer.get();
+}
+
+TEST_F(SharedDatabaseTest, writer_preference) {
+  fillStudents();
+  auto readLock = db->smartSize();  // hold a read lock
+  auto newStudent = generateRandomStudents(1).front();
+  std::atomic<bool> written = false;
+  auto writer = std::async(std::launch::async, [&]() {
+    auto writeDB = SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, 5s);
+    writeDB.set(0, newStudent);
+    written = true;
+  });
+
+  // once the writer is waiting, new readers have to wait behind it
+  auto start = std::chrono::steady_clock::now();
+  bool blocked = false;
+  while (!blocked && std::chrono::steady_clock::now() - start < 2s) {
+    try {
+      auto student = db->get(0);
+    } catch (const std::system_error &) {
+      blocked = true;
+    }
+  }
+  EXPECT_TRUE(blocked);
+  EXPECT_FALSE(written);
+
+  // releasing the read lock wakes the writer right away
+  readLock.reset();
+  EXPECT_EQ(writer.wait_for(1s), std::future_status::ready);
+  EXPECT_TRUE(written);
+  EXPECT_EQ(db->get(0).id, newStudent.id);
+}
+
+TEST_F(SharedDatabaseTest, dead_owner) {
+  fillStudents();
+  // children that die holding the lock, writing and reading
+  auto dieHolding = [](bool write) {
+    auto pid = fork();
+    if (pid == 0) {
+      auto childDB = SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, 5s);
+      if (write) {
+        auto student = childDB.at(0);
+        _exit(0);
+      }
+      auto snapshot = childDB.snapshot();
+      _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+  };
+
+  // the lock is taken back well before the 5 second timeout
+  auto writeDB = SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, 5s);
+  auto newStudent = generateRandomStudents(1).front();
+  dieHolding(true);
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(writeDB.get(0).id, db->get(0).id);
+  dieHolding(false);
+  writeDB.set(0, newStudent);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, 1s);
+  EXPECT_EQ(db->get(0).id, newStudent.id);
+}
+
+TEST(SharedRWLockTest, dies_part_way) {
+  // shared with the children, like the locks in a database's metadata
+  auto lock = static_cast<SharedRWLock *>(
+      mmap(nullptr, sizeof(SharedRWLock), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(lock, MAP_FAILED);
+  initRWLock(lock);
+
+  // a child that dies at each step of locking and unlocking, reading and
+  // writing
+  static LockStep dieAt;
+  for (int step = 0; step < static_cast<int>(LockStep::COUNT); step++) {
+    dieAt = static_cast<LockStep>(step);
+    auto pid = fork();
+    if (pid == 0) {
+      lockStepHook = [](LockStep reached) {
+        if (reached == dieAt) {
+          _exit(0);
+        }
+      };
+      lockRead(lock);
+      unlockRead(lock);
+      lockWrite(lock);
+      unlockWrite(lock);
+      _exit(1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT_EQ(WEXITSTATUS(status), 0) << "step " << step;
+
+    // whatever it left is cleaned up well before the timeout
+    auto start = std::chrono::steady_clock::now();
+    lockWrite(lock, 5s);
+    unlockWrite(lock);
+    lockRead(lock, 5s);
+    unlockRead(lock);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 1s) << "step " << step;
+    EXPECT_EQ(lockReaders(lock), 0);
+  }
+
+  // holders past the owner slots wait for one
+  for (int i = 0; i < LOCK_OWNER_SLOTS; i++) {
+    lockRead(lock);
+  }
+  EXPECT_THROW(lockRead(lock, 20ms), std::system_error);
+  unlockRead(lock);
+  lockRead(lock, 20ms);
+  for (int i = 0; i < LOCK_OWNER_SLOTS; i++) {
+    unlockRead(lock);
+  }
+  EXPECT_EQ(lockReaders(lock), 0);
+  munmap(lock, sizeof(SharedRWLock));
+}
+
+TEST_F(SharedDatabaseTest, grow) {
+  constexpr int GROW_DB_ID = DB_ID + 10;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.capacity = 4;
+  auto growDB = SharedDatabase<StudentInfo>(DB_PASSWORD, GROW_DB_ID, options);
+  // attached before the database grows, so it has to pick up the new extents
+  auto otherDB = SharedDatabase<StudentInfo>(DB_PASSWORD, GROW_DB_ID);
+  EXPECT_EQ(growDB.capacity(), 4);
+  EXPECT_EQ(growDB.maxSize(), 0);
+
+  auto students = generateRandomStudents(100);
+  for (auto student : students) {
+    growDB.push_back(student);
+  }
+  EXPECT_EQ(otherDB.size(), students.size());
+  EXPECT_GE(otherDB.capacity(), students.size());
+  for (int i = 0; i < students.size(); i++) {
+    auto db_student = otherDB.get(i);
+    EXPECT_EQ(db_student.id, students[i].id);
+    EXPECT_STREQ(db_student.name, students[i].name);
+  }
+
+  // entries move across extent boundaries when erasing
+  otherDB.erase(3);
+  students.erase(students.begin() + 3);
+  for (int i = 0; i < students.size(); i++) {
+    EXPECT_EQ(growDB.get(i).id, students[i].id);
+  }
+}
+
+TEST_F(SharedDatabaseTest, find) {
+  constexpr int INDEXED_DB_ID = DB_ID + 20;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.capacity = 8;
+  auto indexedDB =
+      SharedDatabase<StudentInfo, StudentId>(DB_PASSWORD, INDEXED_DB_ID, options);
+  auto otherDB =
+      SharedDatabase<StudentInfo, StudentId>(DB_PASSWORD, INDEXED_DB_ID);
+
+  // enough students to make the index rebuild a few times
+  auto students = generateRandomStudents(500);
+  for (int i = 0; i < students.size(); i++) {
+    students[i].id = i * 7;
+    indexedDB.push_back(students[i]);
+  }
+  for (int i = 0; i < students.size(); i++) {
+    EXPECT_EQ(otherDB.find(i * 7), i);
+  }
+  EXPECT_FALSE(otherDB.find(1).has_value());
+
+  // the first of several duplicates is found
+  auto duplicate = students[10];
+  indexedDB.push_back(duplicate);
+  EXPECT_EQ(indexedDB.find(duplicate.id), 10);
+
+  // changing a key through set() or at() moves it in the index
+  auto changed = students[20];
+  changed.id = 1;
+  otherDB.set(20, changed);
+  EXPECT_EQ(indexedDB.find(1), 20);
+  EXPECT_FALSE(indexedDB.find(20 * 7).has_value());
+  indexedDB.at(20)->id = 3;
+  EXPECT_EQ(otherDB.find(3), 20);
+  EXPECT_FALSE(otherDB.find(1).has_value());
+
+  // erasing shifts the index of everything after it
+  indexedDB.erase(5);
+  EXPECT_FALSE(indexedDB.find(5 * 7).has_value());
+  EXPECT_EQ(indexedDB.find(6 * 7), 5);
+  EXPECT_EQ(indexedDB.find(499 * 7), 498);
+
+  // handles without the key extractor can't keep the index up to date
+  auto unindexedDB = SharedDatabase<StudentInfo>(DB_PASSWORD, INDEXED_DB_ID);
+  EXPECT_THROW(unindexedDB.push_back(students[0]), std::runtime_error);
+
+  indexedDB.clear();
+  EXPECT_FALSE(otherDB.find(6 * 7).has_value());
+  indexedDB.push_back(students[0]);
+  EXPECT_EQ(otherDB.find(students[0].id), 0);
+}
+
+TEST_F(SharedDatabaseTest, scan) {
+  fillStudents();
+  std::vector<StudentInfo> scanned;
+  db->scan([&](const StudentInfo &student) { scanned.push_back(student); });
+  ASSERT_EQ(scanned.size(), db->size());
+  for (int i = 0; i < scanned.size(); i++) {
+    auto db_student = db->get(i);
+    EXPECT_EQ(scanned[i].id, db_student.id);
+    EXPECT_STREQ(scanned[i].name, db_student.name);
+  }
+
+  // scans cross extent boundaries
+  constexpr int GROW_DB_ID = DB_ID + 10;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.capacity = 3;
+  auto growDB = SharedDatabase<StudentInfo>(DB_PASSWORD, GROW_DB_ID, options);
+  auto students = generateRandomStudents(40);
+  for (auto student : students) {
+    growDB.push_back(student);
+  }
+  int i = 0;
+  growDB.scan([&](const StudentInfo &student) {
+    EXPECT_EQ(student.id, students[i].id);
+    i++;
+  });
+  EXPECT_EQ(i, students.size());
+}
+
+TEST_F(SharedDatabaseTest, snapshot) {
+  fillStudents();
+  auto snapshot = db->snapshot();
+  EXPECT_EQ(snapshot.size(), db->size());
+  int i = 0;
+  for (const auto &student : snapshot) {
+    EXPECT_EQ(student.id, snapshot[i].id);
+    i++;
+  }
+  EXPECT_EQ(i, snapshot.size());
+
+  // the snapshot can't change while it is held
+  auto writeDB = SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, 50ms);
+  EXPECT_THROW(writeDB.set(0, generateRandomStudents(1).front()),
+               std::system_error);
+}
+
+TEST_F(SharedDatabaseTest, push_back_bulk) {
+  auto students = generateRandomStudents(db->maxSize() - 5);
+  db->push_back_bulk(students);
+  EXPECT_EQ(db->size(), students.size());
+  // all or nothing when it doesn't fit
+  EXPECT_THROW(db->push_back_bulk(generateRandomStudents(6)), std::out_of_range);
+  EXPECT_EQ(db->size(), students.size());
+  for (int i = 0; i < students.size(); i++) {
+    auto db_student = db->get(i);
+    EXPECT_EQ(db_student.id, students[i].id);
+    EXPECT_STREQ(db_student.name, students[i].name);
+    EXPECT_STREQ(db_student.address, students[i].address);
+    EXPECT_STREQ(db_student.phone, students[i].phone);
+  }
+
+  // bulk inserts split across extents and keep the index up to date
+  constexpr int INDEXED_DB_ID = DB_ID + 20;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.capacity = 3;
+  auto indexedDB =
+      SharedDatabase<StudentInfo, StudentId>(DB_PASSWORD, INDEXED_DB_ID, options);
+  auto bulkStudents = generateRandomStudents(200);
+  for (int i = 0; i < bulkStudents.size(); i++) {
+    bulkStudents[i].id = i + 1000;
+  }
+  indexedDB.push_back(bulkStudents.front());
+  indexedDB.push_back_bulk(bulkStudents.data() + 1, 9);
+  indexedDB.push_back_bulk(bulkStudents.data() + 10, bulkStudents.size() - 10);
+  EXPECT_EQ(indexedDB.size(), bulkStudents.size());
+  for (int i = 0; i < bulkStudents.size(); i++) {
+    EXPECT_EQ(indexedDB.get(i).id, bulkStudents[i].id);
+    EXPECT_EQ(indexedDB.find(bulkStudents[i].id), i);
+  }
+}
+
+TEST_F(SharedDatabaseTest, dump_restore) {
+  const std::string path = "dump_restore_test.snap";
+  auto students = generateRandomStudents(20);
+  db->push_back_bulk(students);
+  db->dump(path);
+
+  // restore by mapping the snapshot and by reading it in
+  for (bool map : {true, false}) {
+    db->clear();
+    db->restore(path, map);
+    ASSERT_EQ(db->size(), students.size());
+    for (int i = 0; i < students.size(); i++) {
+      auto db_student = db->get(i);
+      EXPECT_EQ(db_student.id, students[i].id);
+      EXPECT_STREQ(db_student.name, students[i].name);
+      EXPECT_STREQ(db_student.address, students[i].address);
+      EXPECT_STREQ(db_student.phone, students[i].phone);
+    }
+  }
+
+  // a flipped byte is caught by the checksum and nothing is restored
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(sizeof(SnapshotHeader) + 7);
+    file.put('\x7f');
+  }
+  db->clear();
+  EXPECT_THROW(db->restore(path), std::runtime_error);
+  EXPECT_EQ(db->size(), 0);
+
+  // so is restoring something else's snapshot
+  SnapshotWriter writer(path, sizeof(StudentInfo), schemaHash<int>());
+  writer.finish();
+  EXPECT_THROW(db->restore(path, false), std::runtime_error);
+  std::remove(path.c_str());
+}
+
+TEST_F(SharedDatabaseTest, lock_striping) {
+  constexpr int STRIPED_DB_ID = DB_ID + 50;
+  SharedDatabaseOptions options;
+  options.semTimeout = 50ms;
+  options.clean = true;
+  options.lockStripes = 4;
+  auto stripedDB =
+      SharedDatabase<StudentInfo>(DB_PASSWORD, STRIPED_DB_ID, options);
+  stripedDB.push_back_bulk(generateRandomStudents(8));
+
+  {
+    // holding an entry only locks out its own stripe
+    auto student = stripedDB.at(1);
+    student->id = 4000;
+    StudentInfo other{};
+    other.id = 4002;
+    stripedDB.set(2, other);
+    EXPECT_EQ(stripedDB.get(2).id, 4002);
+    EXPECT_THROW(stripedDB.set(5, other), std::system_error);
+    EXPECT_THROW(stripedDB.get(1), std::system_error);
+    // as does anything that reads or changes more than one entry
+    EXPECT_THROW(stripedDB.scan([](const StudentInfo &) {}), std::system_error);
+    EXPECT_THROW(stripedDB.push_back(other), std::system_error);
+  }
+  EXPECT_EQ(stripedDB.get(1).id, 4000);
+
+  // writers on different stripes run at the same time
+  std::vector<std::thread> writers;
+  for (int stripe = 0; stripe < 4; stripe++) {
+    writers.emplace_back([&stripedDB, stripe] {
+      for (int round = 0; round < 200; round++) {
+        for (int i = stripe; i < 8; i += 4) {
+          auto student = stripedDB.get(i);
+          student.id = round * 10 + i;
+          stripedDB.set(i, student);
+        }
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  for (int i = 0; i < 8; i++) {
+    EXPECT_EQ(stripedDB.get(i).id, 1990 + i);
+  }
+
+  // changing the key of an indexed entry still updates the index
+  auto indexedDB = SharedDatabase<StudentInfo, StudentId>(
+      DB_PASSWORD, STRIPED_DB_ID + 1, options);
+  auto students = generateRandomStudents(10);
+  for (int i = 0; i < students.size(); i++) {
+    students[i].id = 6000 + i;
+  }
+  indexedDB.push_back_bulk(students);
+  auto student = indexedDB.get(3);
+  std::strncpy(student.name, "renamed", sizeof(student.name));
+  indexedDB.set(3, student);
+  student.id = 7000;
+  indexedDB.set(3, student);
+  EXPECT_EQ(indexedDB.find(7000), 3);
+  EXPECT_FALSE(indexedDB.find(6003));
+  EXPECT_STREQ(indexedDB.get(3).name, "renamed");
+}
+
+TEST_F(SharedDatabaseTest, multi_version) {
+  constexpr int VERSIONED_DB_ID = DB_ID + 60;
+  SharedDatabaseOptions options;
+  options.semTimeout = 50ms;
+  options.clean = true;
+  options.multiVersion = true;
+  options.lockStripes = 2;
+  auto versionedDB =
+      SharedDatabase<StudentInfo>(DB_PASSWORD, VERSIONED_DB_ID, options);
+  auto students = generateRandomStudents(10);
+  versionedDB.push_back_bulk(students);
+
+  {
+    // writers carry on while a snapshot is open, without it seeing them
+    auto snapshot = versionedDB.snapshot();
+    for (int round = 0; round < 100; round++) {
+      for (int i = 0; i < students.size(); i += 2) {
+        auto student = students[i];
+        student.id = round;
+        versionedDB.set(i, student);
+      }
+      versionedDB.at(3)->id = round;
+    }
+    EXPECT_EQ(versionedDB.get(0).id, 99);
+    EXPECT_EQ(versionedDB.get(3).id, 99);
+    int i = 0;
+    for (const auto &student : snapshot) {
+      EXPECT_EQ(student.id, students[i].id);
+      EXPECT_STREQ(student.name, students[i].name);
+      i++;
+    }
+    EXPECT_EQ(i, students.size());
+    EXPECT_EQ(snapshot[3].id, students[3].id);
+
+    // a newer snapshot sees them, and the older one still doesn't
+    auto newer = versionedDB.snapshot();
+    versionedDB.at(3)->id = 1234;
+    EXPECT_EQ(newer[3].id, 99);
+    EXPECT_EQ(snapshot[3].id, students[3].id);
+
+    // but the structure can't change underneath them
+    EXPECT_THROW(versionedDB.push_back(students[0]), std::system_error);
+  }
+  versionedDB.push_back(students[0]);
+
+  // edits don't lock anything until they're committed, and fail if someone
+  // else got there first
+  auto edit = versionedDB.edit(5);
+  edit->id = 5555;
+  auto other = versionedDB.edit(5);
+  other->id = 6666;
+  versionedDB.scan([](const StudentInfo &) {});
+  EXPECT_TRUE(edit.commit());
+  EXPECT_FALSE(other.commit());
+  EXPECT_EQ(versionedDB.get(5).id, 5555);
+  auto erased = versionedDB.edit(6);
+  versionedDB.erase(0);
+  EXPECT_FALSE(erased.commit());
+
+  // edits on an indexed database keep the index up to date
+  auto indexedDB = SharedDatabase<StudentInfo, StudentId>(
+      DB_PASSWORD, VERSIONED_DB_ID + 1, options);
+  for (int i = 0; i < students.size(); i++) {
+    students[i].id = 8000 + i;
+  }
+  indexedDB.push_back_bulk(students);
+  auto student = indexedDB.edit(*indexedDB.find(8004));
+  student->id = 9000;
+  EXPECT_TRUE(student.commit());
+  EXPECT_EQ(indexedDB.find(9000), 4);
+  EXPECT_FALSE(indexedDB.find(8004));
+
+  // concurrent scans see the same version however many times they look
+  std::atomic<bool> done = false;
+  std::thread writer([&] {
+    for (int round = 1; !done; round++) {
+      for (int i = 0; i < students.size(); i++) {
+        auto updated = indexedDB.edit(i);
+        std::snprintf(updated->phone, sizeof(updated->phone), "%d", round);
+        updated.commit();
+      }
+    }
+  });
+  for (int scan = 0; scan < 50; scan++) {
+    auto snapshot = indexedDB.snapshot();
+    std::vector<std::string> phones;
+    for (const auto &scanned : snapshot) {
+      phones.emplace_back(scanned.phone);
+    }
+    std::this_thread::sleep_for(1ms);
+    int i = 0;
+    for (const auto &scanned : snapshot) {
+      EXPECT_EQ(phones[i++], scanned.phone);
+    }
+  }
+  done = true;
+  writer.join();
+}
+
+TEST(JournalTest, replay) {
+  constexpr int JOURNAL_DB_ID = DB_ID + 70;
+  const std::string path = "journal_test.wal";
+  std::remove(path.c_str());
+  shmctl(shmget(ftok(".", JOURNAL_DB_ID + METADATA_OFFSET),
+                sizeof(DatabaseMetadata), 0),
+         IPC_RMID, nullptr);
+  SharedDatabaseOptions options;
+  options.semTimeout = 50ms;
+  options.clean = true;
+  options.tombstoneErase = true;
+  options.capacity = 4;
+  options.journalPath = path;
+  auto students = generateRandomStudents(40);
+  for (int i = 0; i < students.size(); i++) {
+    students[i].id = 3000 + i;
+  }
+
+  auto contents = [](SharedDatabase<StudentInfo, StudentId> &journaledDB) {
+    std::vector<int> ids;
+    journaledDB.scan(
+        [&](const StudentInfo &student) { ids.push_back(student.id); });
+    return ids;
+  };
+  std::vector<int> expected;
+  {
+    SharedDatabase<StudentInfo, StudentId> journaledDB(
+        DB_PASSWORD, JOURNAL_DB_ID, options);
+    journaledDB.push_back_bulk(students.data(), 30);
+    journaledDB.push_back(students[30]);
+    journaledDB.erase(3);
+    journaledDB.erase(journaledDB.handle(7));
+    journaledDB.insert(students[31]);
+    journaledDB.set(0, students[32]);
+    journaledDB.at(1)->id = 9999;
+    journaledDB.compact(10);
+
+    // writers in several threads share syncs
+    std::vector<std::thread> writers;
+    for (int i = 33; i < 40; i++) {
+      writers.emplace_back(
+          [&journaledDB, &students, i] { journaledDB.push_back(students[i]); });
+    }
+    for (auto &writer : writers) {
+      writer.join();
+    }
+    expected = contents(journaledDB);
+  }
+
+  // the shared memory is gone, so this rebuilds it from the journal
+  {
+    SharedDatabase<StudentInfo, StudentId> journaledDB(
+        DB_PASSWORD, JOURNAL_DB_ID, options);
+    EXPECT_EQ(contents(journaledDB), expected);
+    EXPECT_EQ(journaledDB.find(9999), 1);
+    journaledDB.checkpoint();
+    journaledDB.erase(0);
+    expected.erase(expected.begin());
+  }
+
+  // a torn record at the end is ignored
+  {
+    std::ofstream file(path, std::ios::app | std::ios::binary);
+    file << "torn";
+  }
+  {
+    SharedDatabase<StudentInfo, StudentId> journaledDB(
+        DB_PASSWORD, JOURNAL_DB_ID, options);
+    EXPECT_EQ(contents(journaledDB), expected);
+    journaledDB.push_back(students[0]);
+    expected.push_back(students[0].id);
+  }
+  {
+    SharedDatabase<StudentInfo, StudentId> journaledDB(
+        DB_PASSWORD, JOURNAL_DB_ID, options);
+    EXPECT_EQ(contents(journaledDB), expected);
+  }
+
+  // transactions are replayed whole, or not at all if any of them is torn
+  using JournaledDatabase = SharedDatabase<StudentInfo, StudentId>;
+  auto transact = [&](JournaledDatabase::Txn &txn) {
+    txn.erase(*txn.find(expected[0]));
+    txn.push_back(students[1]);
+    txn.set(*txn.find(students[1].id), students[2]);
+  };
+  {
+    JournaledDatabase journaledDB(DB_PASSWORD, JOURNAL_DB_ID, options);
+    journaledDB.transaction(transact);
+    expected = contents(journaledDB);
+  }
+  {
+    JournaledDatabase journaledDB(DB_PASSWORD, JOURNAL_DB_ID, options);
+    EXPECT_EQ(contents(journaledDB), expected);
+    journaledDB.transaction(transact);
+  }
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+  {
+    JournaledDatabase journaledDB(DB_PASSWORD, JOURNAL_DB_ID, options);
+    EXPECT_EQ(contents(journaledDB), expected);
+  }
+
+  // checkpoints running at once don't trip over each other's journals
+  {
+    JournaledDatabase journaledDB(DB_PASSWORD, JOURNAL_DB_ID, options);
+    std::vector<std::thread> checkpoints;
+    for (int i = 0; i < 4; i++) {
+      checkpoints.emplace_back([&journaledDB] { journaledDB.checkpoint(); });
+    }
+    for (auto &checkpoint : checkpoints) {
+      checkpoint.join();
+    }
+  }
+  {
+    JournaledDatabase journaledDB(DB_PASSWORD, JOURNAL_DB_ID, options);
+    EXPECT_EQ(contents(journaledDB), expected);
+  }
+  for (const auto &file : std::filesystem::directory_iterator(".")) {
+    EXPECT_NE(file.path().filename().string().rfind(path + ".", 0), 0);
+  }
+
+  // a journal of something else isn't replayed
+  options.tombstoneErase = false;
+  EXPECT_THROW(SharedDatabase<int>(DB_PASSWORD, JOURNAL_DB_ID, options),
+               std::runtime_error);
+  std::remove(path.c_str());
+}
+
+TEST(StudentInfoTest, loadStudents) {
+  auto path = "load_students_test.txt";
+  {
+    std::ofstream file(path);
+    file << "Alice\n123\n1 Main St\n5551234567\n";
+    // overlong fields are truncated, and windows line endings are accepted
+    file << std::string(60, 'b') << "\r\n-7\r\nsomewhere\r\n012345678901234";
+  }
+  auto students = loadStudents(path);
+  ASSERT_EQ(students.size(), 2);
+  EXPECT_STREQ(students[0].name, "Alice");
+  EXPECT_EQ(students[0].id, 123);
+  EXPECT_STREQ(students[0].address, "1 Main St");
+  EXPECT_STREQ(students[0].phone, "5551234567");
+  EXPECT_EQ(std::string(students[1].name), std::string(50, 'b'));
+  EXPECT_EQ(students[1].id, -7);
+  EXPECT_STREQ(students[1].address, "somewhere");
+  EXPECT_STREQ(students[1].phone, "0123456789");
+
+  {
+    std::ofstream file(path);
+    file << "Alice\nnot a number\n1 Main St\n5551234567\n";
+  }
+  EXPECT_THROW(loadStudents(path), std::invalid_argument);
+  std::remove(path);
+  EXPECT_THROW(loadStudents(path), std::system_error);
+}
+
+TEST_F(SharedDatabaseTest, tombstone_erase) {
+  constexpr int TOMBSTONE_DB_ID = DB_ID + 30;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.capacity = 16;
+  options.tombstoneErase = true;
+  auto tombstoneDB = SharedDatabase<StudentInfo, StudentId>(
+      DB_PASSWORD, TOMBSTONE_DB_ID, options);
+  auto otherDB =
+      SharedDatabase<StudentInfo, StudentId>(DB_PASSWORD, TOMBSTONE_DB_ID);
+
+  auto students = generateRandomStudents(300);
+  for (int i = 0; i < students.size(); i++) {
+    students[i].id = i;
+  }
+  tombstoneDB.push_back_bulk(students);
+  auto lastHandle = tombstoneDB.handle(299);
+
+  // erase every third student, through indexes and handles
+  std::vector<StudentInfo> reference;
+  for (int i = 0; i < students.size(); i++) {
+    if (i % 3 != 0) {
+      reference.push_back(students[i]);
+    }
+  }
+  for (int i = 0; i < students.size(); i += 3) {
+    if (i % 2 == 0) {
+      tombstoneDB.erase(*tombstoneDB.findHandle(i));
+    } else {
+      tombstoneDB.erase(*tombstoneDB.find(i));
+    }
+  }
+  auto checkReference = [&]() {
+    ASSERT_EQ(otherDB.size(), reference.size());
+    for (int i = 0; i < reference.size(); i++) {
+      EXPECT_EQ(otherDB.get(i).id, reference[i].id);
+      EXPECT_EQ(otherDB.find(reference[i].id), i);
+    }
+    int i = 0;
+    otherDB.scan([&](const StudentInfo &student) {
+      EXPECT_EQ(student.id, reference[i].id);
+      i++;
+    });
+    EXPECT_EQ(i, reference.size());
+    i = 0;
+    for (const auto &student : otherDB.snapshot()) {
+      EXPECT_EQ(student.id, reference[i].id);
+      i++;
+    }
+    EXPECT_EQ(i, reference.size());
+  };
+  checkReference();
+  EXPECT_FALSE(otherDB.find(3).has_value());
+
+  // handles survive erases
+  EXPECT_EQ(otherDB.get(lastHandle).id, 299);
+  EXPECT_THROW(otherDB.get(EntryHandle{0, lastHandle.epoch}),
+               std::out_of_range);
+
+  // insert() reuses an erased slot rather than growing
+  auto capacity = tombstoneDB.capacity();
+  auto slotsUsed = tombstoneDB.size() + 100;
+  auto newStudent = students[3];
+  newStudent.id = 1000;
+  auto newHandle = tombstoneDB.insert(newStudent);
+  EXPECT_LT(newHandle.slot, slotsUsed);
+  EXPECT_EQ(otherDB.get(newHandle).id, 1000);
+  EXPECT_EQ(tombstoneDB.capacity(), capacity);
+  reference.clear();
+  otherDB.scan([&](const StudentInfo &student) { reference.push_back(student); });
+  checkReference();
+
+  // compact in small steps while other changes happen between them
+  EXPECT_FALSE(tombstoneDB.compact(50));
+  tombstoneDB.erase(*tombstoneDB.find(1));
+  tombstoneDB.push_back(students[0]);
+  while (!tombstoneDB.compact(50)) {
+    tombstoneDB.erase(tombstoneDB.size() - 1);
+  }
+  reference.clear();
+  otherDB.scan([&](const StudentInfo &student) { reference.push_back(student); });
+  checkReference();
+  EXPECT_THROW(otherDB.get(lastHandle), std::out_of_range);
+
+  // a final compaction leaves no holes behind
+  tombstoneDB.compact(SIZE_MAX);
+  EXPECT_TRUE(tombstoneDB.compact());
+  auto handle = tombstoneDB.insert(newStudent);
+  EXPECT_EQ(otherDB.find(1000), handle.slot);
+  EXPECT_EQ(handle.slot, tombstoneDB.size() - 1);
+
+  tombstoneDB.clear();
+  EXPECT_EQ(otherDB.size(), 0);
+  tombstoneDB.push_back(students[5]);
+  EXPECT_EQ(otherDB.get(0).id, 5);
+}
+
+TEST_F(SharedDatabaseTest, key_column) {
+  constexpr int COLUMN_DB_ID = DB_ID + 40;
+  auto students = generateRandomStudents(500);
+  auto inRange = [](int id) { return id >= 200 && id < 600; };
+
+  for (bool tombstones : {false, true}) {
+    for (bool keyColumn : {false, true}) {
+      SharedDatabaseOptions options;
+      options.clean = true;
+      options.capacity = 10;
+      options.tombstoneErase = tombstones;
+      options.keyColumn = keyColumn;
+      auto columnDB = SharedDatabase<StudentInfo, StudentId>(
+          DB_PASSWORD, COLUMN_DB_ID, options);
+      columnDB.push_back_bulk(students.data(), 250);
+      for (int i = 250; i < students.size(); i++) {
+        columnDB.push_back(students[i]);
+      }
+      // change keys through every kind of write
+      for (int i = 0; i < 50; i++) {
+        columnDB.erase(i * 3);
+      }
+      auto changed = students[0];
+      changed.id = 300;
+      columnDB.set(7, changed);
+      columnDB.at(8)->id = 5000;
+      columnDB.at(9)->id = 1;
+      if (tombstones) {
+        columnDB.insert(changed);
+        columnDB.compact(100);
+      }
+
+      std::vector<size_t> expected;
+      size_t index = 0;
+      columnDB.scan([&](const StudentInfo &student) {
+        if (inRange(student.id)) {
+          expected.push_back(index);
+        }
+        index++;
+      });
+      EXPECT_EQ(columnDB.findKeys(inRange), expected);
+      EXPECT_EQ(columnDB.findKeys([](int id) { return id == 5000; }).size(),
+                1);
+    }
+  }
+
+  // a key column needs a key
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.keyColumn = true;
+  EXPECT_THROW(SharedDatabase<StudentInfo>(DB_PASSWORD, COLUMN_DB_ID, options),
+               std::invalid_argument);
+}
+
+TEST(FileBackedDatabaseTest, persists) {
+  const std::string path = "file_backed_test.db";
+  auto students = generateRandomStudents(200);
+  SharedDatabaseOptions options;
+  options.semTimeout = 50ms;
+  options.capacity = 16;
+  options.path = path;
+  {
+    SharedDatabase<StudentInfo, StudentId> fileDB(DB_PASSWORD, 0, options);
+    fileDB.push_back_bulk(students);
+    fileDB.at(3)->id = 5000;
+    fileDB.checkpoint();
+  }
+
+  // reopen it as if the program had been restarted
+  options.clean = true;
+  SharedDatabase<StudentInfo, StudentId> fileDB(DB_PASSWORD, 0, options);
+  students[3].id = 5000;
+  ASSERT_EQ(fileDB.size(), students.size());
+  for (size_t i = 0; i < students.size(); i++) {
+    EXPECT_EQ(fileDB.get(i).id, students[i].id);
+    EXPECT_STREQ(fileDB.get(i).name, students[i].name);
+  }
+  EXPECT_EQ(fileDB.find(5000), 3);
+  fileDB.push_back(students[0]);
+  EXPECT_EQ(fileDB.size(), students.size() + 1);
+}
+
+TEST_F(SharedDatabaseTest, change_feed) {
+  constexpr int FEED_DB_ID = DB_ID + 80;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.tombstoneErase = true;
+  options.changeFeed = 64;
+  auto feedDB =
+      SharedDatabase<StudentInfo, StudentId>(DB_PASSWORD, FEED_DB_ID, options);
+  auto subscriberDB = SharedDatabase<StudentInfo>(DB_PASSWORD, FEED_DB_ID);
+  auto students = generateRandomStudents(10);
+  for (int i = 0; i < students.size(); i++) {
+    students[i].id = 100 + i;
+  }
+
+  auto cursor = subscriberDB.changeCursor();
+  EXPECT_TRUE(subscriberDB.subscribe(cursor, 10ms).empty());
+  feedDB.push_back_bulk(students.data(), 5);
+  feedDB.set(2, students[7]);
+  feedDB.at(3)->id = 500;
+  feedDB.erase(1);
+  feedDB.insert(students[8]);
+  feedDB.clear();
+
+  std::vector<std::tuple<ChangeOp, size_t, uint64_t>> expected = {
+      {ChangeOp::ADDED, 0, 100},   {ChangeOp::ADDED, 1, 101},
+      {ChangeOp::ADDED, 2, 102},   {ChangeOp::ADDED, 3, 103},
+      {ChangeOp::ADDED, 4, 104},   {ChangeOp::CHANGED, 2, 107},
+      {ChangeOp::CHANGED, 3, 500}, {ChangeOp::ERASED, 1, 101},
+      {ChangeOp::ADDED, 1, 108},   {ChangeOp::CLEARED, 0, 0}};
+  auto changes = subscriberDB.subscribe(cursor);
+  ASSERT_EQ(changes.size(), expected.size());
+  for (int i = 0; i < changes.size(); i++) {
+    EXPECT_EQ(std::make_tuple(changes[i].op, changes[i].index, changes[i].key),
+              expected[i]);
+  }
+  EXPECT_EQ(cursor, changes.back().sequence + 1);
+
+  // a sleeping subscriber is woken by the next change
+  std::thread subscriber([&] {
+    auto woken = subscriberDB.subscribe(cursor, 5s);
+    ASSERT_EQ(woken.size(), 1);
+    EXPECT_EQ(woken[0].op, ChangeOp::ADDED);
+  });
+  std::this_thread::sleep_for(50ms);
+  feedDB.push_back(students[9]);
+  subscriber.join();
+
+  // falling more than a ring behind loses the changes in between
+  for (int i = 0; i < 100; i++) {
+    feedDB.set(0, students[i % students.size()]);
+  }
+  changes = subscriberDB.subscribe(cursor);
+  ASSERT_EQ(changes.size(), 65);
+  EXPECT_EQ(changes[0].op, ChangeOp::OVERRUN);
+  EXPECT_EQ(changes[1].op, ChangeOp::CHANGED);
+  EXPECT_EQ(changes[64].key, students[99 % students.size()].id);
+
+  EXPECT_THROW((void)db->changeCursor(), std::runtime_error);
+}
+
+TEST_F(SharedDatabaseTest, stats) {
+  auto otherDB = SharedDatabase<StudentInfo>(DB_PASSWORD, DB_ID, 10ms);
+  otherDB.resetStats();
+  fillStudents();
+  // db's own counts are all in once it's asked
+  const auto &stats = db->stats();
+  auto op = [&](StatOp op) {
+    return stats.ops[static_cast<int>(op)].load();
+  };
+  auto lock = [&](StatLock lock) -> const LockStats & {
+    return stats.locks[static_cast<int>(lock)];
+  };
+  if (!SHARED_DATABASE_STATS) {
+    EXPECT_EQ(op(StatOp::PUSH_BACK), 0);
+    return;
+  }
+  EXPECT_EQ(op(StatOp::PUSH_BACK), db->size());
+  EXPECT_EQ(op(StatOp::GET), db->size());
+  EXPECT_EQ(lock(StatLock::WRITE).acquisitions.load(), db->size());
+  uint64_t waits = 0;
+  for (const auto &bucket : lock(StatLock::READ).waits) {
+    waits += bucket.load();
+  }
+  EXPECT_EQ(waits, lock(StatLock::READ).acquisitions.load());
+
+  // a writer timing out behind a reader
+  {
+    auto readLock = db->smartSize();
+    EXPECT_THROW(otherDB.set(0, db->get(0)), std::system_error);
+  }
+  EXPECT_EQ(lock(StatLock::WRITE).timeouts.load(), 1);
+  EXPECT_GE(stats.maxReaders.load(), 1);
+
+  std::ostringstream out;
+  out << stats;
+  EXPECT_NE(out.str().find("push_back"), std::string::npos);
+  db->resetStats();
+  EXPECT_EQ(op(StatOp::GET), 0);
+  EXPECT_EQ(lock(StatLock::WRITE).timeouts.load(), 0);
+
+  // other handles' counts show up a batch at a time
+  for (uint64_t i = 0; i + 1 < STAT_OP_BATCH; i++) {
+    (void)otherDB.get(0);
+  }
+  EXPECT_EQ(op(StatOp::GET), 0);
+  (void)otherDB.get(0);
+  EXPECT_EQ(op(StatOp::GET), STAT_OP_BATCH);
+}
+
+TEST_F(SharedDatabaseTest, ordered_index) {
+  constexpr int ORDERED_DB_ID = DB_ID + 90;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.capacity = 16;
+  options.tombstoneErase = true;
+  options.lockStripes = 4;
+  using OrderedDB = SharedDatabase<StudentInfo, NoIndex, StudentId>;
+  auto orderedDB = OrderedDB(DB_PASSWORD, ORDERED_DB_ID, options);
+  auto otherDB = OrderedDB(DB_PASSWORD, ORDERED_DB_ID);
+
+  // the ids range() finds, and the ones it should have found
+  auto rangeIds = [&](int low, int high) {
+    std::vector<int> ids;
+    for (const auto &student : otherDB.range(low, high)) {
+      ids.push_back(student.id);
+    }
+    return ids;
+  };
+  auto expectedIds = [&](int low, int high) {
+    std::vector<int> ids;
+    otherDB.scan([&](const StudentInfo &student) {
+      if (student.id >= low && student.id <= high) {
+        ids.push_back(student.id);
+      }
+    });
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+  auto checkRanges = [&] {
+    EXPECT_EQ(rangeIds(INT_MIN, INT_MAX), expectedIds(INT_MIN, INT_MAX));
+    for (int low = 0; low < 1000; low += 97) {
+      EXPECT_EQ(rangeIds(low, low + 150), expectedIds(low, low + 150));
+    }
+  };
+
+  // ids are below 1000, so plenty of them repeat
+  auto students = generateRandomStudents(2000);
+  orderedDB.push_back_bulk(students.data(), 1000);
+  checkRanges();
+  // one at a time, splitting nodes as they fill up
+  for (int i = 1000; i < students.size(); i++) {
+    orderedDB.push_back(students[i]);
+  }
+  checkRanges();
+
+  std::mt19937 gen(7);
+  for (int i = 0; i < 500; i++) {
+    auto index = gen() % orderedDB.size();
+    switch (i % 5) {
+      case 0:
+        orderedDB.erase(index);
+        break;
+      case 1:
+        orderedDB.insert(students[gen() % students.size()]);
+        break;
+      case 2: {
+        auto student = orderedDB.get(index);
+        student.id = gen() % 1000;
+        orderedDB.set(index, student);
+        break;
+      }
+      case 3:
+        orderedDB.at(index)->id = gen() % 1000;
+        break;
+      case 4: {
+        auto edit = orderedDB.edit(index);
+        edit->id = gen() % 1000;
+        EXPECT_TRUE(edit.commit());
+        break;
+      }
+    }
+  }
+  checkRanges();
+  while (!orderedDB.compact(100)) {
+  }
+  checkRanges();
+  // erasing most of the entries leaves mostly empty nodes, until the index is
+  // rebuilt
+  while (orderedDB.size() > 100) {
+    orderedDB.erase(0);
+  }
+  checkRanges();
+  orderedDB.push_back(students[0]);
+  checkRanges();
+  EXPECT_TRUE(rangeIds(5, 4).empty());
+
+  orderedDB.clear();
+  EXPECT_TRUE(rangeIds(INT_MIN, INT_MAX).empty());
+  orderedDB.push_back(students[0]);
+  EXPECT_EQ(rangeIds(INT_MIN, INT_MAX), std::vector<int>{students[0].id});
+
+  // handles without the order key can't keep the index up to date
+  auto unorderedDB = SharedDatabase<StudentInfo>(DB_PASSWORD, ORDERED_DB_ID);
+  EXPECT_THROW(unorderedDB.push_back(students[0]), std::runtime_error);
+
+  // names are ordered byte by byte, so a prefix is a range of them
+  SharedDatabaseOptions nameOptions;
+  nameOptions.clean = true;
+  nameOptions.capacity = 4;
+  auto nameDB = SharedDatabase<StudentInfo, StudentId, StudentName>(
+      DB_PASSWORD, ORDERED_DB_ID + 1, nameOptions);
+  std::vector<std::string> names = {"bob",   "alice", "bobby", "bo",
+                                    "carol", "bob",   "b"};
+  for (int i = 0; i < names.size(); i++) {
+    StudentInfo student{};
+    std::strncpy(student.name, names[i].c_str(), sizeof(student.name) - 1);
+    student.id = i;
+    nameDB.push_back(student);
+  }
+  // without tombstones, everything after an erased entry moves down
+  nameDB.erase(0);
+  auto prefixNames = [&](const std::string &prefix) {
+    auto [low, high] = StudentName::prefixRange(prefix);
+    std::vector<std::string> found;
+    for (const auto &student : nameDB.range(low, high)) {
+      found.emplace_back(student.name);
+    }
+    return found;
+  };
+  EXPECT_EQ(prefixNames("bo"),
+            (std::vector<std::string>{"bo", "bob", "bobby"}));
+  EXPECT_EQ(prefixNames("b"),
+            (std::vector<std::string>{"b", "bo", "bob", "bobby"}));
+  EXPECT_TRUE(prefixNames("d").empty());
+  EXPECT_EQ(prefixNames("").size(), nameDB.size());
+
+  EntryHandle handle;
+  {
+    auto [low, high] = StudentName::prefixRange("bo");
+    handle = nameDB.range(low, high).begin().handle();
+  }
+  auto student = nameDB.get(handle);
+  EXPECT_STREQ(student.name, "bo");
+  std::strncpy(student.name, "dave", sizeof(student.name) - 1);
+  nameDB.set(*nameDB.find(student.id), student);
+  EXPECT_EQ(prefixNames("bo"), (std::vector<std::string>{"bob", "bobby"}));
+  EXPECT_EQ(prefixNames("d"), std::vector<std::string>{"dave"});
+}
+
+TEST_F(SharedDatabaseTest, select) {
+  constexpr int SELECT_DB_ID = DB_ID + 100;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.capacity = 40;
+  options.tombstoneErase = true;
+  auto selectDB =
+      SharedDatabase<StudentInfo>(DB_PASSWORD, SELECT_DB_ID, options);
+  auto students = generateRandomStudents(1000);
+  for (int i = 0; i < students.size(); i++) {
+    if (i % 4 == 0) {
+      students[i].name[0] = 'S';
+      students[i].name[1] = 'm';
+    }
+  }
+  selectDB.push_back_bulk(students);
+  // leave holes in some blocks, so indexes and slots differ
+  for (int i = 0; i < 100; i++) {
+    selectDB.erase(i * 7 % selectDB.size());
+  }
+  std::vector<StudentInfo> live;
+  selectDB.scan([&](const StudentInfo &student) { live.push_back(student); });
+
+  auto expect = [&](auto &&pred) {
+    std::vector<size_t> indexes;
+    for (size_t i = 0; i < live.size(); i++) {
+      if (pred(live[i])) {
+        indexes.push_back(i);
+      }
+    }
+    return indexes;
+  };
+  auto inRange = [](const StudentInfo &student) {
+    return student.id >= 200 && student.id <= 400;
+  };
+  auto smith = [](const StudentInfo &student) {
+    return std::strncmp(student.name, "Sm", 2) == 0;
+  };
+
+  EXPECT_EQ(selectDB.select(where(&StudentInfo::id, between(200, 400))),
+            expect(inRange));
+  EXPECT_EQ(selectDB.select(startsWith(&StudentInfo::name, "Sm")),
+            expect(smith));
+  EXPECT_EQ(selectDB.select(where(&StudentInfo::id, between(200, 400)) &&
+                            startsWith(&StudentInfo::name, "Sm")),
+            expect([&](const StudentInfo &student) {
+              return inRange(student) && smith(student);
+            }));
+  EXPECT_EQ(selectDB.select(where(&StudentInfo::id, equals(live[5].id)) ||
+                            startsWith(&StudentInfo::name, "Sm")),
+            expect([&](const StudentInfo &student) {
+              return student.id == live[5].id || smith(student);
+            }));
+  EXPECT_EQ(selectDB.select(startsWith(&StudentInfo::name, "")).size(),
+            live.size());
+  // longer than the field
+  EXPECT_TRUE(
+      selectDB.select(startsWith(&StudentInfo::phone, "01234567890")).empty());
+  // an empty range, and copies of the matches rather than indexes
+  EXPECT_TRUE(
+      selectDB.select(where(&StudentInfo::id, between(400, 200))).empty());
+  std::vector<int> ids;
+  for (const auto &student :
+       selectDB.selectEntries(where(&StudentInfo::id, between(200, 400)))) {
+    ids.push_back(student.id);
+  }
+  std::vector<int> expectedIds;
+  for (auto index : expect(inRange)) {
+    expectedIds.push_back(live[index].id);
+  }
+  EXPECT_EQ(ids, expectedIds);
+}
+
+TEST_F(SharedDatabaseTest, batch) {
+  constexpr int BATCH_DB_ID = DB_ID + 110;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.capacity = 8;
+  auto batchDB = SharedDatabase<StudentInfo, StudentId>(DB_PASSWORD,
+                                                        BATCH_DB_ID, options);
+  auto otherDB =
+      SharedDatabase<StudentInfo, StudentId>(DB_PASSWORD, BATCH_DB_ID);
+  auto students = generateRandomStudents(20);
+  for (int i = 0; i < students.size(); i++) {
+    students[i].id = i;
+  }
+
+  batchDB.batch([&](auto &batch) {
+    for (const auto &student : students) {
+      batch.push_back(student);
+    }
+    // later changes see the earlier ones
+    EXPECT_EQ(batch.size(), students.size());
+    auto student = batch.get(*batch.find(5));
+    student.id = 100;
+    batch.set(5, student);
+    batch.erase(*batch.find(0));
+    EXPECT_FALSE(batch.find(0).has_value());
+  });
+  EXPECT_EQ(otherDB.size(), students.size() - 1);
+  EXPECT_EQ(otherDB.find(100), 4);
+  EXPECT_EQ(otherDB.get(0).id, 1);
+
+  // other processes wait for the whole batch
+  std::atomic<bool> done = false;
+  std::thread reader;
+  batchDB.batch([&](auto &batch) {
+    reader = std::thread([&] {
+      EXPECT_EQ(*otherDB.smartSize(), 0);
+      EXPECT_TRUE(done);
+    });
+    while (batch.size() > 0) {
+      batch.erase(0);
+    }
+    std::this_thread::sleep_for(20ms);
+    done = true;
+  });
+  reader.join();
+
+  // changes made before a throw are undone
+  EXPECT_THROW(batchDB.batch([&](auto &batch) {
+    batch.push_back(students[0]);
+    batch.erase(5);
+  }),
+               std::out_of_range);
+  EXPECT_EQ(otherDB.size(), 0);
+
+  auto readOnlyDB = SharedDatabase<StudentInfo>(DB_PASSWORD, BATCH_DB_ID);
+  EXPECT_THROW(readOnlyDB.batch([](auto &) {}), std::runtime_error);
+}
+
+TEST_F(SharedDatabaseTest, transaction) {
+  using NamedDatabase = SharedDatabase<StudentInfo, StudentId, StudentName>;
+  for (bool tombstones : {false, true}) {
+    const int txnDBId = DB_ID + 120 + tombstones;
+    SharedDatabaseOptions options;
+    options.clean = true;
+    options.tombstoneErase = tombstones;
+    auto txnDB = NamedDatabase(DB_PASSWORD, txnDBId, options);
+    auto otherDB = NamedDatabase(DB_PASSWORD, txnDBId);
+    auto students = generateRandomStudents(10);
+    for (int i = 0; i < students.size(); i++) {
+      students[i].id = i;
+    }
+    txnDB.push_back_bulk(students);
+
+    // changes are seen by the rest of the transaction
+    txnDB.transaction([&](NamedDatabase::Txn &txn) {
+      auto student = txn.get(*txn.find(3));
+      student.id = 30;
+      txn.set(3, student);
+      EXPECT_EQ(txn.find(30), 3);
+      txn.erase(*txn.find(0));
+      EXPECT_FALSE(txn.find(0).has_value());
+    });
+    EXPECT_EQ(otherDB.find(30), 2);
+    EXPECT_FALSE(otherDB.find(0).has_value());
+
+    // and undone if it throws
+    auto ids = [&] {
+      std::vector<int> found;
+      for (const auto &student : otherDB.snapshot()) {
+        found.push_back(student.id);
+      }
+      return found;
+    };
+    auto namedIds = [&] {
+      auto [low, high] = StudentName::prefixRange("");
+      std::vector<int> found;
+      for (const auto &student : otherDB.range(low, high)) {
+        found.push_back(student.id);
+      }
+      std::sort(found.begin(), found.end());
+      return found;
+    };
+    auto before = ids();
+    auto namedBefore = namedIds();
+    EXPECT_THROW(txnDB.transaction([&](NamedDatabase::Txn &txn) {
+      auto student = students[0];
+      student.id = 100;
+      txn.push_back(student);
+      txn.erase(*txn.find(4));
+      txn.erase(*txn.find(1));
+      student = txn.get(*txn.find(30));
+      student.id = 300;
+      std::strcpy(student.name, "zzz");
+      txn.set(*txn.find(30), student);
+      txn.erase(txn.size());
+    }),
+                 std::out_of_range);
+    EXPECT_EQ(ids(), before);
+    EXPECT_EQ(namedIds(), namedBefore);
+    EXPECT_EQ(otherDB.find(30), 2);
+    EXPECT_EQ(otherDB.find(4), 3);
+    EXPECT_FALSE(otherDB.find(100).has_value());
+    EXPECT_FALSE(otherDB.find(300).has_value());
+
+    // an optimistic transaction runs again if the database changed under it
+    int runs = 0;
+    txnDB.transaction(
+        [&](NamedDatabase::Txn &txn) {
+          auto index = *txn.find(5);
+          if (runs++ == 0) {
+            otherDB.erase(0);
+          }
+          // the first time round, index is stale by now
+          auto student = txn.get(index);
+          student.id = 50;
+          txn.set(index, student);
+        },
+        true);
+    EXPECT_EQ(runs, 2);
+    EXPECT_FALSE(otherDB.find(5).has_value());
+    EXPECT_TRUE(otherDB.find(50).has_value());
+    EXPECT_TRUE(otherDB.find(6).has_value());
+    EXPECT_EQ(*otherDB.smartSize(), before.size() - 1);
+
+    // optimistic indexes mean the entries the body saw, so it gives the same
+    // result as under the lock even after an earlier erase moves them
+    for (bool optimistic : {false, true}) {
+      txnDB.clear();
+      for (int id : {10, 20, 30}) {
+        auto student = students[0];
+        student.id = id;
+        txnDB.push_back(student);
+      }
+      txnDB.transaction(
+          [&](NamedDatabase::Txn &txn) {
+            txn.erase(*txn.find(10));
+            txn.erase(*txn.find(20));
+          },
+          optimistic);
+      ASSERT_EQ(otherDB.size(), 1);
+      EXPECT_EQ(otherDB.get(0).id, 30);
+    }
+  }
+}
+
+// A student with its strings in the database's string arena
+struct CompactStudent {
+  StringRef name;
+  int id;
+  StringRef address;
+};
+
+TEST_F(SharedDatabaseTest, string_arena) {
+  constexpr int ARENA_DB_ID = DB_ID + 130;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  options.stringArena = 256;
+  auto arenaDB =
+      SharedDatabase<CompactStudent>(DB_PASSWORD, ARENA_DB_ID, options);
+  auto otherDB = SharedDatabase<CompactStudent>(DB_PASSWORD, ARENA_DB_ID);
+  auto students = generateRandomStudents(200);
+  for (int i = 0; i < students.size(); i++) {
+    arenaDB.push_back({arenaDB.storeString(students[i].name), i,
+                       arenaDB.storeString(students[i].address)});
+  }
+  EXPECT_LT(sizeof(CompactStudent), sizeof(StudentInfo));
+
+  // the arena has grown well past where it started, and other processes
+  // follow it
+  for (int i = 0; i < students.size(); i++) {
+    auto student = otherDB.get(i);
+    EXPECT_EQ(otherDB.getString(student.name), students[i].name);
+    EXPECT_EQ(otherDB.getString(student.address), students[i].address);
+    EXPECT_EQ(otherDB.compareString(student.name, students[i].name), 0);
+  }
+  EXPECT_LT(otherDB.compareString(StringRef{}, "a"), 0);
+
+  // released strings make room for new ones of the same size
+  auto student = otherDB.get(0);
+  otherDB.releaseString(student.name);
+  auto name = std::string(students[0].name) + "!";
+  student.name = otherDB.storeString(name);
+  otherDB.set(0, student);
+  EXPECT_EQ(arenaDB.getString(arenaDB.get(0).name), name);
+  EXPECT_EQ(arenaDB.getString(arenaDB.get(1).name), students[1].name);
+
+  // snapshots would only have the strings' offsets, and strings too long for
+  // any block are turned away before the arena grows
+  EXPECT_THROW(arenaDB.dump("arena_test.snap"), std::logic_error);
+  EXPECT_THROW(arenaDB.storeString(std::string(STRING_MAX_LENGTH + 1, 'x')),
+               std::length_error);
+  EXPECT_EQ(otherDB.getString(otherDB.get(1).name), students[1].name);
+
+  // clearing the database frees its strings
+  arenaDB.clear();
+  EXPECT_THROW(arenaDB.getString(student.name), std::out_of_range);
+  EXPECT_EQ(arenaDB.getString(arenaDB.storeString("again")), "again");
+
+  SharedDatabaseOptions journalOptions;
+  journalOptions.clean = true;
+  journalOptions.journalPath = "arena_test.wal";
+  auto journaledDB = SharedDatabase<CompactStudent>(
+      DB_PASSWORD, ARENA_DB_ID + 1, journalOptions);
+  EXPECT_THROW(journaledDB.storeString("lost"), std::runtime_error);
+  std::remove("arena_test.wal");
+}
+
+// StudentInfo's layout under different field names
+struct RenamedStudent {
+  char fullName[51];
+  int id;
+  char address[251];
+  char phone[11];
+};
+
+template <>
+struct RecordSchema<RenamedStudent> {
+  constexpr static auto fields = std::make_tuple(
+      field("fullName", &RenamedStudent::fullName),
+      field("id", &RenamedStudent::id),
+      field("address", &RenamedStudent::address),
+      field("phone", &RenamedStudent::phone));
+};
+
+TEST_F(SharedDatabaseTest, schema) {
+  constexpr int SCHEMA_DB_ID = DB_ID + 140;
+  static_assert(fieldsHash<StudentInfo>() != fieldsHash<RenamedStudent>());
+  static_assert(FIELD_COUNT<StudentInfo> == 4);
+
+  // records go out and come back in field by field
+  auto student = generateRandomStudents(1)[0];
+  std::stringstream text;
+  writeRecord(text, student);
+  StudentInfo parsed{};
+  readRecord(parsed, [&] {
+    std::string line;
+    std::getline(text, line);
+    return line;
+  });
+  EXPECT_STREQ(parsed.name, student.name);
+  EXPECT_EQ(parsed.id, student.id);
+  EXPECT_STREQ(parsed.address, student.address);
+  EXPECT_STREQ(parsed.phone, student.phone);
+  std::stringstream bad("name\nnot a number\n");
+  EXPECT_THROW(readRecord(parsed,
+                          [&] {
+                            std::string line;
+                            std::getline(bad, line);
+                            return line;
+                          }),
+               std::invalid_argument);
+
+  // strings are truncated to fit
+  setString(parsed.phone, "0123456789012345");
+  EXPECT_STREQ(parsed.phone, "0123456789");
+  EXPECT_EQ(FieldKey<&StudentInfo::phone>{}(parsed).view(), "0123456789");
+  EXPECT_EQ(FieldKey<&StudentInfo::id>{}(parsed), student.id);
+
+  // a program with a different schema can't open the database
+  SharedDatabaseOptions options;
+  options.clean = true;
+  auto schemaDB =
+      SharedDatabase<StudentInfo>(DB_PASSWORD, SCHEMA_DB_ID, options);
+  EXPECT_THROW(SharedDatabase<RenamedStudent>(DB_PASSWORD, SCHEMA_DB_ID),
+               std::runtime_error);
+}
+
+TEST_F(SharedDatabaseTest, placement) {
+  constexpr int PLACEMENT_DB_ID = DB_ID + 150;
+  SharedDatabaseOptions options;
+  options.clean = true;
+  // big enough for a huge page, if there are any
+  options.capacity = 16384;
+  options.hugePages = true;
+  options.numaPolicy = NumaPolicy::INTERLEAVE;
+  auto placedDB =
+      SharedDatabase<StudentInfo>(DB_PASSWORD, PLACEMENT_DB_ID, options);
+  auto otherDB = SharedDatabase<StudentInfo>(DB_PASSWORD, PLACEMENT_DB_ID);
+  auto students = generateRandomStudents(options.capacity + 1);
+  placedDB.push_back_bulk(students);
+  for (size_t i = 0; i < students.size(); i += 997) {
+    EXPECT_EQ(otherDB.get(i).id, students[i].id);
+  }
+
+  // falls back to normal pages on machines without huge pages
+  auto pageSize = otherDB.stats().pageSize.load();
+  auto basePageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  EXPECT_GE(pageSize, basePageSize);
+  if (pageSize == basePageSize) {
+    EXPECT_EQ(otherDB.stats().hugePageBytes.load(), 0);
+  } else {
+    EXPECT_GE(otherDB.stats().hugePageBytes.load(),
+              options.capacity * sizeof(StudentInfo));
+  }
+  otherDB.resetStats();
+  EXPECT_EQ(otherDB.stats().pageSize.load(), pageSize);
+}
+
+TEST_F(SharedDatabaseTest, catalog) {
+  const std::string CATALOG = "/shared_database_test_catalog";
+  Catalog::unlink(CATALOG);
+  Catalog catalog(CATALOG);
+  SharedDatabaseOptions options;
+  options.clean = true;
+  auto students = generateRandomStudents(100);
+  {
+    SharedDatabase<StudentInfo, StudentId> studentDB(DB_PASSWORD, catalog,
+                                                     "students", options);
+    SharedDatabase<CompactStudent> compactDB(DB_PASSWORD, catalog, "compact",
+                                             options);
+    studentDB.push_back_bulk(students);
+    compactDB.push_back({compactDB.storeString("seven"), 7, {}});
+    EXPECT_EQ(compactDB.size(), 1);
+
+    // another handle on the catalog finds the same tables by name
+    Catalog otherCatalog(CATALOG);
+    auto names = otherCatalog.tables();
+    std::sort(names.begin(), names.end());
+    EXPECT_EQ(names, (std::vector<std::string>{"compact", "students"}));
+    SharedDatabase<StudentInfo, StudentId> otherDB(DB_PASSWORD, otherCatalog,
+                                                   "students");
+    ASSERT_EQ(otherDB.size(), students.size());
+    EXPECT_EQ(otherDB.get(*otherDB.find(students[5].id)).id, students[5].id);
+
+    // dropped tables are gone from the catalog, and opening one again makes
+    // a new, empty table
+    studentDB.drop();
+    EXPECT_EQ(catalog.tables(), std::vector<std::string>{"compact"});
+    SharedDatabase<StudentInfo, StudentId> newDB(DB_PASSWORD, catalog,
+                                                 "students", options);
+    EXPECT_EQ(newDB.size(), 0);
+    // dropping the old table again doesn't touch the new one
+    otherDB.drop();
+    EXPECT_EQ(catalog.tables().size(), 2);
+    newDB.push_back(students[0]);
+    EXPECT_EQ(newDB.size(), 1);
+
+    SharedDatabase<StudentInfo> idDB(DB_PASSWORD, DB_ID + 160, options);
+    EXPECT_THROW(idDB.drop(), std::logic_error);
+    EXPECT_THROW(SharedDatabase<StudentInfo>(DB_PASSWORD, catalog,
+                                             std::string(MAX_TABLE_NAME, 'x')),
+                 std::invalid_argument);
+  }
+  // clean handles take their tables with them
+  EXPECT_TRUE(catalog.tables().empty());
+
+  // and tables that fail to set up are taken back out
+  std::ofstream("catalog_test.wal") << "not a journal";
+  SharedDatabaseOptions journalOptions;
+  journalOptions.journalPath = "catalog_test.wal";
+  EXPECT_THROW(SharedDatabase<StudentInfo>(DB_PASSWORD, catalog, "broken",
+                                           journalOptions),
+               std::runtime_error);
+  EXPECT_TRUE(catalog.tables().empty());
+  std::remove("catalog_test.wal");
+
+  // processes opening a new table at once all get the same one
+  constexpr int PROCESSES = 4;
+  std::vector<pid_t> children;
+  for (int i = 0; i < PROCESSES; i++) {
+    auto pid = fork();
+    if (pid == 0) {
+      Catalog childCatalog(CATALOG);
+      SharedDatabase<StudentInfo> childDB(DB_PASSWORD, childCatalog, "shared");
+      childDB.push_back(students[i]);
+      _exit(0);
+    }
+    children.push_back(pid);
+  }
+  for (auto pid : children) {
+    int status;
+    waitpid(pid, &status, 0);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  SharedDatabase<StudentInfo> sharedDB(DB_PASSWORD, catalog, "shared",
+                                       options);
+  EXPECT_EQ(sharedDB.size(), PROCESSES);
+  sharedDB.drop();
+  Catalog::unlink(CATALOG);
+
+  // a catalog whose creator died part way is finished by the next opener
+  const std::string HALF_MADE = "/shared_database_test_half_made";
+  Catalog::unlink(HALF_MADE);
+  auto creator = fork();
+  if (creator == 0) {
+    int fd = shm_open(HALF_MADE.c_str(), O_RDWR | O_CREAT | O_EXCL,
+                      S_IRUSR | S_IWUSR);
+    if (fd == -1 || ftruncate(fd, sizeof(CatalogState)) == -1) {
+      _exit(1);
+    }
+    auto state = static_cast<CatalogState *>(
+        mmap(nullptr, sizeof(CatalogState), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0));
+    state->creator.store(getpid());
+    _exit(0);
+  }
+  int status;
+  waitpid(creator, &status, 0);
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+  {
+    Catalog halfMade(HALF_MADE, 1s);
+    EXPECT_TRUE(halfMade.tables().empty());
+  }
+  Catalog::unlink(HALF_MADE);
+}
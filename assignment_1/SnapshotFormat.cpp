@@ -0,0 +1,209 @@
+#include "SnapshotFormat.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace {
+
+// records are written out once this much has been buffered
+constexpr size_t SNAPSHOT_BUFFER_BYTES = 1 << 20;
+
+std::array<uint32_t, 256> makeCrcTable() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+// Writes all of the given bytes, retrying short writes
+void writeAll(int fd, const char *data, size_t bytes,
+              const std::string &path) {
+  while (bytes > 0) {
+    auto written = ::write(fd, data, bytes);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              "Failed to write snapshot: " + path);
+    }
+    data += written;
+    bytes -= written;
+  }
+}
+
+}  // namespace
+
+uint32_t crc32(const void *data, size_t bytes, uint32_t crc) {
+  static const auto table = makeCrcTable();
+  auto bytesIn = static_cast<const unsigned char *>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < bytes; i++) {
+    crc = table[(crc ^ bytesIn[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+SnapshotWriter::SnapshotWriter(const std::string &path, uint32_t recordSize,
+                               uint64_t schemaHash)
+    : path_(path), tempPath_(path + ".tmp"), buffer_(SNAPSHOT_BUFFER_BYTES) {
+  fd_ = open(tempPath_.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+             S_IRUSR | S_IWUSR);
+  if (fd_ == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to create snapshot: " + tempPath_);
+  }
+  std::memcpy(header_.magic, SNAPSHOT_MAGIC, sizeof(header_.magic));
+  header_.version = SNAPSHOT_VERSION;
+  header_.recordSize = recordSize;
+  header_.schemaHash = schemaHash;
+  // leave room for the header, which is written last
+  buffered_ = sizeof(SnapshotHeader);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  if (fd_ != -1) {
+    // never finished, so don't leave half a snapshot lying around
+    close(fd_);
+    unlink(tempPath_.c_str());
+  }
+}
+
+void SnapshotWriter::write(const void *records, size_t count) {
+  auto data = static_cast<const char *>(records);
+  auto bytes = count * header_.recordSize;
+  header_.crc = crc32(data, bytes, header_.crc);
+  header_.count += count;
+  while (bytes > 0) {
+    auto chunk = std::min(bytes, buffer_.size() - buffered_);
+    std::memcpy(buffer_.data() + buffered_, data, chunk);
+    buffered_ += chunk;
+    data += chunk;
+    bytes -= chunk;
+    if (buffered_ == buffer_.size()) {
+      flush();
+    }
+  }
+}
+
+void SnapshotWriter::finish() {
+  flush();
+  if (pwrite(fd_, &header_, sizeof(header_), 0) !=
+          static_cast<ssize_t>(sizeof(header_)) ||
+      fsync(fd_) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to write snapshot: " + tempPath_);
+  }
+  close(fd_);
+  fd_ = -1;
+  if (rename(tempPath_.c_str(), path_.c_str()) == -1) {
+    auto error = errno;
+    unlink(tempPath_.c_str());
+    throw std::system_error(error, std::generic_category(),
+                            "Failed to replace snapshot: " + path_);
+  }
+}
+
+void SnapshotWriter::flush() {
+  writeAll(fd_, buffer_.data(), buffered_, tempPath_);
+  buffered_ = 0;
+}
+
+SnapshotReader::SnapshotReader(const std::string &path, uint32_t recordSize,
+                               uint64_t schemaHash, bool map) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to open snapshot: " + path);
+  }
+  struct stat fileStat {};
+  if (fstat(fd, &fileStat) == -1) {
+    auto error = errno;
+    close(fd);
+    throw std::system_error(error, std::generic_category(),
+                            "Failed to stat snapshot: " + path);
+  }
+  bytes_ = fileStat.st_size;
+  if (bytes_ < sizeof(SnapshotHeader)) {
+    close(fd);
+    throw std::runtime_error("Not a database snapshot: " + path);
+  }
+
+  if (map) {
+    auto address = mmap(nullptr, bytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) {
+      auto error = errno;
+      close(fd);
+      throw std::system_error(error, std::generic_category(),
+                              "Failed to map snapshot: " + path);
+    }
+    // the records are only read through once, front to back
+    madvise(address, bytes_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char *>(address);
+    mapped_ = true;
+  } else {
+    buffer_.resize(bytes_);
+    size_t done = 0;
+    while (done < bytes_) {
+      auto chunk = read(fd, buffer_.data() + done, bytes_ - done);
+      if (chunk <= 0) {
+        if (chunk == -1 && errno == EINTR) {
+          continue;
+        }
+        auto error = chunk == 0 ? EIO : errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(),
+                                "Failed to read snapshot: " + path);
+      }
+      done += chunk;
+    }
+    data_ = buffer_.data();
+  }
+  close(fd);
+
+  SnapshotHeader header{};
+  std::memcpy(&header, data_, sizeof(header));
+  try {
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION) {
+      throw std::runtime_error("Not a database snapshot: " + path);
+    }
+    if (header.recordSize != recordSize || header.schemaHash != schemaHash) {
+      throw std::runtime_error("Snapshot is of a different record type: " +
+                               path);
+    }
+    if ((bytes_ - sizeof(SnapshotHeader)) / recordSize != header.count ||
+        (bytes_ - sizeof(SnapshotHeader)) % recordSize != 0) {
+      throw std::runtime_error("Snapshot is truncated: " + path);
+    }
+    if (crc32(records(), header.count * recordSize) != header.crc) {
+      throw std::runtime_error("Snapshot checksum mismatch: " + path);
+    }
+  } catch (...) {
+    if (mapped_) {
+      munmap(const_cast<char *>(data_), bytes_);
+    }
+    throw;
+  }
+  count_ = header.count;
+}
+
+SnapshotReader::~SnapshotReader() {
+  if (mapped_) {
+    munmap(const_cast<char *>(data_), bytes_);
+  }
+}
@@ -0,0 +1,110 @@
+#ifndef ASSIGNMENT_1_SNAPSHOTFORMAT_H
+#define ASSIGNMENT_1_SNAPSHOTFORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include "Schema.hpp"
+
+// Binary snapshots are a header followed by the raw records, so they can be
+// written and read back with a few large sequential writes/reads (or mapped)
+// instead of formatting and parsing every field.
+constexpr static char SNAPSHOT_MAGIC[8] = {'S', 'D', 'B', 'S',
+                                          'N', 'A', 'P', '\0'};
+constexpr static uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+  // identifies the record type, so a snapshot isn't restored into a database
+  // of something else that happens to be the same size
+  uint64_t schemaHash;
+  uint64_t count;
+  // CRC-32 of the records
+  uint32_t crc;
+  uint32_t reserved;
+};
+
+// Updates a CRC-32 (the zlib one) with the given bytes. Pass the previous
+// result as crc to checksum something in pieces.
+uint32_t crc32(const void *data, size_t bytes, uint32_t crc = 0);
+
+// Returns a hash of the layout of T. If T has a RecordSchema, that's a hash of
+// its fields. Otherwise it's only as good as the type's name and size, which
+// is enough to catch restoring the wrong kind of snapshot.
+template <typename T>
+uint64_t schemaHash() {
+  if constexpr (HAS_SCHEMA<T>) {
+    return fieldsHash<T>();
+  }
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto mix = [&](uint64_t value) {
+    hash ^= value;
+    hash *= 0x100000001b3ull;
+  };
+  for (auto c = typeid(T).name(); *c != '\0'; c++) {
+    mix(static_cast<unsigned char>(*c));
+  }
+  mix(sizeof(T));
+  mix(alignof(T));
+  return hash;
+}
+
+// Writes a snapshot to a temporary file next to path, buffering the records so
+// they go out in large writes, and renames it over path once it is complete.
+// Throws a std::system_error if the file can't be written.
+class SnapshotWriter {
+ public:
+  SnapshotWriter(const std::string &path, uint32_t recordSize,
+                 uint64_t schemaHash);
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter &) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+  void write(const void *records, size_t count);
+  // Writes out the rest of the records and the header
+  void finish();
+
+ private:
+  std::string path_;
+  std::string tempPath_;
+  int fd_;
+  SnapshotHeader header_{};
+  std::vector<char> buffer_;
+  size_t buffered_ = 0;
+
+  void flush();
+};
+
+// Reads a snapshot, either mapping it or reading it into memory with large
+// reads, and checks its header and checksum. Throws a std::system_error if the
+// file can't be read, and a std::runtime_error if it isn't a valid snapshot of
+// the expected records.
+class SnapshotReader {
+ public:
+  SnapshotReader(const std::string &path, uint32_t recordSize,
+                 uint64_t schemaHash, bool map = true);
+  ~SnapshotReader();
+
+  SnapshotReader(const SnapshotReader &) = delete;
+  SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+  [[nodiscard]] const void *records() const {
+    return data_ + sizeof(SnapshotHeader);
+  }
+  [[nodiscard]] size_t count() const { return count_; }
+
+ private:
+  const char *data_ = nullptr;
+  size_t bytes_ = 0;
+  bool mapped_ = false;
+  std::vector<char> buffer_;
+  size_t count_ = 0;
+};
+
+#endif  // ASSIGNMENT_1_SNAPSHOTFORMAT_H
@@ -0,0 +1,138 @@
+#ifndef ASSIGNMENT_1_STRINGARENA_HPP
+#define ASSIGNMENT_1_STRINGARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+
+// A string kept in a StringArena. It holds an offset into the arena rather
+// than a pointer, so it can be stored in an entry and means the same thing in
+// every process, wherever they have the arena mapped. The empty string is
+// {0, 0}, so a zeroed entry holds empty strings. An offset means nothing in
+// another database's arena, so entries holding strings can't be dumped.
+struct StringRef {
+  uint32_t offset;
+  uint32_t length;
+};
+
+// Blocks come in power of two sizes from STRING_MIN_BLOCK up, one free list
+// per size
+constexpr static std::size_t STRING_MIN_BLOCK = 16;
+constexpr static int STRING_BLOCK_SIZES = 24;
+constexpr static std::size_t STRING_MAX_LENGTH = STRING_MIN_BLOCK
+                                                 << (STRING_BLOCK_SIZES - 1);
+// Offsets are 32 bits, so an arena can't grow past this
+constexpr static std::size_t STRING_ARENA_MAX_BYTES = 1ull << 32;
+
+// The part of a string arena that lives in the database metadata
+struct StringArenaState {
+  // bytes handed out from the start of the arena so far. The first block is
+  // never used, so offset 0 can mean "none"
+  uint64_t used;
+  // bytes in blocks that haven't been released
+  uint64_t live;
+  // offset of the first free block of each size, or 0. Free blocks are linked
+  // through their first bytes.
+  uint64_t freeBlocks[STRING_BLOCK_SIZES];
+};
+
+// A slab allocator for strings, operating on a byte array owned by someone
+// else, so it can live in shared memory. Released blocks go on a free list for
+// their size and are handed out again before any new space is used. The arena
+// never moves anything, so offsets stay valid, and the owner can grow it by
+// copying it into a bigger array when fits() says a string won't fit.
+class StringArena {
+ public:
+  StringArena(char *bytes, std::size_t size, StringArenaState *state)
+      : bytes_(bytes), size_(size), state_(state) {}
+
+  static void init(StringArenaState *state) {
+    state->used = STRING_MIN_BLOCK;
+    state->live = 0;
+    for (auto &head : state->freeBlocks) {
+      head = 0;
+    }
+  }
+
+  // Returns the size of the block a string of the given length is kept in
+  static std::size_t blockBytes(std::size_t length) {
+    std::size_t bytes = STRING_MIN_BLOCK;
+    while (bytes < length) {
+      bytes <<= 1;
+    }
+    return bytes;
+  }
+
+  // Returns true if a string of the given length can be stored without
+  // growing the arena. Strings longer than STRING_MAX_LENGTH never fit.
+  [[nodiscard]] bool fits(std::size_t length) const {
+    if (length > STRING_MAX_LENGTH) {
+      return false;
+    }
+    return length == 0 || state_->freeBlocks[sizeIndex(length)] != 0 ||
+           state_->used + blockBytes(length) <= size_;
+  }
+
+  // Copies text into the arena. fits(text.size()) must be true.
+  StringRef store(std::string_view text) {
+    if (text.size() > STRING_MAX_LENGTH) {
+      throw std::length_error("String is too long for the arena");
+    }
+    if (text.empty()) {
+      return {0, 0};
+    }
+    auto &head = state_->freeBlocks[sizeIndex(text.size())];
+    uint64_t offset = head;
+    if (offset != 0) {
+      std::memcpy(&head, bytes_ + offset, sizeof(uint64_t));
+    } else {
+      offset = state_->used;
+      state_->used += blockBytes(text.size());
+    }
+    state_->live += blockBytes(text.size());
+    std::memcpy(bytes_ + offset, text.data(), text.size());
+    return {static_cast<uint32_t>(offset),
+            static_cast<uint32_t>(text.size())};
+  }
+
+  // Puts the string's block back on its free list. The string must not be
+  // used after this. Throws if it isn't in the arena.
+  void release(StringRef string) {
+    if (view(string).empty()) {
+      return;
+    }
+    auto &head = state_->freeBlocks[sizeIndex(string.length)];
+    std::memcpy(bytes_ + string.offset, &head, sizeof(uint64_t));
+    head = string.offset;
+    state_->live -= blockBytes(string.length);
+  }
+
+  // The string's characters, which stay where they are until it's released
+  // or the arena is moved. Throws if it isn't in the arena.
+  [[nodiscard]] std::string_view view(StringRef string) const {
+    if (string.length == 0) {
+      return {};
+    }
+    if (uint64_t{string.offset} + string.length > state_->used) {
+      throw std::out_of_range("String isn't in the arena");
+    }
+    return {bytes_ + string.offset, string.length};
+  }
+
+ private:
+  char *bytes_;
+  std::size_t size_;
+  StringArenaState *state_;
+
+  static int sizeIndex(std::size_t length) {
+    int index = 0;
+    while ((STRING_MIN_BLOCK << index) < length) {
+      index++;
+    }
+    return index;
+  }
+};
+
+#endif  // ASSIGNMENT_1_STRINGARENA_HPP
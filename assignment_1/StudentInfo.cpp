@@ -0,0 +1,84 @@
+#include "StudentInfo.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+
+namespace {
+
+// Returns the next line of text, without its line ending, and advances text
+// past it
+std::string_view nextLine(std::string_view &text) {
+  auto end = text.find('\n');
+  auto line = text.substr(0, end);
+  text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+  return line;
+}
+
+}  // namespace
+
+std::vector<StudentInfo> loadStudents(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to open file: " + path);
+  }
+  struct stat fileStat {};
+  if (fstat(fd, &fileStat) == -1) {
+    close(fd);
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to stat file: " + path);
+  }
+  std::vector<StudentInfo> students;
+  if (fileStat.st_size == 0) {
+    close(fd);
+    return students;
+  }
+
+  // map the whole file and parse it in place, rather than copying every line
+  // into a string. The mapping stays valid after the file is closed
+  auto size = static_cast<size_t>(fileStat.st_size);
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to map file: " + path);
+  }
+  std::shared_ptr<void> mapping(data,
+                                [size](void *data) { munmap(data, size); });
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  std::string_view text(static_cast<const char *>(data), size);
+  // each student takes at least four line endings
+  students.reserve(std::count(text.begin(), text.end(), '\n') / 4 + 1);
+  while (!text.empty()) {
+    StudentInfo student{};
+    readRecord(student, [&] { return nextLine(text); });
+    students.push_back(student);
+  }
+  return students;
+}
+
+std::pair<StudentName::Key, StudentName::Key> StudentName::prefixRange(
+    const std::string &prefix) {
+  // the lowest name is the prefix itself, and the highest is the prefix
+  // followed by the highest possible characters
+  Key low{};
+  Key high{};
+  auto length = std::min(prefix.size(), sizeof(low.chars) - 1);
+  std::memcpy(low.chars, prefix.data(), length);
+  std::memcpy(high.chars, prefix.data(), length);
+  std::memset(high.chars + length, 0xff, sizeof(high.chars) - 1 - length);
+  return {low, high};
+}
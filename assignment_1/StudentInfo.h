@@ -1,6 +1,13 @@
 #ifndef ASSIGNMENT_1_STUDENTINFO_H
 #define ASSIGNMENT_1_STUDENTINFO_H
 
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "Schema.hpp"
+
 // must avoid using pointers in the struct
 struct StudentInfo {
   char name[51];
@@ -9,4 +16,28 @@ struct StudentInfo {
   char phone[11];
 };
 
+template <>
+struct RecordSchema<StudentInfo> {
+  constexpr static auto fields = std::make_tuple(
+      field("name", &StudentInfo::name), field("id", &StudentInfo::id),
+      field("address", &StudentInfo::address),
+      field("phone", &StudentInfo::phone));
+};
+
+// Key extractor for indexing a SharedDatabase of students by id
+using StudentId = FieldKey<&StudentInfo::id>;
+
+// Key extractor for ordering a SharedDatabase of students by name
+struct StudentName : FieldKey<&StudentInfo::name> {
+  // Returns the lowest and highest keys of names starting with prefix, to
+  // pass to SharedDatabase::range()
+  static std::pair<Key, Key> prefixRange(const std::string &prefix);
+};
+
+// Parses the students in the given file, which holds four lines per student:
+// name, id, address and phone. Fields that are too long are truncated. Throws
+// a std::system_error if the file can't be read, and a std::invalid_argument
+// if it is malformed.
+std::vector<StudentInfo> loadStudents(const std::string &path);
+
 #endif  // ASSIGNMENT_1_STUDENTINFO_H
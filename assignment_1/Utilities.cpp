@@ -4,31 +4,360 @@
 
 #include "Utilities.h"
 
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <string>
+#include <system_error>
+#include <thread>
+
+namespace {
+
+// Layout of SharedRWLock::state
+constexpr uint32_t READERS_MASK = 0x0000FFFF;
+constexpr uint32_t WRITER_WAITING = 1u << 16;
+constexpr uint32_t WRITERS_WAITING_MASK = 0x3FFF0000;
+constexpr uint32_t HAS_SLEEPERS = 1u << 30;
+constexpr uint32_t WRITE_LOCKED = 1u << 31;
+
+// Kinds of SharedRWLock::owners entries. A pending owner is part way through
+// changing the state, so the state can't be checked against the owners until
+// it's done. An idle one is waiting to read, and hasn't changed the state.
+constexpr uint64_t OWNER_READ = 1;
+constexpr uint64_t OWNER_WRITE = 2;
+constexpr uint64_t OWNER_WAITING = 3;
+constexpr uint64_t OWNER_PENDING = 4;
+constexpr uint64_t OWNER_IDLE = 5;
+constexpr uint64_t OWNER_KIND_MASK = 7;
+constexpr int OWNER_PID_SHIFT = 3;
+// How long a waiter sleeps before checking whether the holders are alive
+constexpr auto OWNER_CHECK_INTERVAL = 10ms;
+
+// getpid() is a syscall, so cache it, forgetting it in forked children
+std::atomic<pid_t> cachedPid{0};
+
+uint64_t ownerTag(uint64_t kind) {
+  static bool registered = [] {
+    return pthread_atfork(nullptr, nullptr, [] { cachedPid.store(0); }) == 0;
+  }();
+  (void)registered;
+  auto pid = cachedPid.load(std::memory_order_relaxed);
+  if (pid == 0) {
+    pid = getpid();
+    cachedPid.store(pid, std::memory_order_relaxed);
+  }
+  return static_cast<uint64_t>(pid) << OWNER_PID_SHIFT | kind;
+}
+
+void reachStep(LockStep step) {
+  if (lockStepHook != nullptr) {
+    lockStepHook(step);
+  }
+}
+
+// Wakes everyone sleeping on the lock if previousState says there are any
+void wakeSleepers(SharedRWLock *lock, uint32_t previousState) {
+  if (previousState & HAS_SLEEPERS) {
+    lock->state.fetch_and(~HAS_SLEEPERS);
+    futexWake(&lock->state);
+  }
+}
+
+// Forgets holders of the lock that have died, rebuilding the state from the
+// owners that are left. A dead owner may have died anywhere between claiming
+// its slot and changing the state, so what it did can't be undone by itself,
+// but every holder has a slot, so the state is just what the live ones add
+// up to. Gives up until next time if a live owner is in the middle of a
+// change, or anything changes while it looks.
+void reclaimDeadOwners(SharedRWLock *lock) {
+  uint64_t tags[LOCK_OWNER_SLOTS];
+  bool dead[LOCK_OWNER_SLOTS] = {};
+  bool anyDead = false;
+  for (int i = 0; i < LOCK_OWNER_SLOTS; i++) {
+    tags[i] = lock->owners[i].load();
+    if (tags[i] == 0) {
+      continue;
+    }
+    if (!processAlive(static_cast<pid_t>(tags[i] >> OWNER_PID_SHIFT))) {
+      dead[i] = anyDead = true;
+    } else if ((tags[i] & OWNER_KIND_MASK) == OWNER_PENDING) {
+      return;
+    }
+  }
+  if (!anyDead) {
+    return;
+  }
+
+  // anyone who changed the state before it's read here either shows up in
+  // the second look at the owners, or changed their slot since the first
+  auto state = lock->state.load();
+  auto rebuilt = state & HAS_SLEEPERS;
+  for (int i = 0; i < LOCK_OWNER_SLOTS; i++) {
+    if (lock->owners[i].load() != tags[i]) {
+      return;
+    }
+    if (dead[i] || tags[i] == 0) {
+      continue;
+    }
+    switch (tags[i] & OWNER_KIND_MASK) {
+      case OWNER_READ:
+        rebuilt += 1;
+        break;
+      case OWNER_WRITE:
+        rebuilt |= WRITE_LOCKED;
+        break;
+      case OWNER_WAITING:
+        rebuilt += WRITER_WAITING;
+        break;
+    }
+  }
+  // and anyone changing it after fails this
+  if (!lock->state.compare_exchange_strong(state, rebuilt)) {
+    return;
+  }
+  for (int i = 0; i < LOCK_OWNER_SLOTS; i++) {
+    if (dead[i]) {
+      lock->owners[i].compare_exchange_strong(tags[i], 0);
+    }
+  }
+  wakeSleepers(lock, rebuilt);
+}
+
+// Records this process in a free owner slot of the lock, as pending, and
+// returns it. A holder without a slot couldn't be cleaned up after, so if
+// they're all taken this waits for one, and throws if none comes free before
+// the deadline.
+std::atomic<uint64_t> &claimOwner(
+    SharedRWLock *lock, std::chrono::steady_clock::time_point deadline,
+    const char *error) {
+  // threads start looking in different places, so they don't all fight over
+  // the first slot
+  static thread_local auto start =
+      std::hash<std::thread::id>{}(std::this_thread::get_id());
+  auto tag = ownerTag(OWNER_PENDING);
+  while (true) {
+    for (int i = 0; i < LOCK_OWNER_SLOTS; i++) {
+      auto &owner = lock->owners[(start + i) % LOCK_OWNER_SLOTS];
+      uint64_t expected = 0;
+      if (owner.load(std::memory_order_relaxed) == 0 &&
+          owner.compare_exchange_strong(expected, tag)) {
+        return owner;
+      }
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      throw std::system_error(ETIMEDOUT, std::generic_category(), error);
+    }
+    // some of them may belong to the dead
+    reclaimDeadOwners(lock);
+    std::this_thread::sleep_for(1ms);
+  }
+}
+
+// Finds an owner slot holding the given tag and marks it pending, returning
+// it, or nullptr if there isn't one. Any slot will do, since they're all this
+// process's.
+std::atomic<uint64_t> *takeOwner(SharedRWLock *lock, uint64_t tag) {
+  for (auto &owner : lock->owners) {
+    auto expected = tag;
+    if (owner.load(std::memory_order_relaxed) == tag &&
+        owner.compare_exchange_strong(expected, ownerTag(OWNER_PENDING))) {
+      return &owner;
+    }
+  }
+  return nullptr;
+}
+
+// Sleeps until the lock state changes from the given value, or the deadline
+// passes. Returns false if the deadline had already passed. Holders that have
+// died are cleaned up after every OWNER_CHECK_INTERVAL, so the caller should
+// check the state again even if it looks like nothing happened.
+bool sleepOn(SharedRWLock *lock, uint32_t state,
+             std::chrono::steady_clock::time_point deadline) {
+  auto now = std::chrono::steady_clock::now();
+  if (now >= deadline) {
+    return false;
+  }
+  // let the releasing thread know it has to wake us up
+  if (!(state & HAS_SLEEPERS)) {
+    if (!lock->state.compare_exchange_strong(state, state | HAS_SLEEPERS)) {
+      return true;  // the state changed under us, so check it again
+    }
+    state |= HAS_SLEEPERS;
+  }
+  futexWait(&lock->state, state,
+            std::min(deadline, now + OWNER_CHECK_INTERVAL));
+  if (lock->state.load() == state) {
+    // nobody has let go in a while, so make sure they're still around
+    reclaimDeadOwners(lock);
+  }
+  return true;
+}
+
+}  // namespace
 
-[[nodiscard]] std::shared_ptr<sem_t> acquireSem(
-    sem_t *semaphore, std::chrono::milliseconds semTimeout) {
-  auto timeout_time = std::chrono::system_clock::now() + semTimeout;
+void (*lockStepHook)(LockStep step) = nullptr;
+
+bool futexWait(std::atomic<uint32_t> *word, uint32_t value,
+               std::chrono::steady_clock::time_point deadline) {
+  auto remaining = deadline - std::chrono::steady_clock::now();
+  if (remaining <= 0s) {
+    return false;
+  }
+  auto seconds = std::chrono::duration_cast<std::chrono::seconds>(remaining);
   timespec timeout{};
-  timeout.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(
-                       timeout_time.time_since_epoch())
-                       .count();
-  if (sem_timedwait(semaphore, &timeout) == -1) {
-    throw std::system_error(errno, std::generic_category(),
-                            "Failed to acquire exclusive lock");
-  }
-
-  // Return a shared pointer to the semaphore, with a custom deleter that
-  // unlocks the semaphore
-  return {semaphore, [](sem_t *sem) {
-            // check if semaphore is locked (user could have unlocked it
-            // manually)
-            if (sem_trywait(sem) == -1) {
-              // if it is, unlock it
-              if (sem_post(sem) == -1) {
-                throw std::system_error(errno, std::generic_category(),
-                                        "Failed to release exclusive lock");
-              }
-            }
-          }};
-}
\ No newline at end of file
+  timeout.tv_sec = seconds.count();
+  timeout.tv_nsec =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(remaining - seconds)
+          .count();
+  // not FUTEX_PRIVATE_FLAG, since the word is shared between processes.
+  // EAGAIN, EINTR and ETIMEDOUT all just mean the caller should check again
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, value,
+          &timeout, nullptr, 0);
+  return true;
+}
+
+void futexWake(std::atomic<uint32_t> *word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+bool processAlive(pid_t pid) {
+  if (kill(pid, 0) == -1 && errno == ESRCH) {
+    return false;
+  }
+  // zombies still answer kill(), so look at their state
+  auto path = "/proc/" + std::to_string(pid) + "/stat";
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return errno != ENOENT;
+  }
+  char stat[512];
+  auto bytes = read(fd, stat, sizeof(stat) - 1);
+  close(fd);
+  if (bytes <= 0) {
+    return true;
+  }
+  stat[bytes] = '\0';
+  // the state comes after the command name, which may have ) in it
+  auto end = std::strrchr(stat, ')');
+  return end == nullptr || end[1] == '\0' || (end[2] != 'Z' && end[2] != 'X');
+}
+
+void initRWLock(SharedRWLock *lock) {
+  lock->state.store(0);
+  for (auto &owner : lock->owners) {
+    owner.store(0);
+  }
+}
+
+void lockRead(SharedRWLock *lock, std::chrono::milliseconds timeout) {
+  constexpr auto error = "Failed to acquire shared lock";
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  auto &owner = claimOwner(lock, deadline, error);
+  reachStep(LockStep::READ_CLAIMED);
+  auto state = lock->state.load(std::memory_order_relaxed);
+  while (true) {
+    if (!(state & (WRITE_LOCKED | WRITERS_WAITING_MASK)) &&
+        (state & READERS_MASK) != READERS_MASK) {
+      if (lock->state.compare_exchange_weak(state, state + 1)) {
+        reachStep(LockStep::READ_COUNTED);
+        owner.store(ownerTag(OWNER_READ));
+        return;
+      }
+      continue;
+    }
+    // a pending owner holds up reclaiming, which might be what we're
+    // waiting for
+    owner.store(ownerTag(OWNER_IDLE));
+    if (!sleepOn(lock, state, deadline)) {
+      owner.store(0);
+      throw std::system_error(ETIMEDOUT, std::generic_category(), error);
+    }
+    owner.store(ownerTag(OWNER_PENDING));
+    state = lock->state.load(std::memory_order_relaxed);
+  }
+}
+
+void unlockRead(SharedRWLock *lock) {
+  auto owner = takeOwner(lock, ownerTag(OWNER_READ));
+  reachStep(LockStep::READ_UNLOCKING);
+  auto previousState = lock->state.fetch_sub(1);
+  reachStep(LockStep::READ_UNCOUNTED);
+  if (owner != nullptr) {
+    owner->store(0);
+  }
+  // only a writer can be waiting on readers
+  if ((previousState & READERS_MASK) == 1) {
+    wakeSleepers(lock, previousState);
+  }
+}
+
+void lockWrite(SharedRWLock *lock, std::chrono::milliseconds timeout) {
+  constexpr auto error = "Failed to acquire exclusive lock";
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  auto &owner = claimOwner(lock, deadline, error);
+  reachStep(LockStep::WRITE_CLAIMED);
+  // announce ourselves so that new readers hold off
+  auto state = lock->state.fetch_add(WRITER_WAITING) + WRITER_WAITING;
+  reachStep(LockStep::WRITE_ANNOUNCED);
+  owner.store(ownerTag(OWNER_WAITING));
+  while (true) {
+    if (!(state & (WRITE_LOCKED | READERS_MASK))) {
+      owner.store(ownerTag(OWNER_PENDING));
+      if (lock->state.compare_exchange_weak(
+              state, (state - WRITER_WAITING) | WRITE_LOCKED)) {
+        reachStep(LockStep::WRITE_LOCKED);
+        owner.store(ownerTag(OWNER_WRITE));
+        return;
+      }
+      owner.store(ownerTag(OWNER_WAITING));
+      continue;
+    }
+    if (!sleepOn(lock, state, deadline)) {
+      owner.store(ownerTag(OWNER_PENDING));
+      // readers we were holding off may be able to go now
+      auto previousState = lock->state.fetch_sub(WRITER_WAITING);
+      owner.store(0);
+      wakeSleepers(lock, previousState);
+      throw std::system_error(ETIMEDOUT, std::generic_category(), error);
+    }
+    state = lock->state.load(std::memory_order_relaxed);
+  }
+}
+
+void unlockWrite(SharedRWLock *lock) {
+  auto owner = takeOwner(lock, ownerTag(OWNER_WRITE));
+  reachStep(LockStep::WRITE_UNLOCKING);
+  auto previousState = lock->state.fetch_and(~WRITE_LOCKED);
+  reachStep(LockStep::WRITE_UNLOCKED);
+  if (owner != nullptr) {
+    owner->store(0);
+  }
+  wakeSleepers(lock, previousState);
+}
+
+uint32_t lockReaders(const SharedRWLock *lock) {
+  return lock->state.load(std::memory_order_relaxed) & READERS_MASK;
+}
+
+[[nodiscard]] std::shared_ptr<SharedRWLock> acquireReadLock(
+    SharedRWLock *lock, std::chrono::milliseconds timeout) {
+  lockRead(lock, timeout);
+  return {lock, [](SharedRWLock *lock) { unlockRead(lock); }};
+}
+
+[[nodiscard]] std::shared_ptr<SharedRWLock> acquireWriteLock(
+    SharedRWLock *lock, std::chrono::milliseconds timeout) {
+  lockWrite(lock, timeout);
+  return {lock, [](SharedRWLock *lock) { unlockWrite(lock); }};
+}
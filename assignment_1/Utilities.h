@@ -5,30 +5,83 @@
 #ifndef ASSIGNMENT_1_UTILITIES_H
 #define ASSIGNMENT_1_UTILITIES_H
 
-// Locks a semaphore, returning a handle that automatically unlocks it when
-// destroyed.
-#include <semaphore.h>
+// Process-shared locking: futex waits, and the SharedRWLock the databases and
+// catalog are locked with.
+#include <sys/types.h>
 
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <memory>
 
 using namespace std::chrono_literals;
 
-// Get a lock on the database entry. Da a sem_timedwait() on it and
-// throw an exception if it times out.
-[[nodiscard]] std::shared_ptr<sem_t> acquireSem(
-    sem_t *semaphore, std::chrono::milliseconds semTimeout = 1000ms);
-
-template <typename F>
-void runWithLock(sem_t *semaphore, F &&lambda,
-                 std::chrono::milliseconds semTimeout = 1000ms) {
-  auto lock = acquireSem(semaphore, semTimeout);
-  try {
-    lambda();
-  } catch (...) {
-    lock.reset();
-    throw;
-  }
-}
+// Sleeps until *word no longer holds value, someone calls futexWake() on it,
+// or the deadline passes, whichever comes first. Works across processes if
+// word is in shared memory. May also return early for no reason, so check
+// again after. Returns false without sleeping if the deadline has passed.
+bool futexWait(std::atomic<uint32_t> *word, uint32_t value,
+               std::chrono::steady_clock::time_point deadline);
+// Wakes everyone sleeping on word in futexWait()
+void futexWake(std::atomic<uint32_t> *word);
+
+// Returns false if the process has exited, even if it hasn't been reaped yet
+bool processAlive(pid_t pid);
+
+// Most holders (and waiting writers) a SharedRWLock can have at once. Each
+// one's process is recorded, so it can be cleaned up after, and any more wait
+// for one of them to let go.
+constexpr static int LOCK_OWNER_SLOTS = 16;
+
+// A reader/writer lock that can be placed in shared memory and used by
+// multiple processes. The lock itself is a single futex word, so waiters sleep
+// in the kernel and are woken as soon as the lock is released. A waiting
+// writer blocks new readers, so writers can't be starved by a stream of reads.
+//
+// The pids of the processes holding it are kept alongside, and waiters
+// periodically check that they are still alive, so a process that dies while
+// holding the lock (or waiting to write) only holds everyone else up for a few
+// milliseconds rather than until they time out. Whatever the dead process was
+// in the middle of changing is left as it was.
+struct SharedRWLock {
+  std::atomic<uint32_t> state;
+  // pid << 3 | kind of each holder, or 0 if the slot is free
+  std::atomic<uint64_t> owners[LOCK_OWNER_SLOTS];
+};
+
+void initRWLock(SharedRWLock *lock);
+
+// Take or release the lock directly. The lock functions throw a
+// std::system_error if the lock can't be acquired within the timeout.
+void lockRead(SharedRWLock *lock, std::chrono::milliseconds timeout = 1000ms);
+void unlockRead(SharedRWLock *lock);
+void lockWrite(SharedRWLock *lock, std::chrono::milliseconds timeout = 1000ms);
+void unlockWrite(SharedRWLock *lock);
+// Returns the number of readers holding the lock right now
+uint32_t lockReaders(const SharedRWLock *lock);
+
+// The points in the lock functions between one change to a SharedRWLock and
+// the next, where a process that died would leave it part way through
+enum class LockStep {
+  READ_CLAIMED,
+  READ_COUNTED,
+  READ_UNLOCKING,
+  READ_UNCOUNTED,
+  WRITE_CLAIMED,
+  WRITE_ANNOUNCED,
+  WRITE_LOCKED,
+  WRITE_UNLOCKING,
+  WRITE_UNLOCKED,
+  COUNT,
+};
+// Called at each LockStep if set, so tests can kill a process there
+extern void (*lockStepHook)(LockStep step);
+
+// Get a shared/exclusive lock, returning a handle that releases it when
+// destroyed.
+[[nodiscard]] std::shared_ptr<SharedRWLock> acquireReadLock(
+    SharedRWLock *lock, std::chrono::milliseconds timeout = 1000ms);
+[[nodiscard]] std::shared_ptr<SharedRWLock> acquireWriteLock(
+    SharedRWLock *lock, std::chrono::milliseconds timeout = 1000ms);
 
 #endif  // ASSIGNMENT_1_UTILITIES_H
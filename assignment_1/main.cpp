@@ -1,10 +1,171 @@
 #include <argparse/argparse.hpp>
-#include <cstring>
 #include <fstream>
+#include <optional>
+#include <sstream>
 
 #include "SharedDatabase.hpp"
 #include "StudentInfo.h"
 
+using StudentDatabase = SharedDatabase<StudentInfo, StudentId, StudentName>;
+
+namespace {
+
+// Most changes --batch makes under one lock, so a long import doesn't keep
+// readers out the whole time
+constexpr size_t BATCH_CHANGES = 4096;
+
+struct BatchCommand {
+  enum class Kind { ADD, DELETE, UPDATE, QUERY };
+  Kind kind;
+  // just the id for DELETE and QUERY
+  StudentInfo student;
+};
+
+// Parses a line of --batch input, which is a command and its arguments
+// separated by whitespace:
+//   add NAME ID ADDRESS PHONE
+//   update ID NAME ADDRESS PHONE
+//   delete ID
+//   query ID
+// Blank lines and lines starting with # are skipped. Returns nothing if the
+// line is skipped or malformed.
+std::optional<BatchCommand> parseCommand(const std::string &line,
+                                         size_t number) {
+  std::istringstream in(line);
+  std::vector<std::string> words;
+  for (std::string word; in >> word;) {
+    words.push_back(word);
+  }
+  if (words.empty() || words[0][0] == '#') {
+    return std::nullopt;
+  }
+  const auto &kind = words[0];
+  BatchCommand command{};
+  size_t arguments = FIELD_COUNT<StudentInfo>;
+  if (kind == "add") {
+    command.kind = BatchCommand::Kind::ADD;
+  } else if (kind == "update") {
+    command.kind = BatchCommand::Kind::UPDATE;
+    // the id comes first, but the name comes first in a student
+    if (words.size() > 2) {
+      std::swap(words[1], words[2]);
+    }
+  } else if (kind == "delete" || kind == "query") {
+    command.kind = kind == "delete" ? BatchCommand::Kind::DELETE
+                                    : BatchCommand::Kind::QUERY;
+    arguments = 1;
+  } else {
+    std::cerr << "Line " << number << ": unknown command " << kind
+              << std::endl;
+    return std::nullopt;
+  }
+  if (words.size() < arguments + 1) {
+    std::cerr << "Line " << number << ": bad arguments to " << kind
+              << std::endl;
+    return std::nullopt;
+  }
+  if (arguments == 1) {
+    if (!parseField(command.student.id, words[1])) {
+      std::cerr << "Line " << number << ": invalid id " << words[1]
+                << std::endl;
+      return std::nullopt;
+    }
+    return command;
+  }
+  try {
+    size_t next = 1;
+    readRecord(command.student,
+               [&]() -> std::string_view { return words[next++]; });
+  } catch (const std::invalid_argument &err) {
+    std::cerr << "Line " << number << ": bad arguments to " << kind << ": "
+              << err.what() << std::endl;
+    return std::nullopt;
+  }
+  return command;
+}
+
+// Parses a --numa policy, which is interleave or bind, optionally followed by
+// a colon and a comma separated list of nodes. Returns false if it's invalid.
+bool parseNumaPolicy(const std::string &text, SharedDatabaseOptions &options) {
+  auto colon = text.find(':');
+  auto policy = text.substr(0, colon);
+  if (policy == "interleave") {
+    options.numaPolicy = NumaPolicy::INTERLEAVE;
+  } else if (policy == "bind") {
+    options.numaPolicy = NumaPolicy::BIND;
+  } else {
+    return false;
+  }
+  options.numaNodes = 0;
+  if (colon == std::string::npos) {
+    return true;
+  }
+  std::istringstream nodes(text.substr(colon + 1));
+  for (std::string node; std::getline(nodes, node, ',');) {
+    int number;
+    if (!parseField(number, node) || number < 0 || number >= 64) {
+      return false;
+    }
+    options.numaNodes |= 1ull << number;
+  }
+  return options.numaNodes != 0;
+}
+
+// Runs the commands in a --batch stream. Runs of changes are made together
+// under one write lock, up to BATCH_CHANGES at a time, and a query makes the
+// changes before it first.
+void runBatch(StudentDatabase &db, std::istream &in, std::ostream &out) {
+  std::vector<BatchCommand> changes;
+  auto applyChanges = [&] {
+    if (changes.empty()) {
+      return;
+    }
+    db.batch([&](StudentDatabase::Batch &batch) {
+      for (const auto &change : changes) {
+        if (change.kind == BatchCommand::Kind::ADD) {
+          batch.push_back(change.student);
+          continue;
+        }
+        auto index = batch.find(change.student.id);
+        if (!index) {
+          out << "Student not found: " << change.student.id << '\n';
+        } else if (change.kind == BatchCommand::Kind::DELETE) {
+          batch.erase(*index);
+        } else {
+          batch.set(*index, change.student);
+        }
+      }
+    });
+    changes.clear();
+  };
+
+  std::string line;
+  for (size_t number = 1; std::getline(in, line); number++) {
+    auto command = parseCommand(line, number);
+    if (!command) {
+      continue;
+    }
+    if (command->kind != BatchCommand::Kind::QUERY) {
+      changes.push_back(*command);
+      if (changes.size() == BATCH_CHANGES) {
+        applyChanges();
+      }
+      continue;
+    }
+    applyChanges();
+    auto index = db.find(command->student.id);
+    if (index) {
+      writeRecord(out, db.get(*index));
+    } else {
+      out << "Student not found: " << command->student.id << '\n';
+    }
+  }
+  applyChanges();
+  out.flush();
+}
+
+}  // namespace
+
 int main(int argc, char **argv) {
   argparse::ArgumentParser program("assignment_1");
   program.add_argument("-p", "--password")
@@ -12,6 +173,15 @@ int main(int argc, char **argv) {
           "password for the database, enables write-mode when matching "
           "existing")
       .default_value("1234");
+  program.add_argument("-t", "--table")
+      .help(
+          "name of the table in the shared memory catalog to open, or create "
+          "if it doesn't exist")
+      .default_value(std::string("students"));
+  program.add_argument("--drop")
+      .help("delete the table and exit")
+      .default_value(false)
+      .implicit_value(true);
   program.add_argument("-c", "--clean")
       .help("cleanup shared memory on exit")
       .default_value(false)
@@ -23,12 +193,81 @@ int main(int argc, char **argv) {
   program.add_argument("-q", "--query")
       .help("query the database for the specified student ID")
       .scan<'i', int>();
+  program.add_argument("--prefix")
+      .help("print the students whose names start with the specified prefix");
+  program.add_argument("--ids")
+      .help(
+          "print the students with ids from LOW to HIGH, given as LOW:HIGH, "
+          "that also match --prefix if it is given");
   program.add_argument("-s", "--sleep")
       .help(
           "sleep for the specified number of seconds after requesting a "
           "semaphore")
       .default_value(0)
       .scan<'i', int>();
+  program.add_argument("--format")
+      .help(
+          "format of the --load and --output files: text (four lines per "
+          "student) or binary (a checksummed snapshot)")
+      .default_value(std::string("text"));
+  program.add_argument("--stripes")
+      .help(
+          "number of lock stripes to create the database with, so updates to "
+          "different students don't wait for each other")
+      .default_value(0)
+      .scan<'i', int>();
+  program.add_argument("--versioned")
+      .help(
+          "create the database with multi-version snapshots, so printing and "
+          "saving don't hold up updates")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--huge-pages")
+      .help(
+          "create the database with huge pages where there are any free, to "
+          "cut TLB misses on large tables")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--numa")
+      .help(
+          "create the database with a NUMA policy: interleave or bind, "
+          "optionally followed by :NODES, e.g. interleave:0,1");
+  program.add_argument("-j", "--journal")
+      .help(
+          "create the database with a write-ahead journal at the specified "
+          "path, and rebuild it from the journal if it exists");
+  program.add_argument("-f", "--file")
+      .help(
+          "store the database in files at the specified path instead of "
+          "shared memory, so it persists across restarts");
+  program.add_argument("--feed")
+      .help(
+          "create the database with a change feed of at least the specified "
+          "number of changes, for --watch")
+      .default_value(0)
+      .scan<'i', int>();
+  program.add_argument("--watch")
+      .help("print changes to the database as other processes make them")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--stats")
+      .help("print the database's lock and operation counters on exit")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--reset-stats")
+      .help("zero the database's lock and operation counters at startup")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("-b", "--batch")
+      .help(
+          "run the add, update, delete and query commands in the specified "
+          "file, or - for stdin, instead of the prompt");
+  program.add_argument("--checkpoint")
+      .help(
+          "flush a file backed database to disk and shrink the journal "
+          "before the prompt and on exit")
+      .default_value(false)
+      .implicit_value(true);
 
   try {
     program.parse_args(argc, argv);
@@ -41,33 +280,78 @@ int main(int argc, char **argv) {
   auto password = program.get<std::string>("--password");
   auto clean = program.get<bool>("--clean");
   auto sleep = program.get<int>("--sleep");
+  auto checkpoint = program.get<bool>("--checkpoint");
 
   auto load = program.present("--load");
   auto output = program.present("--output");
+  auto format = program.get<std::string>("--format");
+  if (format != "text" && format != "binary") {
+    std::cerr << "Unknown format: " << format << std::endl;
+    exit(1);
+  }
 
-  auto db = SharedDatabase<StudentInfo>(password, 0, std::chrono::seconds(300),
-                                        std::chrono::seconds(sleep), clean);
+  SharedDatabaseOptions options;
+  options.semTimeout = std::chrono::seconds(300);
+  options.semSleep = std::chrono::seconds(sleep);
+  options.clean = clean;
+  options.lockStripes = program.get<int>("--stripes");
+  options.multiVersion = program.get<bool>("--versioned");
+  options.changeFeed = program.get<int>("--feed");
+  options.hugePages = program.get<bool>("--huge-pages");
+  if (auto numa = program.present("--numa")) {
+    if (!parseNumaPolicy(numa.value(), options)) {
+      std::cerr << "Invalid NUMA policy: " << numa.value() << std::endl;
+      exit(1);
+    }
+  }
+  if (auto journal = program.present("--journal")) {
+    options.journalPath = journal.value();
+  }
+  if (auto file = program.present("--file")) {
+    options.path = file.value();
+  }
+  auto table = program.get<std::string>("--table");
+  std::optional<Catalog> catalog;
+  auto db = [&]() -> StudentDatabase {
+    try {
+      // a file backed database is named by its path instead
+      if (!options.path.empty()) {
+        return StudentDatabase(password, 0, options);
+      }
+      catalog.emplace(DEFAULT_CATALOG, options.semTimeout);
+      return StudentDatabase(password, *catalog, table, options);
+    } catch (const std::exception &err) {
+      std::cerr << err.what() << std::endl;
+      exit(1);
+    }
+  }();
+  if (program.get<bool>("--drop")) {
+    try {
+      db.drop();
+    } catch (const std::exception &err) {
+      std::cerr << err.what() << std::endl;
+      exit(1);
+    }
+    return 0;
+  }
+  if (program.get<bool>("--reset-stats")) {
+    db.resetStats();
+  }
 
   if (load) {
     if (load.has_value()) {
-      auto load_file = load.value();
-      std::ifstream file(load_file);
-      if (!file.is_open()) {
-        std::cerr << "Failed to open file: " << load_file << std::endl;
-        exit(1);
-      }
-
-      std::string line;
-      while (std::getline(file, line)) {
-        StudentInfo student{};
-        std::strncpy(student.name, line.c_str(), 51);
-        std::getline(file, line);
-        student.id = std::stoi(line);
-        std::getline(file, line);
-        std::strncpy(student.address, line.c_str(), 251);
-        std::getline(file, line);
-        std::strncpy(student.phone, line.c_str(), 11);
-        db.push_back(student);
+      try {
+        if (format == "binary") {
+          db.restore(load.value());
+        } else {
+          // parse everything first so the write lock is only taken once
+          db.push_back_bulk(loadStudents(load.value()));
+        }
+      } catch (const std::exception &err) {
+        // a bad line is an invalid_argument, a bad file a runtime_error
+        std::cerr << err.what() << std::endl;
+        // returning, unlike exit(), still runs db's destructor for --clean
+        return 1;
       }
     }
   }
@@ -76,42 +360,119 @@ int main(int argc, char **argv) {
     auto query_id = program.get<int>("--query");
     // request user to input student id, then search for it in the database
     StudentInfo queryStudent{};
-    for (int i = 0; i < db.size(); i++) {
-      auto student = db.get(i);
-      if (student.id == query_id) {
-        queryStudent = student;
-        break;
-      }
+    if (auto index = db.find(query_id)) {
+      queryStudent = db.get(*index);
     }
     if (queryStudent.id == 0) {
       std::cout << "Student not found" << std::endl;
     } else {
-      std::cout << queryStudent.name << std::endl;
-      std::cout << queryStudent.id << std::endl;
-      std::cout << queryStudent.address << std::endl;
-      std::cout << queryStudent.phone << std::endl;
+      writeRecord(std::cout, queryStudent);
+    }
+  }
+
+  auto prefix = program.present("--prefix");
+  if (auto ids = program.present("--ids")) {
+    int low, high;
+    char colon;
+    std::istringstream in(ids.value());
+    if (!(in >> low >> colon >> high) || colon != ':') {
+      std::cerr << "Invalid id range: " << ids.value() << std::endl;
+      exit(1);
+    }
+    // one pass over the students, under one lock
+    auto inRange = where(&StudentInfo::id, between(low, high));
+    auto students =
+        prefix ? db.selectEntries(
+                     inRange && startsWith(&StudentInfo::name, prefix.value()))
+               : db.selectEntries(inRange);
+    for (const auto &student : students) {
+      writeRecord(std::cout, student);
+    }
+  } else if (prefix) {
+    // in name order, straight from the ordered index
+    auto [low, high] = StudentName::prefixRange(prefix.value());
+    for (const auto &student : db.range(low, high)) {
+      writeRecord(std::cout, student);
     }
   }
 
   if (output) {
-    if (output.value() != "console") {
+    if (format == "binary") {
+      try {
+        db.dump(output.value());
+      } catch (const std::system_error &err) {
+        std::cerr << err.what() << std::endl;
+        exit(1);
+      }
+    } else if (output.value() != "console") {
       std::ofstream file(output.value());
       if (!file.is_open()) {
         std::cerr << "Failed to open file: " << output.value() << std::endl;
         exit(1);
       }
-      for (int i = 0; i < db.size(); i++) {
-        auto student = db.get(i);
-        file << student.name << std::endl;
-        file << student.id << std::endl;
-        file << student.address << std::endl;
-        file << student.phone << std::endl;
-      }
+      db.scan([&](const StudentInfo &student) { writeRecord(file, student); });
       file.close();
     }
   }
 
-  bool shouldExit = false;
+  if (checkpoint) {
+    db.checkpoint();
+  }
+
+  if (program.get<bool>("--watch")) {
+    uint64_t cursor;
+    try {
+      cursor = db.changeCursor();
+    } catch (const std::runtime_error &err) {
+      std::cerr << err.what() << std::endl;
+      exit(1);
+    }
+    // runs until interrupted
+    while (true) {
+      for (const auto &change : db.subscribe(cursor, 1min)) {
+        switch (change.op) {
+          case ChangeOp::ADDED:
+            std::cout << "Added student " << change.key << std::endl;
+            break;
+          case ChangeOp::CHANGED:
+            std::cout << "Updated student " << change.key << std::endl;
+            break;
+          case ChangeOp::ERASED:
+            std::cout << "Deleted student " << change.key << std::endl;
+            break;
+          case ChangeOp::CLEARED:
+            std::cout << "Deleted all students" << std::endl;
+            break;
+          case ChangeOp::COMPACTED:
+            break;
+          case ChangeOp::OVERRUN:
+            std::cout << "Missed some changes" << std::endl;
+            break;
+        }
+      }
+    }
+  }
+
+  auto batch = program.present("--batch");
+  if (batch) {
+    try {
+      if (batch.value() == "-") {
+        runBatch(db, std::cin, std::cout);
+      } else {
+        std::ifstream file(batch.value());
+        if (!file.is_open()) {
+          std::cerr << "Failed to open file: " << batch.value() << std::endl;
+          exit(1);
+        }
+        runBatch(db, file, std::cout);
+      }
+    } catch (const std::runtime_error &err) {
+      std::cerr << err.what() << std::endl;
+      exit(1);
+    }
+  }
+
+  bool shouldExit = batch.has_value();
   while (!shouldExit) {
     std::cout << "1. Add new student" << std::endl;
     std::cout << "2. Delete student" << std::endl;
@@ -136,10 +497,10 @@ int main(int argc, char **argv) {
         std::string phone;
         std::cin >> phone;
         StudentInfo student{};
-        std::strncpy(student.name, name.c_str(), 51);
+        setString(student.name, name);
         student.id = id;
-        std::strncpy(student.address, address.c_str(), 251);
-        std::strncpy(student.phone, phone.c_str(), 11);
+        setString(student.address, address);
+        setString(student.phone, phone);
         db.push_back(student);
         break;
       }
@@ -147,17 +508,16 @@ int main(int argc, char **argv) {
         std::cout << "Enter student id: " << std::endl;
         int id;
         std::cin >> id;
-        // find student with id
-        bool erased = false;
-        for (int i = 0; i < db.size(); i++) {
-          auto student = db.get(i);
-          if (student.id == id) {
-            db.erase(i);
-            erased = true;
-            break;
+        // find and erase them together, so the index can't go stale between
+        bool found = false;
+        db.transaction([&](StudentDatabase::Txn &txn) {
+          auto studentIndex = txn.find(id);
+          found = studentIndex.has_value();
+          if (found) {
+            txn.erase(*studentIndex);
           }
-        }
-        if (!erased) {
+        });
+        if (!found) {
           std::cout << "Student not found!" << std::endl;
         }
         break;
@@ -168,21 +528,14 @@ int main(int argc, char **argv) {
         std::cin >> id;
 
         // find student with id
-        int studentIndex = -1;
-        for (int i = 0; i < db.size(); i++) {
-          auto student = db.get(i);
-          if (student.id == id) {
-            studentIndex = i;
-            break;
-          }
-        }
-
-        if (studentIndex == -1) {
+        auto studentIndex = db.find(id);
+        if (!studentIndex) {
           std::cout << "Student not found!" << std::endl;
           break;
         }
 
-        auto student = db.at(studentIndex);
+        // edit a copy, so nothing is locked while waiting for input
+        auto student = db.edit(*studentIndex);
         std::cout << "Enter student name: " << std::endl;
         std::string name;
         std::cin >> name;
@@ -192,16 +545,18 @@ int main(int argc, char **argv) {
         std::cout << "Enter student phone: " << std::endl;
         std::string phone;
         std::cin >> phone;
-        std::strncpy(student->name, name.c_str(), 51);
-        std::strncpy(student->address, address.c_str(), 251);
-        std::strncpy(student->phone, phone.c_str(), 11);
+        setString(student->name, name);
+        setString(student->address, address);
+        setString(student->phone, phone);
+        if (!student.commit()) {
+          std::cout << "Student was changed by someone else!" << std::endl;
+        }
         break;
       }
 
       case 4: {
         std::cout << "== Students ==" << std::endl;
-        for (int i = 0; i < db.size(); i++) {
-          auto student = db.get(i);
+        for (const auto &student : db.snapshot()) {
           std::cout << "Name: " << student.name << std::endl;
           std::cout << "ID: " << student.id << std::endl;
           std::cout << "Address: " << student.address << std::endl;
@@ -215,4 +570,11 @@ int main(int argc, char **argv) {
       }
     }
   }
+
+  if (checkpoint && !clean) {
+    db.checkpoint();
+  }
+  if (program.get<bool>("--stats")) {
+    std::cout << db.stats();
+  }
 }